@@ -0,0 +1,165 @@
+/*
+ * Generator of synthetic compact trace files, which are read by
+ * func_latency like the output of 'perf script --compact_format=1'.
+ * It is used by the offline benchmark, so no Intel PT is required.
+ *
+ * Each thread runs calls from "main" to "target" or to "other", and
+ * every called function calls children down to the depth. Threads are
+ * picked by a skewed weight, and trace errors cut the current call.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <cmath>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "tools/perf/include/perf/pt_compact_format.h"
+
+using namespace std;
+
+#define GEN_TARGET "target"
+#define GEN_FANOUT 2
+#define GEN_TID_BASE 1000
+/* code of lost trace data */
+#define GEN_ERROR_CODE 8
+
+struct GenOption {
+  uint32_t threads;
+  uint64_t calls;
+  uint32_t depth;
+  double target_freq;
+  double error_rate;
+  double skew;
+  string output;
+};
+
+class CompactGenerator {
+public:
+  CompactGenerator(GenOption &o, FILE *f)
+    : opt(o), fp(f), ts(1000000000ULL), rng(20240601), actions(0) {}
+
+  void run() {
+    // weight of thread i is 1 / (i + 1)^skew
+    vector<double> weights;
+    for (uint32_t i = 0; i < opt.threads; ++i)
+      weights.push_back(1.0 / pow(i + 1, opt.skew));
+    discrete_distribution<uint32_t> pick_thread(weights.begin(), weights.end());
+    uniform_real_distribution<double> prob(0, 1);
+
+    uint64_t total = opt.calls * opt.threads;
+    for (uint64_t i = 0; i < total; ++i) {
+      uint32_t tid = GEN_TID_BASE + pick_thread(rng);
+      bool is_target = prob(rng) < opt.target_freq;
+      gen_call(tid, "main", 0, is_target ? GEN_TARGET : "other", 0);
+    }
+  }
+  uint64_t get_actions() { return actions; }
+
+private:
+  uint32_t get_symbol(const string &name, uint32_t offset) {
+    string key = name + "+" + to_string(offset);
+    auto it = symbols.find(key);
+    if (it != symbols.end())
+      return it->second;
+    uint32_t id = symbols.size();
+    if (!funcs.count(name))
+      funcs[name] = 0x400000 + funcs.size() * 0x1000;
+    pt_fwrite_symbol_action(fp, id, funcs[name] + offset, offset, name.c_str());
+    symbols[key] = id;
+    return id;
+  }
+
+  void branch(uint32_t tid, uint8_t type, const string &from, uint32_t from_off,
+              const string &to, uint32_t to_off) {
+    uint32_t from_id = get_symbol(from, from_off);
+    uint32_t to_id = get_symbol(to, to_off);
+    ts += 5 + rng() % 50;
+    pt_fwrite_branch_action(fp, tid, ts, type, from_id, to_id);
+    ++actions;
+  }
+
+  /* return false if the call is cut by trace error */
+  bool gen_call(uint32_t tid, const string &caller, uint32_t site,
+                const string &callee, uint32_t level) {
+    uint32_t call_off = 0x10 + site * 0x10;
+    branch(tid, PT_ACTION_CALL, caller, call_off, callee, 0);
+    if (opt.error_rate > 0 &&
+        uniform_real_distribution<double>(0, 1)(rng) < opt.error_rate) {
+      ts += 1000;
+      pt_fwrite_error_action(fp, tid, ts, GEN_ERROR_CODE);
+      ++actions;
+      return false;
+    }
+    if (level < opt.depth) {
+      for (uint32_t i = 0; i < GEN_FANOUT; ++i) {
+        string child = "func_" + to_string(level) + "_" + to_string(rng() % 4);
+        if (!gen_call(tid, callee, i, child, level + 1))
+          return false;
+      }
+    }
+    // a long tail of self time
+    ts += (uint64_t)exponential_distribution<double>(0.01)(rng);
+    branch(tid, PT_ACTION_RETURN, callee, 0x100, caller, call_off + 5);
+    return true;
+  }
+
+  GenOption &opt;
+  FILE *fp;
+  uint64_t ts;
+  mt19937_64 rng;
+  uint64_t actions;
+  map<string, uint32_t> symbols;
+  map<string, uint64_t> funcs;
+};
+
+static void usage() {
+  printf(
+    "usage ./gen_compact [-t threads] [-n calls] [-d depth] [-f target_freq]\n"
+    "                    [-e error_rate] [-s skew] -o file\n"
+    "\t-t --- number of threads, 4 by default\n"
+    "\t-n --- top-level calls of each thread on average, 100000 by default\n"
+    "\t-d --- depth of children below each call, 3 by default\n"
+    "\t-f --- frequency of calls to the target function 'target', 0.5 by default\n"
+    "\t-e --- rate of trace errors of each call, 0.0001 by default\n"
+    "\t-s --- skew of calls among threads, 0 for the same weight, 1 by default\n"
+    "\t-o --- output compact file\n"
+  );
+}
+
+int main(int argc, char *argv[]) {
+  GenOption opt = {4, 100000, 3, 0.5, 0.0001, 1.0, ""};
+  int c;
+  while (-1 != (c = getopt(argc, argv, "ht:n:d:f:e:s:o:"))) {
+    switch (c) {
+      case 't': opt.threads = atol(optarg); break;
+      case 'n': opt.calls = atoll(optarg); break;
+      case 'd': opt.depth = atol(optarg); break;
+      case 'f': opt.target_freq = atof(optarg); break;
+      case 'e': opt.error_rate = atof(optarg); break;
+      case 's': opt.skew = atof(optarg); break;
+      case 'o': opt.output = optarg; break;
+      default: usage(); exit(0);
+    }
+  }
+  if (opt.output == "" || opt.threads == 0) {
+    usage();
+    exit(1);
+  }
+
+  FILE *fp = fopen(opt.output.c_str(), "w");
+  if (!fp) {
+    printf("ERROR: Failed to open %s\n", opt.output.c_str());
+    exit(1);
+  }
+  CompactGenerator gen(opt, fp);
+  gen.run();
+  long size = ftell(fp);
+  fclose(fp);
+  printf("[ generated %lu actions of %u threads, %.2f MB in %s ]\n",
+         gen.get_actions(), opt.threads, size / 1048576.0, opt.output.c_str());
+  return 0;
+}
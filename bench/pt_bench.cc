@@ -0,0 +1,194 @@
+/*
+ * Offline microbenchmarks of the func_latency analysis pipeline, on a
+ * compact file of gen_compact. The jobs of func_latency.cc are used as
+ * they are, so its source is included with its main renamed.
+ */
+#define main func_latency_main
+#include "src/func_latency.cc"
+#undef main
+
+#include <random>
+#include <functional>
+
+#define BENCH_TARGET "target"
+/* text lines are slow to parse, use a part of actions */
+#define BENCH_TEXT_LINES 1000000
+
+struct BenchResult {
+  const char *name;
+  uint64_t items;
+  uint64_t bytes;
+  double seconds;
+};
+
+static void print_result(BenchResult &r) {
+  printf("%-28s %12lu items %10.2f s %10.2f Mitems/s", r.name, r.items,
+         r.seconds, r.seconds > 0 ? r.items / r.seconds / 1e6 : 0);
+  if (r.bytes)
+    printf(" %10.2f MB/s", r.seconds > 0 ? r.bytes / r.seconds / 1048576 : 0);
+  printf("\n");
+}
+
+/* run the function for some rounds, and keep the fastest one */
+template <typename Func>
+static BenchResult bench(const char *name, int rounds, Func f) {
+  BenchResult best = {name, 0, 0, 0};
+  for (int i = 0; i < rounds; ++i) {
+    BenchResult r = {name, 0, 0, 0};
+    auto t1 = ut_time_now();
+    f(r);
+    auto t2 = ut_time_now();
+    r.seconds = ut_time_diff(t2, t1);
+    if (i == 0 || r.seconds < best.seconds)
+      best = r;
+  }
+  print_result(best);
+  return best;
+}
+
+static vector<unsigned char> read_file(const string &filename) {
+  ifstream ifs(filename, ios::binary);
+  return vector<unsigned char>(istreambuf_iterator<char>(ifs),
+                               istreambuf_iterator<char>());
+}
+
+/* text line of action in the format of perf script */
+static string action_to_string(Action &action) {
+  static const char *types[] = {"call", "return"};
+  char line[1024];
+  snprintf(line, 1024, "%8d [001] %lu.%09lu:   %-8s %lx %s+0x%x =>   %lx %s+0x%x",
+           action.tid, action.ts / NSECS_PER_SECS, action.ts % NSECS_PER_SECS,
+           types[action.type == PT_ACTION_RETURN], action.from->addr,
+           action.from->name.c_str(), action.from->offset, action.to->addr,
+           action.to->name.c_str(), action.to->offset);
+  return line;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("usage ./pt_bench compact_file [rounds]\n");
+    exit(1);
+  }
+  string filename = argv[1];
+  int rounds = argc > 2 ? atol(argv[2]) : 3;
+  vector<unsigned char> data = read_file(filename);
+  if (data.empty()) {
+    printf("ERROR: Failed to read %s\n", filename.c_str());
+    exit(1);
+  }
+
+  param.compact_format = true;
+  param.target = BENCH_TARGET;
+  param.targets = {BENCH_TARGET};
+  target_idx_map[BENCH_TARGET] = 0;
+
+  /* 1. decode the compact file in memory */
+  auto loop_binary = [&](SymbolMgr &sym_mgr, function<void(Action &)> f) {
+    for (size_t off = 0; off < data.size(); off += PT_FILE_BLOCK_SIZE) {
+      unsigned char *ptr = data.data() + off;
+      unsigned char *end_ptr = data.data() +
+          std::min(data.size(), off + PT_FILE_BLOCK_SIZE);
+      Action action;
+      while (ptr && ptr < end_ptr) {
+        ptr = create_action_from_binary(action, sym_mgr, ptr);
+        if (ptr && action.pt_type == PT_ACTION_TYPE_BRANCH)
+          f(action);
+      }
+    }
+  };
+  bench("create_action_from_binary", rounds, [&](BenchResult &r) {
+    SymbolMgr sym_mgr;
+    loop_binary(sym_mgr, [&](Action &action) { ++r.items; });
+    r.bytes = data.size();
+  });
+
+  /* 2. parse the same actions in the text format of perf script */
+  vector<string> lines;
+  SymbolMgr text_sym_mgr;
+  loop_binary(text_sym_mgr, [&](Action &action) {
+    if (lines.size() < BENCH_TEXT_LINES)
+      lines.push_back(action_to_string(action));
+  });
+  bench("create_action_from_string", rounds, [&](BenchResult &r) {
+    SymbolMgr sym_mgr;
+    Action action;
+    for (string &line : lines) {
+      create_action_from_string(action, sym_mgr, line);
+      r.bytes += line.size() + 1;
+    }
+    r.items = lines.size();
+  });
+
+  /* 3. decode and group actions by thread in parse job */
+  vector<ParseJob *> parse_jobs;
+  bench("ParseJob::decode_to_actions", rounds, [&](BenchResult &r) {
+    for (ParseJob *job : parse_jobs)
+      delete job;
+    parse_jobs = {new ParseJob(filename, 0, 0, 0)};
+    parse_jobs[0]->exec();
+    parse_jobs[0]->loop_parsed_actions([&](ActionSet &as) {
+      r.items += as.size();
+    });
+    r.bytes = data.size();
+  });
+
+  vector<int> tids;
+  parse_jobs[0]->loop_parsed_actions([&](ActionSet &as) {
+    tids.push_back(as.tid);
+  });
+  std::sort(tids.begin(), tids.end());
+
+  /* 4. merge actions of each thread from parse jobs */
+  vector<ThreadJob *> thread_jobs;
+  bench("ThreadJob::extract_actions", rounds, [&](BenchResult &r) {
+    for (ThreadJob *job : thread_jobs)
+      delete job;
+    thread_jobs.clear();
+    for (int tid : tids) {
+      thread_jobs.push_back(new ThreadJob(tid, &parse_jobs));
+      thread_jobs.back()->extract_actions();
+      r.items += parse_jobs[0]->parsed_actions_num(tid) +
+                 parse_jobs[0]->error_actions_num(tid);
+    }
+  });
+
+  /* 5. analyze target function of each thread */
+  vector<FuncStat::Option> stat_opts = get_stat_options();
+  bench("ThreadJob::do_analyze", rounds, [&](BenchResult &r) {
+    for (size_t i = 0; i < thread_jobs.size(); ++i) {
+      thread_jobs[i]->init_stat(stat_opts);
+      thread_jobs[i]->do_analyze(0);
+      r.items += parse_jobs[0]->parsed_actions_num(tids[i]) +
+                 parse_jobs[0]->error_actions_num(tids[i]);
+    }
+  });
+
+  /* 6. latency histogram */
+  vector<uint64_t> lats(10000000);
+  std::mt19937_64 rng(1);
+  for (uint64_t &lat : lats)
+    lat = rng() % (1ULL << (rng() % 40));
+  bench("Distribution::assign_slot", rounds, [&](BenchResult &r) {
+    Distribution dist;
+    for (uint64_t lat : lats)
+      dist.assign_slot(lat);
+    r.items = dist.get_count();
+  });
+
+  /* 7. merge stats of threads */
+  bench("FuncStat::merge", rounds, [&](BenchResult &r) {
+    for (int i = 0; i < 10000; ++i) {
+      FuncStat stat(stat_opts[0], &srcline_map);
+      for (ThreadJob *job : thread_jobs) {
+        stat.merge(job->get_stat(0));
+        ++r.items;
+      }
+    }
+  });
+
+  for (ThreadJob *job : thread_jobs)
+    delete job;
+  for (ParseJob *job : parse_jobs)
+    delete job;
+  return 0;
+}
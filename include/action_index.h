@@ -0,0 +1,135 @@
+#ifndef _h_action_index_
+#define _h_action_index_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstring>
+#include "sys_tools.h"
+#include "pt_action.h"
+
+namespace pt {
+/*
+ * Index of decoded actions, saved in the result directory for repeated
+ * queries. Each thread has one file of time-sorted actions, stored by
+ * column: timestamps, from/to symbol ids and types in separate arrays,
+ * with a sparse time index of every ACTION_INDEX_SPARSE_STEP actions.
+ * Symbols of all threads are in one symbol table. All branches are kept,
+ * including jumps inside target functions, so that queries of any option
+ * (eg, code blocks by -c) can be answered by the index.
+ */
+#define ACTION_INDEX_DIR "action_index"
+#define ACTION_INDEX_SYMBOLS "symbols"
+#define ACTION_INDEX_SUFFIX ".col"
+#define ACTION_INDEX_MAGIC_V0 0x31584449544e4950ULL /* "PINTIDX1", no version */
+#define ACTION_INDEX_MAGIC 0x32584449544e4950ULL /* "PINTIDX2" */
+/* version of the index layout and content, bump it when either changes */
+#define ACTION_INDEX_VERSION 1
+#define ACTION_INDEX_SPARSE_STEP 4096
+/* type column flag of trace error action */
+#define ACTION_INDEX_ERROR 0x80
+#define ACTION_INDEX_NO_SYMBOL UINT32_MAX
+
+struct ActionIndexHeader {
+  uint64_t magic;
+  uint64_t version;
+  int64_t tid;
+  uint64_t count;
+  uint64_t sparse_step;
+  uint64_t sparse_count;
+  /* file offsets of columns */
+  uint64_t ts_off;
+  uint64_t from_off;
+  uint64_t to_off;
+  uint64_t type_off;
+  uint64_t sparse_off;
+};
+
+class ActionIndexWriter {
+public:
+  ActionIndexWriter(const std::string &d) : dir(d) {}
+  /* add symbols of one symbol manager, not thread-safe */
+  void add_symbols(SymbolMgr &sym_mgr);
+  bool write_symbols();
+  /* write time-sorted actions of one thread, thread-safe */
+  bool write_thread(long tid, std::vector<Action> &actions);
+private:
+  uint32_t get_id(const Symbol *sym) {
+    auto it = sym_ids.find(sym);
+    return it != sym_ids.end() ? it->second : ACTION_INDEX_NO_SYMBOL;
+  }
+  std::string dir;
+  std::vector<const Symbol *> symbols;
+  std::unordered_map<std::string, uint32_t> sym_keys;
+  std::unordered_map<const Symbol *, uint32_t> sym_ids;
+};
+
+class ActionIndexReader {
+public:
+  ActionIndexReader() : base(nullptr), size(0), hdr(nullptr) {}
+  ~ActionIndexReader() { close(); }
+
+  static bool load_symbols(const std::string &dir, SymbolMgr &sym_mgr);
+  static std::vector<long> list_threads(const std::string &dir);
+  static std::string thread_file(const std::string &dir, long tid) {
+    return dir + "/" + std::to_string(tid) + ACTION_INDEX_SUFFIX;
+  }
+
+  bool open(const std::string &filename);
+  void close();
+
+  /* read actions with timestamp in [start, end], only the pages of
+   * columns in the range are touched, return the bytes of them */
+  template <typename InitActionFunc>
+  size_t read_actions(SymbolMgr &sym_mgr, uint64_t start, uint64_t end,
+                      InitActionFunc init_func) {
+    if (!hdr) return 0;
+    const uint64_t *ts = column<uint64_t>(hdr->ts_off);
+    const uint32_t *from = column<uint32_t>(hdr->from_off);
+    const uint32_t *to = column<uint32_t>(hdr->to_off);
+    const uint8_t *type = column<uint8_t>(hdr->type_off);
+    size_t sym_count = sym_mgr.id_count();
+    size_t i = lower_bound(start), first = i;
+    for (; i < hdr->count && ts[i] <= end; ++i) {
+      Action action;
+      action.tid = hdr->tid;
+      action.ts = ts[i];
+      action.from_target = action.to_target = false;
+      if (type[i] & ACTION_INDEX_ERROR) {
+        action.pt_type = PT_ACTION_TYPE_ERROR;
+        action.is_error = true;
+        action.type = type[i] & ~ACTION_INDEX_ERROR;
+        action.from = action.to = nullptr;
+      } else {
+        // skip the branch of symbol not in the symbol table
+        if (from[i] >= sym_count || to[i] >= sym_count)
+          continue;
+        action.pt_type = PT_ACTION_TYPE_BRANCH;
+        action.is_error = false;
+        action.type = type[i];
+        action.from = sym_mgr.get_by_id(from[i]);
+        action.to = sym_mgr.get_by_id(to[i]);
+      }
+      init_func(action);
+    }
+    return (i - first) * (sizeof(*ts) + sizeof(*from) + sizeof(*to) + sizeof(*type));
+  }
+private:
+  template <typename T>
+  const T *column(uint64_t off) {
+    return reinterpret_cast<const T *>(base + off);
+  }
+  /* if the column of n elements at off is in the file */
+  bool check_column(uint64_t off, uint64_t n, size_t width) {
+    return off <= size && n <= (size - off) / width;
+  }
+  /* first action with timestamp not less than ts */
+  size_t lower_bound(uint64_t ts);
+
+  unsigned char *base;
+  size_t size;
+  const ActionIndexHeader *hdr;
+};
+};
+
+#endif
@@ -2,19 +2,37 @@
 #define _h_func_latency_
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <unordered_map>
 
 #include "stat_tools.h"
 #include "worker.h"
 #include "pt_action.h"
+#include "action_index.h"
+#include "trace_export.h"
+#include "self_profile.h"
 
 using namespace pt;
 
+/* snapshot of aggregated stats in continuous mode */
+#define CONTINUOUS_SNAPSHOT "snapshot.shard"
+/* children of target shown in each report of progress */
+#define PROGRESS_TOP_CHILDREN 5
+/* levels of ancestor path at most */
+#define ANCESTOR_MAX_LEVELS 16
+
+/* one level of ancestor path, its calls are within the latency interval */
+struct AncestorLevel {
+  std::string name;
+  std::pair<uint64_t, uint64_t> latency;
+};
+
 struct Param {
   std::string perf_tool;
   std::string perf_dlfilter;
   std::string binary;
   std::string target;
+  std::vector<std::string> targets;
   float trace_time;
   long pid;
   std::string tid;
@@ -23,20 +41,47 @@ struct Param {
   bool parallel_script;
   bool per_thread_mode;
   size_t worker_num;
+  size_t script_files;
   bool ip_filtering;
   std::string func_idx;
   bool offcpu;
   bool call_line;
   std::string pt_config;
   bool compact_format;
+  bool unordered_queues;
+  bool threaded_script;
+  std::string insn_cache_dir;
+  bool build_index;
+  bool interactive;
+  std::string shard_file;
+  std::string chrome_trace;
+  /* profile of func_latency itself, JSON summary and chrome trace */
+  std::string self_profile;
+  std::string self_trace;
+  /* continuous mode, seconds between windows and number of windows */
+  float continuous_period;
+  uint32_t continuous_windows;
 
+  /* ancestor path of target, "name[#min,max]>name[#min,max]..." */
   std::string ancestor;
-  std::pair<uint64_t, uint64_t> ancestor_latency;
+  std::vector<AncestorLevel> ancestors;
 
   bool code_block;
+  uint32_t cct_depth;
+  uint32_t caller_depth;
+  uint32_t top_k;
+  /* percentiles of typical and slow calls to compare */
+  std::pair<double, double> cohort;
 
   bool timeline;
   uint32_t timeline_unit;
+  uint32_t heatmap;
+  /* callers and children to keep by heavy hitters, 0 for all */
+  uint32_t max_keys;
+  /* analyze one of every N invocations of target, 0 or 1 for all */
+  uint32_t sample;
+  /* seconds between the reports of progress, 0 for no report */
+  double progress;
   std::pair<uint64_t, uint64_t> latency_interval;
   std::pair<uint64_t, uint64_t> time_interval;
   uint64_t time_start;
@@ -59,18 +104,22 @@ extern Param param;
 class ParseJob : public ParallelJob {
 public:
   ParseJob(const std::string &name, uint32_t f, uint32_t t, uint32_t i) 
-    : filename(name), from(f), to(t), id(i) {}
+    : filename(name), from(f), to(t), id(i), decoded(0), bytes(0),
+      read_bytes(0) {}
 
   void exec() override {
     decode_to_actions();
     sort_actions();
   }
+  const char *job_name() override { return "parse"; }
+  uint64_t job_items() override { return decoded; }
+  uint64_t job_bytes() override { return bytes; }
 
-  void add_action(Action &a) {
+  void add_action(Action &a, bool is_target) {
     ActionSet &as = parsed_actions[a.tid];
     as.tid = a.tid;
     as.add_action(a);
-    if (a.from_target || a.to_target)
+    if (is_target)
       ++as.target;
   }
 
@@ -129,6 +178,10 @@ public:
       f(it->second);
     }
   }
+  SymbolMgr &get_sym_mgr() { return sym_mgr; }
+  const std::string &get_filename() { return filename; }
+  /* bytes read so far, updated while decoding */
+  size_t get_read_bytes() { return read_bytes.load(std::memory_order_relaxed); }
   friend class ThreadJob;
 
 private:
@@ -137,6 +190,10 @@ private:
   uint32_t to;
   uint32_t total;
   uint32_t id;
+  /* branch and error actions decoded, and bytes read */
+  uint64_t decoded;
+  uint64_t bytes;
+  std::atomic<size_t> read_bytes;
 
   // store decoded acitions grouped by thread
   std::unordered_map<long, ActionSet> parsed_actions;
@@ -151,29 +208,113 @@ private:
 class ThreadJob : public ParallelJob {
 public:
   ThreadJob(long t, std::vector<ParseJob *> * ptr)
-    : tid(t), parse_jobs_ptr(ptr) {}
+    : tid(t), parse_jobs_ptr(ptr), extracted(false), done(false),
+      cohort_pass(false) {}
 
   void exec() override {
-    extract_actions();
-    do_analyze();
+    // actions are kept for the queries of interactive mode
+    if (!extracted) {
+      extract_actions();
+      extracted = true;
+    }
+    if (param.interactive)
+      mark_ancestor();
+    if (param.chrome_trace != "" && !cohort_pass)
+      trace_writer.reset(new ChromeTraceWriter(param.chrome_trace, tid));
+    for (size_t i = 0; i < stats.size(); ++i) {
+      if (stats.size() > 1 || param.interactive)
+        mark_target(i);
+      do_analyze(i);
+      if (cohort_pass)
+        continue;
+      if (param.cct_depth > 0)
+        build_call_tree(i);
+      if (param.caller_depth > 0)
+        build_caller_tree(i);
+    }
+    trace_writer.reset();
+    done.store(true, std::memory_order_release);
   }
+  const char *job_name() override { return "thread"; }
+  uint64_t job_items() override { return actions.size(); }
 
   long get_tid() { return tid; }
   void set_tid(long t) { tid = t; }
   void extract_actions();
-  void do_analyze();
+  void mark_target(size_t idx);
+  void mark_ancestor();
+  std::vector<bool> pair_ancestors();
+  void do_analyze(size_t idx);
+  void build_call_tree(size_t idx);
+  void build_caller_tree(size_t idx);
+  bool is_target_call(size_t i) {
+    return std::binary_search(target_calls.begin(), target_calls.end(), i);
+  }
 
-  void init_stat(FuncStat::Option &opt) {
-    stat.opt = opt;
+  /* one stat for each target function */
+  void init_stat(std::vector<FuncStat::Option> &opts) {
+    done.store(false);
+    cohort_pass = false;
+    stats.clear();
+    stats.resize(opts.size());
+    for (size_t i = 0; i < opts.size(); ++i) {
+      stats[i].opt = opts[i];
+      stats[i].set_max_keys();
+    }
+  }
+  /* the second pass of cohort only runs do_analyze with the thresholds
+   * of cohorts, the trees of the first pass are kept */
+  void init_cohort(std::vector<FuncStat::Option> &opts) {
+    done.store(false);
+    cohort_pass = true;
+    for (size_t i = 0; i < opts.size(); ++i) {
+      FuncStat stat;
+      stat.opt = opts[i];
+      stat.set_max_keys();
+      std::swap(stat.cct, stats[i].cct);
+      std::swap(stat.caller_tree, stats[i].caller_tree);
+      stats[i] = std::move(stat);
+    }
   }
-  FuncStat &get_stat() { return stat; }
+  FuncStat &get_stat(size_t idx = 0) { return stats[idx]; }
+  /* if the stats are analyzed and not changed by the job any more */
+  bool is_done() { return done.load(std::memory_order_acquire); }
 
-private:
+protected:
   std::vector<ParseJob *> *parse_jobs_ptr;
   std::vector<Action> actions;
+  bool extracted;
+  std::atomic_bool done;
+  bool cohort_pass;
 
-  FuncStat stat;
+  std::vector<FuncStat> stats;
+  /* index of target calls counted by the last do_analyze, ascending */
+  std::vector<size_t> target_calls;
   long tid;
+  /* events of target calls for chrome trace */
+  std::unique_ptr<ChromeTraceWriter> trace_writer;
+};
+
+/* write all actions of one thread to the action index */
+class IndexBuildJob : public ThreadJob {
+public:
+  IndexBuildJob(long t, std::vector<ParseJob *> *ptr, ActionIndexWriter *w)
+    : ThreadJob(t, ptr), writer(w), failed(false), written(0) {}
+
+  void exec() override {
+    extract_actions();
+    written = actions.size();
+    failed = !writer->write_thread(tid, actions);
+    std::vector<Action>().swap(actions);
+  }
+  const char *job_name() override { return "index"; }
+  uint64_t job_items() override { return written; }
+  bool is_failed() { return failed; }
+
+private:
+  ActionIndexWriter *writer;
+  bool failed;
+  size_t written;
 };
 
 #endif
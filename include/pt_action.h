@@ -2,6 +2,7 @@
 #define _h_pt_action_
 
 #include <shared_mutex>
+#include <atomic>
 #include <assert.h>
 #include <algorithm>
 #include <unordered_map>
@@ -9,10 +10,16 @@
 #include "tools/perf/include/perf/pt_compact_format.h"
 
 namespace pt {
+/* bytes read between the updates of progress */
+#define PT_PROGRESS_BYTES (1 << 20)
+#define SYMBOL_TARGET_UNKNOWN -2
+#define SYMBOL_NOT_TARGET -1
 struct Symbol {
   std::string name;
   uint64_t addr;
   uint32_t offset;
+  int target_idx = SYMBOL_TARGET_UNKNOWN; // index in target functions
+  int ancestor_idx = SYMBOL_TARGET_UNKNOWN; // level in ancestor path
   bool equal(struct Symbol *sym) {
     uint64_t func_addr1 = addr - offset;
     uint64_t func_addr2 = sym->addr - sym->offset;
@@ -55,6 +62,15 @@ public:
   }
 
   Symbol *get_by_id(uint64_t sym_id) { return m_vec[sym_id]; }
+  /* number of symbols created by id */
+  size_t id_count() { return m_vec.size(); }
+  template <typename Func>
+  void loop_symbols(Func f) {
+    for (auto it = m_map.begin(); it != m_map.end(); ++it)
+      f(it->second);
+    for (Symbol *sym : m_vec)
+      f(sym);
+  }
 private:
   std::unordered_map<uint64_t, Symbol*> m_map;
   std::vector<Symbol *> m_vec;
@@ -71,6 +87,7 @@ public:
   bool ancestor_begin; // begin of ancestor func
   bool ancestor_end;   // end of ancestor func
   bool is_error;
+  int8_t ancestor_idx; // level of ancestor begin or end
   int tid;
   uint64_t ts; // timestamp for nanosecond
 	Symbol *from;
@@ -81,7 +98,8 @@ public:
 #endif
   void init_for_sched();
 
-  void init_for_ancestor(const std::string &ancestor);
+  /* from_idx and to_idx are the levels of symbols in ancestor path */
+  void init_for_ancestor(int from_idx, int to_idx);
 };
 
 struct ActionSet {
@@ -114,6 +132,15 @@ public:
   uint64_t get(const std::string &function);
   void put(const std::string &function, uint64_t addr);
   void process_address();
+  /* resolved srclines, for saving in stat shard */
+  void put_srcline(const std::string &function, const std::string &srcline);
+  template <typename Func>
+  void loop_srcline(Func f) {
+    m_lock.s_lock();
+    for (auto it = srcline_map.begin(); it != srcline_map.end(); ++it)
+      f(it->first, it->second);
+    m_lock.s_unlock();
+  }
 private:
   std::unordered_map<std::string, uint64_t> addr_map;
   std::unordered_map<std::string, std::string> srcline_map;
@@ -148,9 +175,12 @@ unsigned char *create_action_from_binary(Action &action,
 void report_error_action(const std::string &type, Action *action, bool verbose);
 
 template <typename InitActionFunc>
-void read_actions_from_text_file(const std::string &filename,
+size_t read_actions_from_text_file(const std::string &filename,
     uint32_t id, uint32_t from, uint32_t to, SymbolMgr &sym_mgr,
-    InitActionFunc init_func) {
+    InitActionFunc init_func, std::atomic<size_t> *progress = nullptr) {
+  /* bytes of the lines in range */
+  size_t bytes = 0;
+  size_t reported = 0;
   std::fstream ifs(filename, std::ios::in | std::ios::out);
   if (ifs.is_open()) {
     std::string line;
@@ -162,6 +192,11 @@ void read_actions_from_text_file(const std::string &filename,
         continue;
       }
       ++lnum;
+      bytes += line.size() + 1;
+      if (progress && bytes - reported >= PT_PROGRESS_BYTES) {
+        progress->fetch_add(bytes - reported, std::memory_order_relaxed);
+        reported = bytes;
+      }
       if (create_action_from_string(action,
             sym_mgr, line)) {
         /* invalid action */
@@ -175,11 +210,16 @@ void read_actions_from_text_file(const std::string &filename,
     }
     ifs.close();
   }
+  if (progress)
+    progress->fetch_add(bytes - reported, std::memory_order_relaxed);
+  return bytes;
 }
 
 template <typename InitActionFunc>
-void read_actions_from_compact_file(const std::string &filename,
-    uint32_t id, SymbolMgr &sym_mgr, InitActionFunc init_func) {
+size_t read_actions_from_compact_file(const std::string &filename,
+    uint32_t id, SymbolMgr &sym_mgr, InitActionFunc init_func,
+    std::atomic<size_t> *progress = nullptr) {
+  size_t bytes = 0;
   std::ifstream ifs(filename, std::ios::binary);
   unsigned char buffer[PT_FILE_BLOCK_SIZE];
   if (ifs.is_open()) {
@@ -187,6 +227,9 @@ void read_actions_from_compact_file(const std::string &filename,
     while (!ifs.eof()) {
       ifs.read((char *)buffer, PT_FILE_BLOCK_SIZE);
       auto len = ifs.gcount();
+      bytes += len;
+      if (progress)
+        progress->fetch_add(len, std::memory_order_relaxed);
       unsigned char *ptr = buffer;
       unsigned char *end_ptr = buffer + len;
       Action action;
@@ -202,6 +245,7 @@ void read_actions_from_compact_file(const std::string &filename,
     }
     ifs.close(); 
   }
+  return bytes;
 }
 };
 
@@ -5,6 +5,8 @@
 #include "sys_tools.h"
 
 #define SCRIPT_FILE_PREFIX "script_out"
+// parallel script splits the trace into more chunks than workers
+#define SCRIPT_CHUNKS_PER_WORKER 4
 
 struct PerfOption {
   std::string binary;
@@ -23,7 +25,11 @@ struct PerfOption {
   std::string fields;
   std::string itrace;
   size_t worker_num;
+  size_t script_files;
   bool compact_format;
+  bool unordered_queues;
+  bool threaded_script;
+  std::string insn_cache_dir;
   std::string sub_command;
 
   int history;
@@ -35,6 +41,7 @@ void perf_script(PerfOption &opt);
 
 void clear_record_files();
 void clear_script_files();
+size_t count_script_files();
 
 struct FlameGraphOption {
   std::string type;
@@ -43,6 +50,7 @@ struct FlameGraphOption {
 
   bool parallel_script;
   size_t worker_num;
+  size_t script_files;
 
   bool verbose;
 };
@@ -0,0 +1,46 @@
+#ifndef _h_self_profile_
+#define _h_self_profile_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "worker.h"
+
+namespace pt {
+/*
+ * Profile of func_latency itself: wall time, CPU time and peak RSS of
+ * each phase, with the jobs that the worker pool executed in it. Each
+ * job has its worker, queue wait, start and end time, and the items and
+ * bytes it processed, so stragglers and idle workers can be found.
+ *
+ * It is written as a JSON summary, and optionally as a Chrome trace with
+ * one track for each worker.
+ */
+class SelfProfiler {
+public:
+  SelfProfiler() : pool(nullptr), origin(0) {}
+  void enable(ParallelWorkerPool *p);
+  bool is_enabled() { return pool != nullptr; }
+
+  /* phases are not nested, the jobs of the pool are kept by phase */
+  void begin_phase(const char *name);
+  void end_phase();
+
+  bool write_summary(const std::string &file);
+  bool write_trace(const std::string &file);
+private:
+  struct Phase {
+    std::string name;
+    uint64_t start;
+    uint64_t end;
+    double cpu_time;
+    uint64_t peak_rss;
+    std::vector<JobProfile> jobs;
+  };
+  ParallelWorkerPool *pool;
+  uint64_t origin;
+  std::vector<Phase> phases;
+};
+};
+
+#endif
@@ -4,28 +4,117 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <cstring>
+#include <memory>
+#include <fstream>
 
 #include "sys_tools.h"
 #include "pt_action.h"
 
 #define INTEGER_TEN_ZEROS 10000000000UL
 
+/* binary writer and reader of stat shard file */
+#define STAT_SHARD_MAGIC_V0 0x3144524148535450ULL /* "PTSHARD1", no version */
+#define STAT_SHARD_MAGIC 0x3244524148535450ULL /* "PTSHARD2" */
+/* version of the shard layout, bump it when any saved stat changes */
+#define STAT_SHARD_VERSION 1
+class ShardWriter {
+public:
+  ShardWriter(const std::string &filename) : ofs(filename, std::ios::binary) {}
+  bool good() { return ofs.good(); }
+  void put_u64(uint64_t v) { ofs.write((const char *)&v, sizeof(v)); }
+  void put_str(const std::string &str) {
+    put_u64(str.size());
+    ofs.write(str.data(), str.size());
+  }
+  void put_u32s(const std::vector<uint32_t> &vec) {
+    put_u64(vec.size());
+    ofs.write((const char *)vec.data(), vec.size() * sizeof(uint32_t));
+  }
+  bool close() {
+    ofs.close();
+    return ofs.good();
+  }
+private:
+  std::ofstream ofs;
+};
+
+class ShardReader {
+public:
+  ShardReader(const std::string &filename)
+    : ifs(filename, std::ios::binary | std::ios::ate), size(0) {
+    if (ifs.good()) {
+      size = ifs.tellg();
+      ifs.seekg(0);
+    }
+  }
+  bool good() { return ifs.good(); }
+  uint64_t get_u64() {
+    uint64_t v = 0;
+    ifs.read((char *)&v, sizeof(v));
+    return v;
+  }
+  /* length of the following items of 'unit' bytes, a length beyond the
+   * rest of file fails the reader instead of a huge allocation */
+  uint64_t get_len(size_t unit) {
+    uint64_t len = get_u64();
+    if (!good())
+      return 0;
+    uint64_t pos = ifs.tellg();
+    if (len > (size - pos) / unit) {
+      ifs.setstate(std::ios::failbit);
+      return 0;
+    }
+    return len;
+  }
+  std::string get_str() {
+    std::string str(get_len(1), '\0');
+    if (good())
+      ifs.read(&str[0], str.size());
+    return str;
+  }
+  std::vector<uint32_t> get_u32s() {
+    std::vector<uint32_t> vec(get_len(sizeof(uint32_t)));
+    if (good())
+      ifs.read((char *)vec.data(), vec.size() * sizeof(uint32_t));
+    return vec;
+  }
+private:
+  std::ifstream ifs;
+  uint64_t size;
+};
+
+/* key of the keys folded by max_keys */
+#define BUCKET_OTHERS "[others]"
+
 class HistogramBucket;
+/*
+ * Values by key. With max_keys, it is a Space-Saving sketch of heavy
+ * hitters by total: when there are twice max_keys keys, the keys beyond
+ * the top max_keys (by total + err) are folded into BUCKET_OTHERS, so
+ * the sum of all keys keeps exact. A key added later may have been
+ * folded before, its err is the largest folded total at that time, which
+ * bounds the total it misses. A key with more than 1/max_keys of the sum
+ * is never folded.
+ */
 class Bucket {
 public:
-  Bucket() : val_name(""), width(10) {}
-  Bucket(const std::string &name) : val_name(name), width(10) {}
+  Bucket() : val_name(""), width(10), max_keys(0), evict_floor(0) {}
+  Bucket(const std::string &name)
+    : val_name(name), width(10), max_keys(0), evict_floor(0) {}
   struct Element {
     std::string name;
     uint64_t count;
     uint64_t total;
+    /* upper bound of the total missed by max_keys */
+    uint64_t err;
     double scale;
     std::string val_str;
     std::string err_msg;
     int width;
-    Element() : count(0), total(0), scale(0.0),
+    Element() : count(0), total(0), err(0), scale(0.0),
                 val_str(""), err_msg(""), width(10) {}
     uint64_t get_avg() {
       if (!count) return 0;
@@ -52,10 +141,16 @@ public:
 
   typedef std::unordered_map<std::string, Element> Slot;
 
-  void add_val(const std::string &key, uint64_t val) {
-    slots[key].name = key;
-    slots[key].total += val;
-    slots[key].count++;
+  /* return true if some keys are folded */
+  bool add_val(const std::string &key, uint64_t val) {
+    Element &el = get_slot(key);
+    el.total += val;
+    el.count++;
+    if (max_keys && slots.size() > 2 * max_keys) {
+      fold_keys();
+      return true;
+    }
+    return false;
   }
   void add_val(const std::string &key, const std::string &val) {
     slots[key].name = key;
@@ -64,12 +159,26 @@ public:
       width = val.size();
     }
   }
-  void add_bucket(Bucket &b) {
+  bool add_bucket(Bucket &b) {
+    if (b.evict_floor) {
+      // keys not in b may have been folded by b
+      for (auto it = slots.begin(); it != slots.end(); ++it) {
+        if (!b.slots.count(it->first))
+          it->second.err += b.evict_floor;
+      }
+    }
     for (auto it = b.slots.begin(); it != b.slots.end(); ++it) {
-      slots[it->first].count += it->second.count;
-      slots[it->first].total += it->second.total;
-      slots[it->first].name = it->first;
+      Element &el = get_slot(it->first);
+      el.count += it->second.count;
+      el.total += it->second.total;
+      el.err += it->second.err;
+    }
+    evict_floor += b.evict_floor;
+    if (max_keys && slots.size() > 2 * max_keys) {
+      fold_keys();
+      return true;
     }
+    return false;
   }
   void sub_bucket(Bucket &b) {
     for (auto it = b.slots.begin(); it != b.slots.end(); ++it) {
@@ -113,7 +222,57 @@ public:
     printf(" %-*s", width, val_name.substr(0, width).c_str());
   }
   bool empty() { return slots.size() == 0; }
-  void clear() { slots.clear(); }
+  void clear() {
+    slots.clear();
+    evict_floor = 0;
+  }
+  void set_max_keys(uint32_t n) { max_keys = n; }
+  void scale(uint32_t n) {
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+      it->second.count *= n;
+      it->second.total *= n;
+      it->second.err *= n;
+    }
+    evict_floor *= n;
+  }
+  /* fold to max_keys by the exact total to print */
+  void trim_keys() {
+    if (max_keys && (slots.size() > max_keys || evict_floor))
+      fold_keys(true);
+  }
+  /* keys kept by trim_keys */
+  std::unordered_set<std::string> get_top_keys() { return get_top_keys(true); }
+  /* fold the keys not in keep into BUCKET_OTHERS */
+  void fold_keys_to(const std::unordered_set<std::string> &keep) {
+    fold_keys_if([&](const std::string &key) { return !keep.count(key); });
+  }
+  /* fold the keys not in b, so the rows of paired buckets match */
+  void fold_keys_like(Bucket &b) {
+    fold_keys_if([&](const std::string &key) { return !b.slots.count(key); });
+  }
+  /* if some keys are folded into BUCKET_OTHERS */
+  bool has_folded() { return evict_floor > 0 || slots.count(BUCKET_OTHERS); }
+  void save(ShardWriter &w) {
+    w.put_u64(slots.size());
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+      w.put_str(it->first);
+      w.put_u64(it->second.count);
+      w.put_u64(it->second.total);
+      w.put_u64(it->second.err);
+    }
+    w.put_u64(evict_floor);
+  }
+  void load(ShardReader &r) {
+    for (uint64_t n = r.get_len(sizeof(uint64_t)); n > 0 && r.good(); --n) {
+      std::string name = r.get_str();
+      Element &el = slots[name];
+      el.name = name;
+      el.count = r.get_u64();
+      el.total = r.get_u64();
+      el.err = r.get_u64();
+    }
+    evict_floor = r.get_u64();
+  }
 
   template<typename Func>
   void loop_for_element(Func f) {
@@ -124,9 +283,44 @@ public:
 
   friend class HistogramBucket;
 private:
+  Element &get_slot(const std::string &key) {
+    auto it = slots.find(key);
+    if (it == slots.end()) {
+      it = slots.emplace(key, Element()).first;
+      it->second.name = key;
+      it->second.err = evict_floor;
+    }
+    return it->second;
+  }
+  std::unordered_set<std::string> get_top_keys(bool by_total);
+  void fold_keys(bool by_total = false) { fold_keys_to(get_top_keys(by_total)); }
+  template<typename Func>
+  void fold_keys_if(Func folded) {
+    auto it = slots.begin();
+    while (it != slots.end() && (it->first == BUCKET_OTHERS || !folded(it->first)))
+      ++it;
+    if (it == slots.end())
+      return;
+    Element &others = get_slot(BUCKET_OTHERS);
+    others.err = 0;
+    for (it = slots.begin(); it != slots.end();) {
+      if (it->first == BUCKET_OTHERS || !folded(it->first)) {
+        ++it;
+        continue;
+      }
+      others.count += it->second.count;
+      others.total += it->second.total;
+      evict_floor = std::max(evict_floor, it->second.total + it->second.err);
+      it = slots.erase(it);
+    }
+  }
+
   Slot slots;
   std::string val_name;
   uint32_t width;
+  uint32_t max_keys;
+  /* largest total + err of the folded keys */
+  uint64_t evict_floor;
 };
 
 class HistogramBucket {
@@ -164,7 +358,7 @@ private:
 class HistogramDist;
 class Distribution {
 public:
-  Distribution() : total(0), count(0), val_max(0), val_name("") {}
+  Distribution() : total(0), count(0), val_max(0), val_name(""), total_sq(0) {}
   void assign_slot(uint64_t val);
   void merge_slots(Distribution &dist);
   void init_val_max();
@@ -177,6 +371,27 @@ public:
     return total / count;
   }
   uint32_t get_count() { return count; }
+  double get_stddev();
+  const std::vector<uint32_t> &get_slots() { return slots; }
+  /* scale counts of sampled values to estimate all values */
+  void scale(uint32_t n);
+  /* upper bound of the slot where the percentile falls in */
+  uint64_t get_percentile(double pct);
+  void save(ShardWriter &w) {
+    w.put_u64(total);
+    w.put_u64(count);
+    w.put_u32s(slots);
+    uint64_t sq;
+    memcpy(&sq, &total_sq, sizeof(sq));
+    w.put_u64(sq);
+  }
+  void load(ShardReader &r) {
+    total = r.get_u64();
+    count = r.get_u64();
+    slots = r.get_u32s();
+    uint64_t sq = r.get_u64();
+    memcpy(&total_sq, &sq, sizeof(sq));
+  }
 
   friend class HistogramDist;
 private:
@@ -185,6 +400,8 @@ private:
   uint32_t val_max;
   std::string val_name;
   std::vector<uint32_t> slots;
+  /* sum of squares for the standard deviation */
+  double total_sq;
 };
 
 class HistogramDist {
@@ -204,6 +421,112 @@ private:
   std::vector<Distribution> dists;
 };
 
+/* latency distribution of each time window, merged across threads */
+class Heatmap {
+public:
+  Heatmap() : start(0), unit(0) {}
+  bool empty() { return windows.empty(); }
+  void init(uint64_t s, uint64_t u, uint32_t num) {
+    start = s;
+    unit = u ? u : 1;
+    windows.resize(num);
+  }
+  void add(uint64_t ts, uint64_t lat) {
+    if (windows.empty() || ts < start) return;
+    size_t idx = std::min((ts - start) / unit, (uint64_t)windows.size() - 1);
+    windows[idx].assign_slot(lat);
+  }
+  void merge(Heatmap &map);
+  void scale(uint32_t n) {
+    for (Distribution &dist : windows)
+      dist.scale(n);
+  }
+  void save(ShardWriter &w) {
+    w.put_u64(start);
+    w.put_u64(unit);
+    w.put_u64(windows.size());
+    for (Distribution &dist : windows)
+      dist.save(w);
+  }
+  void load(ShardReader &r) {
+    start = r.get_u64();
+    unit = r.get_u64();
+    windows.resize(r.get_len(sizeof(uint64_t)));
+    for (Distribution &dist : windows)
+      dist.load(r);
+  }
+  void print();
+private:
+  uint64_t start;
+  /* time of each window (ns) */
+  uint64_t unit;
+  std::vector<Distribution> windows;
+};
+
+/* node of the calling-context tree below target function,
+ * or of the caller path tree above it */
+struct CallTreeNode {
+  uint64_t count;
+  /* latency with and without children in the tree */
+  uint64_t incl;
+  uint64_t excl;
+  /* schedule time with and without children in the tree */
+  uint64_t sched_incl;
+  uint64_t sched_excl;
+  std::unordered_map<std::string, std::unique_ptr<CallTreeNode>> children;
+  CallTreeNode() : count(0), incl(0), excl(0), sched_incl(0), sched_excl(0) {}
+
+  CallTreeNode *get_child(const std::string &name) {
+    std::unique_ptr<CallTreeNode> &child = children[name];
+    if (!child)
+      child.reset(new CallTreeNode());
+    return child.get();
+  }
+  void merge(CallTreeNode &node) {
+    count += node.count;
+    incl += node.incl;
+    excl += node.excl;
+    sched_incl += node.sched_incl;
+    sched_excl += node.sched_excl;
+    for (auto &it : node.children) {
+      get_child(it.first)->merge(*it.second);
+    }
+  }
+  /* estimate the tree of all calls from 1/n of them */
+  void scale(uint32_t n) {
+    count *= n;
+    incl *= n;
+    excl *= n;
+    sched_incl *= n;
+    sched_excl *= n;
+    for (auto &it : children)
+      it.second->scale(n);
+  }
+  void save(ShardWriter &w) {
+    w.put_u64(count);
+    w.put_u64(incl);
+    w.put_u64(excl);
+    w.put_u64(sched_incl);
+    w.put_u64(sched_excl);
+    w.put_u64(children.size());
+    for (auto &it : children) {
+      w.put_str(it.first);
+      it.second->save(w);
+    }
+  }
+  void load(ShardReader &r) {
+    count = r.get_u64();
+    incl = r.get_u64();
+    excl = r.get_u64();
+    sched_incl = r.get_u64();
+    sched_excl = r.get_u64();
+    for (uint64_t n = r.get_len(sizeof(uint64_t)); n > 0 && r.good(); --n) {
+      std::string name = r.get_str();
+      get_child(name)->load(r);
+    }
+  }
+};
+
 using namespace pt;
 #define TARGET_SELF "*self"
 #define CODE_BLOCK_PREFIX  "*code block: "
@@ -224,6 +547,21 @@ public:
     uint64_t time_start;
     uint32_t timeline_unit;
     bool ip_filtering;
+    uint32_t cct_depth;
+    uint32_t caller_depth;
+    uint32_t top_k;
+    /* latency thresholds of typical and slow calls, 0 for no cohort */
+    uint64_t cohort_fast;
+    uint64_t cohort_slow;
+    /* number and time (ns) of windows in heatmap, 0 for no heatmap */
+    uint32_t heatmap_windows;
+    uint64_t heatmap_unit;
+    /* keys of callers and children to keep, 0 for all */
+    uint32_t max_keys;
+    /* analyze one of every sample invocations, 0 or 1 for all */
+    uint32_t sample;
+    /* counts are already scaled by sample, as the stats of loaded shards */
+    bool sample_scaled;
 	};
   struct Latency {
     Distribution target;
@@ -238,6 +576,21 @@ public:
       sched.merge_slots(lat.sched);
       unknown_count += lat.unknown_count;
     }
+    void scale(uint32_t n) {
+      target.scale(n);
+      sched.scale(n);
+      unknown_count *= n;
+    }
+    void save(ShardWriter &w) {
+      target.save(w);
+      sched.save(w);
+      w.put_u64(unknown_count);
+    }
+    void load(ShardReader &r) {
+      target.load(r);
+      sched.load(r);
+      unknown_count = r.get_u64();
+    }
   };
   struct LatencyChild {
     Bucket target;
@@ -251,8 +604,27 @@ public:
       sched.clear();
     }
     bool empty() { return target.empty() && sched.empty();}
+    /* sched is folded by the keys of target, so each row has both */
+    void set_max_keys(uint32_t n) {
+      target.set_max_keys(n);
+    }
+    void trim_keys() {
+      target.trim_keys();
+      sched.fold_keys_like(target);
+    }
+    void fold_keys_to(const std::unordered_set<std::string> &keep) {
+      target.fold_keys_to(keep);
+      sched.fold_keys_like(target);
+    }
+    void scale(uint32_t n) {
+      target.scale(n);
+      sched.scale(n);
+      target_total *= n;
+      sched_total *= n;
+    }
     void add_target(const std::string &name, uint64_t lat) {
-      target.add_val(name, lat);
+      if (target.add_val(name, lat))
+        sched.fold_keys_like(target);
       target_total += lat;
     }
     void add_sched(const std::string &name, uint64_t lat) {
@@ -261,14 +633,32 @@ public:
       sched_total += lat;
     }
     void add_child(LatencyChild &child) {
-      target.add_bucket(child.target);
+      bool folded = target.add_bucket(child.target);
       sched.add_bucket(child.sched);
+      if (folded)
+        sched.fold_keys_like(target);
     }
     void merge(LatencyChild &child) { add_child(child);}
+    void save(ShardWriter &w) {
+      target.save(w);
+      sched.save(w);
+      w.put_u64(target_total);
+      w.put_u64(sched_total);
+    }
+    void load(ShardReader &r) {
+      target.load(r);
+      sched.load(r);
+      target_total = r.get_u64();
+      sched_total = r.get_u64();
+    }
   };
   struct LatencyCaller {
     Latency latency;
     LatencyChild children;
+    /* upper bound of the latency missed by max_keys, like Bucket */
+    uint64_t err;
+    LatencyCaller() : err(0) {}
+    uint64_t get_total() { return latency.target.get_total() + err; }
     void add_target(uint64_t lat) {latency.add_target(lat);}
     void add_sched(uint64_t lat) {latency.add_sched(lat);}
     void add_child(LatencyChild &c) { children.add_child(c); }
@@ -276,11 +666,60 @@ public:
       latency.merge(caller.latency);
       children.merge(caller.children);
     }
+    void save(ShardWriter &w) {
+      latency.save(w);
+      children.save(w);
+      w.put_u64(err);
+    }
+    void load(ShardReader &r) {
+      latency.load(r);
+      children.load(r);
+      err = r.get_u64();
+    }
+  };
+  /* one slow invocation of target, with its own child breakdown */
+  struct Outlier {
+    uint64_t ts;
+    long tid;
+    uint64_t latency;
+    uint64_t sched;
+    std::string caller;
+    /* name, total latency and count of each child */
+    std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> children;
+    /* the top of heap is the fastest one of outliers */
+    bool operator<(const Outlier &o) const { return latency > o.latency; }
+    void save(ShardWriter &w) {
+      w.put_u64(ts);
+      w.put_u64(tid);
+      w.put_u64(latency);
+      w.put_u64(sched);
+      w.put_str(caller);
+      w.put_u64(children.size());
+      for (auto &it : children) {
+        w.put_str(it.first);
+        w.put_u64(it.second.first);
+        w.put_u64(it.second.second);
+      }
+    }
+    void load(ShardReader &r) {
+      ts = r.get_u64();
+      tid = r.get_u64();
+      latency = r.get_u64();
+      sched = r.get_u64();
+      caller = r.get_str();
+      for (uint64_t n = r.get_len(sizeof(uint64_t)); n > 0 && r.good(); --n) {
+        std::string name = r.get_str();
+        uint64_t total = r.get_u64();
+        children.push_back({name, {total, r.get_u64()}});
+      }
+    }
   };
   FuncStat(Option o, SrclineMap *s) : opt(o), srcline_map(s),
-      sched_count(0), timeline_unit_lat(0), timeline_unit(0) {}
+      caller_floor(0), sched_count(0), fast_count(0), slow_count(0),
+      timeline_unit_lat(0), timeline_unit(0) { set_max_keys(); }
   FuncStat() : srcline_map(nullptr),
-      sched_count(0), timeline_unit_lat(0), timeline_unit(0) {}
+      caller_floor(0), sched_count(0), fast_count(0), slow_count(0),
+      timeline_unit_lat(0), timeline_unit(0) {}
   /* option */
   Option opt;
   /* srcline map */
@@ -292,30 +731,86 @@ public:
   LatencyChild children;
   /* Latency divided by Caller */
   std::unordered_map<std::string, LatencyCaller> callers;
+  /* largest latency of the callers folded by max_keys */
+  uint64_t caller_floor;
   /* schedule count */
   uint64_t sched_count;
+  /* calling-context tree, the root is target function */
+  CallTreeNode cct;
+  /* latency by caller path, the root is target function */
+  CallTreeNode caller_tree;
+  /* heap of the top_k slowest invocations */
+  std::vector<Outlier> outliers;
+  /* child latency of typical calls and slow calls */
+  LatencyChild fast_children;
+  LatencyChild slow_children;
+  uint64_t fast_count;
+  uint64_t slow_count;
+  /* latency by time window */
+  Heatmap heatmap;
 
   /* Latency timeline */
   std::vector<std::vector<long double>> timeline;
   uint64_t timeline_unit_lat;
   uint32_t timeline_unit;
 
+  /* caller by name, the callers beyond max_keys are folded first */
+  LatencyCaller &get_caller(const std::string &name) {
+    auto it = callers.find(name);
+    if (it == callers.end()) {
+      if (opt.max_keys && callers.size() >= 2 * opt.max_keys)
+        fold_callers();
+      it = callers.emplace(name, LatencyCaller()).first;
+      it->second.err = caller_floor;
+      it->second.children.set_max_keys(opt.max_keys);
+    }
+    return it->second;
+  }
+  void fold_callers(bool by_total = false);
+  void trim_keys();
+  /* scale the stat of sampled invocations to estimate all invocations */
+  void scale_samples();
+  /* set max_keys of option to children */
+  void set_max_keys() {
+    children.set_max_keys(opt.max_keys);
+    fast_children.set_max_keys(opt.max_keys);
+    slow_children.set_max_keys(opt.max_keys);
+  }
+
   void add_latency(uint64_t lat_t, uint64_t lat_s, const std::string &caller) {
+    LatencyCaller &c = get_caller(caller);
     latency.add_target(lat_t);
-    callers[caller].add_target(lat_t);
+    c.add_target(lat_t);
     if (lat_s) {
       latency.add_sched(lat_s);
-      callers[caller].add_sched(lat_s);
+      c.add_sched(lat_s);
     }
   }
   void add_child_latency(LatencyChild &child,
       const std::string &caller, bool gather = true) {
     if (gather)
       children.add_child(child);
-    callers[caller].add_child(child);
+    get_caller(caller).add_child(child);
   }
   
+  /* if the call is in the latency and time interval to show */
+  bool in_interval(uint64_t ts, uint64_t lat) {
+    return lat >= opt.latency_interval.first &&
+           lat <= opt.latency_interval.second &&
+           ts >= opt.time_interval.first && ts <= opt.time_interval.second;
+  }
   void add(Action &action_call, Action &action_return, uint64_t lat_s, LatencyChild &child);
+  void add_outlier(Outlier &outlier) {
+    if (outliers.size() < opt.top_k) {
+      outliers.push_back(std::move(outlier));
+      std::push_heap(outliers.begin(), outliers.end());
+    } else if (!outliers.empty() &&
+               outlier.latency > outliers.front().latency) {
+      std::pop_heap(outliers.begin(), outliers.end());
+      outliers.back() = std::move(outlier);
+      std::push_heap(outliers.begin(), outliers.end());
+    }
+  }
 
   void add_unknown_latency(LatencyChild &child, const std::string &caller) {
     bool gather = (caller != "unknown");
@@ -326,20 +821,75 @@ public:
   void merge(FuncStat &stat) {
     latency.merge(stat.latency);
     children.merge(stat.children);
-    for (auto &it : stat.callers) {
-      LatencyCaller &caller = it.second;
-      callers[it.first].merge(caller);
-    }
+    merge_callers(stat);
     sched_count += stat.sched_count;
+    cct.merge(stat.cct);
+    caller_tree.merge(stat.caller_tree);
+    for (Outlier &outlier : stat.outliers) {
+      add_outlier(outlier);
+    }
+    fast_children.merge(stat.fast_children);
+    slow_children.merge(stat.slow_children);
+    fast_count += stat.fast_count;
+    slow_count += stat.slow_count;
+    heatmap.merge(stat.heatmap);
+  }
+
+  void merge_callers(FuncStat &stat);
+  /* merge only latency and children of stat, it is not changed */
+  void merge_summary(FuncStat &stat) {
+    latency.merge(stat.latency);
+    children.merge(stat.children);
   }
 
+  /* save and load the stat with its option in stat shard */
+  void save(ShardWriter &w);
+  void load(ShardReader &r);
+
   void init_print_width();
   void add_addr_from_funcname(const std::string &name);
   void generate_srcline();
   void print_latency(FuncStat::Latency &latency);
+  void print_sample_ci(Distribution &dist);
   void print_child(FuncStat::LatencyChild &child);
+  void print_call_tree();
+  void print_caller_tree();
+  void print_outliers();
+  void print_cohort();
   void print();
   void print_timeline();
+  /* one line of latency and top children of merge_summary */
+  void print_summary(uint32_t top);
+};
+
+/* difference of one target's stats between a base run and a new run */
+class FuncStatDiff {
+public:
+  FuncStatDiff(FuncStat &b, FuncStat &n) : base(b), cur(n) {}
+  void print();
+  /* folded stacks of the calling-context tree with exclusive latency
+   * per target call of both runs, the input of differential flamegraph */
+  void write_folded(std::ostream &os);
+
+  struct Row {
+    std::string name;
+    /* time per call of target (ns) */
+    double base_time;
+    double cur_time;
+    uint64_t base_count;
+    uint64_t cur_count;
+    double delta() const { return cur_time - base_time; }
+  };
+private:
+  void print_latency();
+  void print_rows(const char *title, std::vector<Row> &rows);
+  void add_child_rows(std::vector<Row> &rows);
+  void add_caller_rows(std::vector<Row> &rows);
+  void write_folded_node(std::ostream &os, const std::string &path,
+                         CallTreeNode *base_node, CallTreeNode *cur_node);
+
+  FuncStat &base;
+  FuncStat &cur;
 };
 
 struct FuncGlobalStatus {
@@ -367,6 +917,27 @@ struct FuncGlobalStatus {
   }
 
   void print(size_t thread_num, const std::string &ancestor);
+  void save(ShardWriter &w) {
+    w.put_u64(miss.load());
+    w.put_u64(real.first);
+    w.put_u64(real.second);
+    w.put_u64(ancestor_begin.load());
+    w.put_u64(ancestor_end.load());
+  }
+  void load(ShardReader &r) {
+    miss.store(r.get_u64());
+    real.first = r.get_u64();
+    real.second = r.get_u64();
+    ancestor_begin.store(r.get_u64());
+    ancestor_end.store(r.get_u64());
+  }
+  void merge(FuncGlobalStatus &st) {
+    miss.fetch_add(st.miss.load());
+    real.first = std::min(real.first, st.real.first);
+    real.second = std::max(real.second, st.real.second);
+    ancestor_begin.fetch_add(st.ancestor_begin.load());
+    ancestor_end.fetch_add(st.ancestor_end.load());
+  }
   FuncGlobalStatus() : miss(0), real({UINT64_MAX, 0}),
     ancestor_begin(0), ancestor_end(0) {}
 };
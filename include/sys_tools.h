@@ -73,7 +73,9 @@ long str2long(const std::string &str);
 int str2int(const std::string &str);
 std::pair<uint64_t, uint64_t> get_interval_from_string(const std::string &str);
 std::string parse_number_range_to_sequence(const std::string &str);
+std::vector<std::string> split_string(const std::string &str, char sep);
 size_t get_file_linecount(const std::string &path);
+size_t get_file_size(const std::string &path);
 bool check_path_exist(const std::string &path);
 bool create_directory(const std::string &path);
 bool check_system();
@@ -94,4 +96,10 @@ void addr2line(const std::string &binary,
 
 std::string parse_sub_command(int argc, char *argv[]);
 
+/* peak resident memory in KB since start or the last reset */
+uint64_t get_peak_rss();
+void reset_peak_rss();
+/* user and system CPU time of the process, in seconds */
+double get_cpu_time();
+
 #endif
@@ -0,0 +1,51 @@
+#ifndef _h_trace_export_
+#define _h_trace_export_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace pt {
+/*
+ * Writer of Chrome trace-event JSON, which is opened by chrome://tracing
+ * and Perfetto UI. Each thread job streams its events into its own part
+ * file, and the parts are concatenated into one trace at the end, so no
+ * event list is kept in memory.
+ *
+ * Events of one call chain are pending until the target returns, then
+ * they are written or discarded by the filters of the stat.
+ */
+class ChromeTraceWriter {
+public:
+  ChromeTraceWriter(const std::string &file, long tid);
+  ~ChromeTraceWriter();
+  static std::string part_file(const std::string &file, long tid) {
+    return file + "." + std::to_string(tid) + ".part";
+  }
+  /* concatenate the part files of threads into the trace file */
+  static bool concat(const std::string &file, const std::vector<long> &tids);
+
+  bool good() { return fp != nullptr; }
+  /* complete event from ts with duration, in ns */
+  void add_event(const std::string &name, const char *cat,
+                 uint64_t ts, uint64_t dur) {
+    pending.push_back({name, cat, ts, dur});
+  }
+  void commit();
+  void discard() { pending.clear(); }
+private:
+  struct Event {
+    std::string name;
+    const char *cat;
+    uint64_t ts;
+    uint64_t dur;
+  };
+  FILE *fp;
+  long tid;
+  bool first;
+  std::vector<Event> pending;
+};
+};
+
+#endif
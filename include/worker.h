@@ -7,14 +7,36 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <chrono>
+#include <utility>
 #include <stdint.h>
 
 class ParallelJob {
 public:
   virtual ~ParallelJob() {}
   virtual void exec() = 0;
+  /* for self profiling: kind of job, and the items and bytes it processed */
+  virtual const char *job_name() { return "job"; }
+  virtual uint64_t job_items() { return 0; }
+  virtual uint64_t job_bytes() { return 0; }
 };
 
+/* profile of one job executed by a worker, times in ns of steady clock */
+struct JobProfile {
+  const char *name;
+  uint32_t worker;
+  uint64_t enqueue;
+  uint64_t start;
+  uint64_t end;
+  uint64_t items;
+  uint64_t bytes;
+};
+
+static inline uint64_t job_time_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 class MemoryFreeJob : public ParallelJob {
 public:
   MemoryFreeJob() : to_free(nullptr) {}
@@ -23,13 +45,15 @@ public:
   void exec() override {
     if (to_free) delete to_free;
   }
+  const char *job_name() override { return "free"; }
 private:
   ParallelJob *to_free;
 };
 
 class ParallelWorker {
 public:
-  ParallelWorker(uint32_t i) : idx(i), thr(nullptr), should_stop(false), alive(false) {}
+  ParallelWorker(uint32_t i, std::atomic_bool *p)
+    : idx(i), thr(nullptr), should_stop(false), alive(false), profiling(p) {}
   ~ParallelWorker() {
     if (thr) {
       delete thr;
@@ -53,15 +77,29 @@ public:
   }
 
   void add_job(ParallelJob *job) {
+    uint64_t enqueue = profiling->load() ? job_time_now() : 0;
     std::unique_lock<std::mutex> ul(m_mutex);
-    jobs.push(job);
+    jobs.push({job, enqueue});
     jobs_cv.notify_one();
   }
 
+  /* take the profiles of executed jobs */
+  void take_profiles(std::vector<JobProfile> &out) {
+    std::unique_lock<std::mutex> ul(m_mutex);
+    out.insert(out.end(), profiles.begin(), profiles.end());
+    profiles.clear();
+  }
+
   void wait_idle() {
     std::unique_lock<std::mutex> ul(m_mutex);
     idle_cv.wait(ul, [&]() -> bool { return job_doing == nullptr && jobs.empty();});
   }
+  /* return false if it is not idle before the deadline */
+  bool wait_idle_until(std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> ul(m_mutex);
+    return idle_cv.wait_until(ul, deadline,
+        [&]() -> bool { return job_doing == nullptr && jobs.empty();});
+  }
 
 private:
   uint32_t idx;
@@ -69,8 +107,12 @@ private:
   std::atomic_bool should_stop;
   std::atomic_bool alive;
 
+  std::atomic_bool *profiling;
+  std::vector<JobProfile> profiles;
+
   ParallelJob *job_doing;
-  std::queue<ParallelJob *> jobs;
+  /* jobs with their enqueue time */
+  std::queue<std::pair<ParallelJob *, uint64_t>> jobs;
   std::mutex m_mutex;
   std::condition_variable jobs_cv;
   std::condition_variable idle_cv;
@@ -79,7 +121,7 @@ private:
 
 class ParallelWorkerPool {
 public:
-  ParallelWorkerPool() : alive(false), pool_size(0) {}
+  ParallelWorkerPool() : alive(false), pool_size(0), profiling(false) {}
   ~ParallelWorkerPool() {
     for (size_t i=0; i<pool_size; ++i) {
       workers[i]->stop();
@@ -92,7 +134,7 @@ public:
     if (!alive) {
       pool_size = size;
       for (size_t i=0; i<pool_size; ++i) {
-        workers.push_back(new ParallelWorker(i));
+        workers.push_back(new ParallelWorker(i, &profiling));
         workers[i]->start();
       }
       alive = true;
@@ -104,13 +146,38 @@ public:
       worker->wait_idle();
     }
   }
+  /* wait all workers for some seconds at most, return if they are idle */
+  bool wait_all_idle_for(double secs) {
+    if (!alive) return true;
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(secs));
+    for (ParallelWorker *worker : workers) {
+      if (!worker->wait_idle_until(deadline))
+        return false;
+    }
+    return true;
+  }
   void add_job(ParallelJob *job, uint32_t idx) {
     if (!alive) return;
     workers[idx % pool_size]->add_job(job);
   }
+
+  /* record the profile of each job, see JobProfile */
+  void set_profiling(bool on) { profiling.store(on); }
+  bool is_profiling() { return profiling.load(); }
+  /* take the profiles of jobs executed since last time */
+  std::vector<JobProfile> take_profiles() {
+    std::vector<JobProfile> out;
+    for (ParallelWorker *worker : workers)
+      worker->take_profiles(out);
+    return out;
+  }
+  uint32_t size() { return pool_size; }
 private:
   bool alive;
   uint32_t pool_size;
+  std::atomic_bool profiling;
   std::vector<ParallelWorker *> workers;
 };
 
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <stdexcept>
+#include "action_index.h"
+
+namespace pt {
+using namespace std;
+
+static uint64_t align8(uint64_t off) { return (off + 7) & ~7ULL; }
+
+void ActionIndexWriter::add_symbols(SymbolMgr &sym_mgr) {
+  sym_mgr.loop_symbols([&](Symbol *sym) {
+    /* the same symbol may be created by multiple parse jobs */
+    string key = sym->name;
+    funcname_add_addr(key, sym->addr);
+    auto it = sym_keys.find(key);
+    if (it != sym_keys.end()) {
+      sym_ids[sym] = it->second;
+      return;
+    }
+    uint32_t id = symbols.size();
+    symbols.push_back(sym);
+    sym_keys[key] = id;
+    sym_ids[sym] = id;
+  });
+}
+
+bool ActionIndexWriter::write_symbols() {
+  ofstream ofs(dir + "/" + ACTION_INDEX_SYMBOLS);
+  if (!ofs.is_open())
+    return false;
+  for (const Symbol *sym : symbols) {
+    ofs << sym->addr << " " << sym->offset << " " << sym->name << "\n";
+  }
+  return ofs.good();
+}
+
+bool ActionIndexWriter::write_thread(long tid, vector<Action> &actions) {
+  ActionIndexHeader hdr;
+  size_t n = actions.size();
+  hdr.magic = ACTION_INDEX_MAGIC;
+  hdr.version = ACTION_INDEX_VERSION;
+  hdr.tid = tid;
+  hdr.count = n;
+  hdr.sparse_step = ACTION_INDEX_SPARSE_STEP;
+  hdr.sparse_count = (n + ACTION_INDEX_SPARSE_STEP - 1) / ACTION_INDEX_SPARSE_STEP;
+  hdr.ts_off = align8(sizeof(hdr));
+  hdr.from_off = hdr.ts_off + n * sizeof(uint64_t);
+  hdr.to_off = hdr.from_off + n * sizeof(uint32_t);
+  hdr.type_off = hdr.to_off + n * sizeof(uint32_t);
+  hdr.sparse_off = align8(hdr.type_off + n);
+
+  vector<uint64_t> ts(n);
+  vector<uint32_t> from(n), to(n);
+  vector<uint8_t> type(n);
+  vector<uint64_t> sparse(hdr.sparse_count);
+  for (size_t i = 0; i < n; ++i) {
+    Action &a = actions[i];
+    ts[i] = a.ts;
+    if (a.is_error) {
+      from[i] = to[i] = ACTION_INDEX_NO_SYMBOL;
+      type[i] = ACTION_INDEX_ERROR;
+    } else {
+      from[i] = get_id(a.from);
+      to[i] = get_id(a.to);
+      type[i] = a.type;
+    }
+    if (i % ACTION_INDEX_SPARSE_STEP == 0)
+      sparse[i / ACTION_INDEX_SPARSE_STEP] = a.ts;
+  }
+
+  ofstream ofs(ActionIndexReader::thread_file(dir, tid), ios::binary);
+  if (!ofs.is_open())
+    return false;
+  auto write_at = [&](uint64_t off, const void *data, size_t len) {
+    ofs.seekp(off);
+    ofs.write((const char *)data, len);
+  };
+  write_at(0, &hdr, sizeof(hdr));
+  write_at(hdr.ts_off, ts.data(), n * sizeof(uint64_t));
+  write_at(hdr.from_off, from.data(), n * sizeof(uint32_t));
+  write_at(hdr.to_off, to.data(), n * sizeof(uint32_t));
+  write_at(hdr.type_off, type.data(), n);
+  write_at(hdr.sparse_off, sparse.data(), hdr.sparse_count * sizeof(uint64_t));
+  return ofs.good();
+}
+
+bool ActionIndexReader::load_symbols(const string &dir, SymbolMgr &sym_mgr) {
+  ifstream ifs(dir + "/" + ACTION_INDEX_SYMBOLS);
+  if (!ifs.is_open()) {
+    printf("ERROR: failed to open symbols of action index in %s\n", dir.c_str());
+    return false;
+  }
+  string line;
+  uint64_t id = 0;
+  while (getline(ifs, line)) {
+    size_t sep1 = line.find(' ');
+    size_t sep2 = line.find(' ', sep1 + 1);
+    uint64_t addr;
+    uint32_t offset;
+    try {
+      if (sep1 == string::npos || sep2 == string::npos)
+        throw invalid_argument(line);
+      addr = stoull(line.substr(0, sep1));
+      offset = stoul(line.substr(sep1 + 1, sep2 - sep1 - 1));
+    } catch (const logic_error &) {
+      printf("ERROR: invalid symbol %lu of action index: %s\n", id, line.c_str());
+      return false;
+    }
+    sym_mgr.create(id++, addr, offset, line.substr(sep2 + 1));
+  }
+  return true;
+}
+
+vector<long> ActionIndexReader::list_threads(const string &dir) {
+  vector<long> tids;
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return tids;
+  string suffix = ACTION_INDEX_SUFFIX;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != nullptr) {
+    string name = ent->d_name;
+    if (name.size() <= suffix.size() ||
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix))
+      continue;
+    tids.push_back(atol(name.c_str()));
+  }
+  closedir(d);
+  return tids;
+}
+
+bool ActionIndexReader::open(const string &filename) {
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(ActionIndexHeader)) {
+    ::close(fd);
+    return false;
+  }
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  base = (unsigned char *)addr;
+  size = st.st_size;
+  hdr = (const ActionIndexHeader *)base;
+  if (hdr->magic == ACTION_INDEX_MAGIC_V0 ||
+      (hdr->magic == ACTION_INDEX_MAGIC && hdr->version != ACTION_INDEX_VERSION)) {
+    printf("ERROR: action index file %s is of another version, "
+           "build it again by --build_index\n", filename.c_str());
+    close();
+    return false;
+  }
+  if (hdr->magic != ACTION_INDEX_MAGIC || !hdr->sparse_step ||
+      hdr->sparse_count != hdr->count / hdr->sparse_step +
+                           (hdr->count % hdr->sparse_step != 0) ||
+      !check_column(hdr->ts_off, hdr->count, sizeof(uint64_t)) ||
+      !check_column(hdr->from_off, hdr->count, sizeof(uint32_t)) ||
+      !check_column(hdr->to_off, hdr->count, sizeof(uint32_t)) ||
+      !check_column(hdr->type_off, hdr->count, sizeof(uint8_t)) ||
+      !check_column(hdr->sparse_off, hdr->sparse_count, sizeof(uint64_t))) {
+    printf("ERROR: invalid action index file %s\n", filename.c_str());
+    close();
+    return false;
+  }
+  return true;
+}
+
+void ActionIndexReader::close() {
+  if (base)
+    munmap(base, size);
+  base = nullptr;
+  hdr = nullptr;
+  size = 0;
+}
+
+size_t ActionIndexReader::lower_bound(uint64_t ts) {
+  const uint64_t *sparse = column<uint64_t>(hdr->sparse_off);
+  const uint64_t *ts_col = column<uint64_t>(hdr->ts_off);
+  /* find the block in sparse index, then search in the block */
+  size_t block = std::lower_bound(sparse, sparse + hdr->sparse_count, ts) - sparse;
+  if (block == 0)
+    return 0;
+  size_t from = (block - 1) * hdr->sparse_step;
+  size_t to = std::min(from + hdr->sparse_step, (size_t)hdr->count);
+  return std::lower_bound(ts_col + from, ts_col + to, ts) - ts_col;
+}
+};
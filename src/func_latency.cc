@@ -8,6 +8,7 @@
 #include <cmath>
 #include <sstream>
 #include <signal.h>
+#include <unordered_set>
 
 #include "stat_tools.h"
 #include "sys_tools.h"
@@ -20,7 +21,14 @@ Param param;
 FuncGlobalStatus gstat;
 /* use to decode source file and line number */
 static SrclineMap srcline_map;
+/* target function name to its index in param.targets */
+static unordered_map<string, int> target_idx_map;
+/* ancestor function name to its level in param.ancestors */
+static unordered_map<string, int> ancestor_idx_map;
+/* symbols of the action index, shared by all parse jobs */
+static SymbolMgr index_sym_mgr;
 static ParallelWorkerPool worker_pool;
+static SelfProfiler self_profiler;
 
 Param::Param() {
   perf_tool = get_executor_dir() + "/perf";
@@ -35,24 +43,43 @@ Param::Param() {
   parallel_script = false;
   per_thread_mode = false;
   worker_num = 10;
+  script_files = 1;
   ip_filtering = false;
   func_idx = "#0"; // global symbol
   offcpu = false;
   call_line = true;
   pt_config = "cyc=1";
   compact_format = true;
+  unordered_queues = false;
+  threaded_script = false;
+  insn_cache_dir = "";
+  build_index = false;
+  interactive = false;
+  shard_file = "";
+  chrome_trace = "";
+  self_profile = "";
+  self_trace = "";
 
   ancestor = "";
-  ancestor_latency = {0, UINT64_MAX};
   code_block = false;
+  cct_depth = 0;
+  caller_depth = 0;
+  top_k = 0;
+  cohort = {0, 0};
 
   timeline = false;
   timeline_unit = 1;
+  heatmap = 0;
+  max_keys = 0;
+  sample = 0;
+  progress = 0;
   offcpu_filter = "filter " + sys_sched_funcname +" ,";
   latency_interval = {0, UINT64_MAX};
   time_interval = {0, UINT64_MAX};
   time_start = UINT64_MAX;
   history = 0;
+  continuous_period = 0;
+  continuous_windows = 0;
 
   flamegraph = "";
   scripts_home = get_executor_dir() + "/scripts";
@@ -63,6 +90,25 @@ Param::Param() {
   sub_command = "";
 }
 
+/* codes of long-only options, the digits are all used */
+enum {
+  OPT_CCT_DEPTH = 256,
+  OPT_CALLER_DEPTH,
+  OPT_BUILD_INDEX,
+  OPT_INTERACTIVE,
+  OPT_SAVE_SHARD,
+  OPT_CONTINUOUS,
+  OPT_TOP_K,
+  OPT_COHORT,
+  OPT_HEATMAP,
+  OPT_CHROME_TRACE,
+  OPT_SELF_PROFILE,
+  OPT_SELF_TRACE,
+  OPT_MAX_KEYS,
+  OPT_SAMPLE,
+  OPT_PROGRESS,
+};
+
 struct option opts[] = {
   {"binary", 1, NULL, 'b'},
   {"func", 1, NULL, 'f'},
@@ -87,8 +133,26 @@ struct option opts[] = {
   {"pt_config", 1, NULL, '5'},
   {"script_format", 1, NULL, '6'},
   {"result_dir", 1, NULL, 'D'},
+  {"unordered", 0, NULL, '7'},
+  {"threaded_script", 0, NULL, '8'},
+  {"insn_cache", 1, NULL, '9'},
+  {"build_index", 0, NULL, OPT_BUILD_INDEX},
+  {"interactive", 0, NULL, OPT_INTERACTIVE},
+  {"save_shard", 1, NULL, OPT_SAVE_SHARD},
+  {"chrome_trace", 1, NULL, OPT_CHROME_TRACE},
+  {"self_profile", 1, NULL, OPT_SELF_PROFILE},
+  {"self_trace", 1, NULL, OPT_SELF_TRACE},
+  {"continuous", 1, NULL, OPT_CONTINUOUS},
   {"unfold_gathered_line", 0, NULL, 'U'},
   {"code_block", 0, NULL, 'c'},
+  {"cct_depth", 1, NULL, OPT_CCT_DEPTH},
+  {"caller_depth", 1, NULL, OPT_CALLER_DEPTH},
+  {"top_k", 1, NULL, OPT_TOP_K},
+  {"cohort", 1, NULL, OPT_COHORT},
+  {"heatmap", 1, NULL, OPT_HEATMAP},
+  {"max_keys", 1, NULL, OPT_MAX_KEYS},
+  {"sample", 1, NULL, OPT_SAMPLE},
+  {"progress", 1, NULL, OPT_PROGRESS},
   {"offcpu", 0, NULL, 'o'},
   {"per_thread", 0, NULL, 't'},
   {"ip_filter", 0, NULL, 'i'},
@@ -106,7 +170,8 @@ static void usage() {
     "Linux version 4.2+ is required for Intel PT\n"
     "Linux version 5.10+ is required for IP filtering when tracing\n"
     "\t-b / --binary          --- binary file path, empty for kernel func\n"
-    "\t-f / --func            --- target's function name\n"
+    "\t-f / --func            --- target's function name, or comma separated names to analyze\n"
+    "\t                           multiple functions from one trace, like 'func1,func2'\n"
     "\t-d / --duration        --- trace time (seconds), 0.01 seconds by default\n"
     "\t-p / --pid             --- existing process ID\n"
     "\t-T / --tid             --- existing thread ID (comma separated list), example like tid1,tid2\n"
@@ -121,9 +186,43 @@ static void usage() {
     "\t-a / --ancestor        --- only analyze target function with 'ancestor' function in its call chain,\n"
     "\t                           eg, 'test#100,200', we shows the result of target function\n"
     "\t                           where its ancestor latency is between 100ns and 200 ns.\n"
+    "\t                           A path of ancestors is separated by '>' from the outermost one,\n"
+    "\t                           eg, 'do_command>dispatch_command#1000,inf>row_search_mvcc'\n"
     "\t-c / --code_block      --- show the code block latency of target function\n"
-    "\t     --history         --- for history trace, 1: generate perf.data, 2: use perf.data \n"
+    "\t     --cct_depth       --- show the calling-context tree below target function up to this depth,\n"
+    "\t                           with inclusive/exclusive latency of each call path\n"
+    "\t     --caller_depth    --- show the latency of target function by its caller path up to this\n"
+    "\t                           number of frames, all branches of the threads are decoded\n"
+    "\t     --top_k           --- show the k slowest calls of target function with their child latency,\n"
+    "\t                           and the time interval to trace them with '--ti'\n"
+    "\t     --cohort          --- compare the child latency of typical and slow calls, split by latency\n"
+    "\t                           percentiles, format: \"typical,slow\", eg, \"50,99\"\n"
+    "\t     --max_keys        --- keep the top N callers and children of target function by latency,\n"
+    "\t                           and fold others into '[others]' with error bounds, to bound memory\n"
+    "\t     --sample          --- analyze one of every N calls of target function, picked by the hash\n"
+    "\t                           of timestamp, and show the estimated latency with confidence intervals\n"
+    "\t     --progress        --- report the progress of parsing and the latency of the finished threads\n"
+    "\t                           every N seconds, to abort early once the answer is clear\n"
+    "\t     --history         --- for history trace, 1: generate perf.data, 2: use perf.data,\n"
+    "\t                           4: use the action index of --build_index\n"
     "\t-D / --result_dir      --- the result directory to save and use perf.data and temporary files\n"
+    "\t     --unordered       --- decode each cpu/thread trace independently in perf script,\n"
+    "\t                           faster for large traces, actions are sorted by thread later\n"
+    "\t     --threaded_script --- parallel script by threads of one perf process, saves the memory\n"
+    "\t                           of loading symbols in each worker, per_thread mode is required\n"
+    "\t     --insn_cache      --- directory to save and reuse the decoded instruction cache of binaries,\n"
+    "\t                           shared by script workers and later runs on the same binary\n"
+    "\t     --build_index     --- save all decoded actions as an index in result directory, later\n"
+    "\t                           queries with '--history=4' read it instead of perf script\n"
+    "\t     --interactive     --- keep the decoded trace in memory, and answer queries of target,\n"
+    "\t                           ancestor, tid and intervals from stdin\n"
+    "\t     --save_shard      --- save the stats to this shard file, to merge them with other runs by\n"
+    "\t                           './func_latency merge shard1 shard2 ...'\n"
+    "\t     --chrome_trace    --- export target calls, their children and schedule of each thread to\n"
+    "\t                           this file, as Chrome trace-event JSON for chrome://tracing or Perfetto\n"
+    "\t     --self_profile    --- save the profile of func_latency itself to this JSON file: time, CPU\n"
+    "\t                           and peak RSS of each phase, and the jobs of each worker\n"
+    "\t     --self_trace      --- save the jobs of workers in each phase to this file as Chrome trace\n"
     "\t-U / --unfold_gathered_line\n"
     "\t                       --- unfold the call-line which gathered for simplicity, like interrupts that\n"
     "\t                           may be called from multiple locations\n"
@@ -136,17 +235,41 @@ static void usage() {
     "\t--ti/--time_interval   --- show the trace between the time interval (ns), format:\"start,min,max\"\n"
     "\t--tu/--timeline_unit   --- the unit size in the timeline grapth, we caculate the average\n" 
     "\t                           latency in the unit, 1 by default\n"
+    "\t     --heatmap         --- show the latency heatmap of this number of time windows, with call\n"
+    "\t                           rate and percentiles of each window, merged by all threads\n"
+    "\n"
+    "Continuous mode:\n"
+    "\t     --continuous      --- trace a window of '-d' seconds in each period until the number of\n"
+    "\t                           windows or Ctrl-C, format: \"period[,windows]\", the aggregated stats\n"
+    "\t                           are saved to " CONTINUOUS_SNAPSHOT " or '--save_shard' after each window,\n"
+    "\t                           Ctrl-C finishes the current window and prints the aggregated stats\n"
     "\n"
     "Flamegraph mode:\n"
     "\t-F / --flamegraph      --- show the flamegraph, \"latency, cpu\"\n"
     "\t     --pt_flame        --- the installed path of pt_flame, latency-based flamegraph required\n"
     "\n"
+    "Merge mode:\n"
+    "\t./func_latency merge shard1 shard2 ...\n"
+    "\t                       --- merge the stat shards saved by '--save_shard', and show the report\n"
+    "\n"
+    "Diff mode:\n"
+    "\t./func_latency diff base_shard new_shard [-F]\n"
+    "\t                       --- compare the stat shards of two runs, -F for differential flamegraph\n"
+    "\n"
     "Example: ./func_latency -b \"bin/mysqld\" -f \"do_command\" -d 1 -p 60467 -s -t -i\n"
     "         sudo ./func_latency -b \"bin/mysqld\" -f \"do_command\" -d 1 -p 60467 -s -t -i -o\n"
   );
 }
 
+/* set by the first SIGINT in continuous mode */
+static volatile sig_atomic_t continuous_stop = 0;
+
 static void sig_handler(int sig) {
+  if (param.continuous_period && sig == SIGINT && !continuous_stop) {
+    /* finish the current window, then print the aggregated stats */
+    continuous_stop = 1;
+    return;
+  }
   abort_cmd_killable(sig);
   if (param.history < 2)
     clear_record_files();
@@ -166,7 +289,145 @@ static void dump_options() {
   printf("sub_command: %s\n", param.sub_command.c_str());
 }
 
-void ThreadJob::do_analyze() {
+/* set time interval from "start,min,max" */
+static int set_time_interval(const string &str) {
+  int sep1 = str.find_first_of(',');
+  int sep2 = str.find_last_of(',');
+  if (sep1 == string::npos || sep1 == sep2) {
+    printf("ERROR: wrong time_interval format!\n");
+    return 1;
+  }
+  param.time_start = str2long(str.substr(0, sep1));
+  param.time_interval.first =
+                  param.time_start + str2long(str.substr(sep1 + 1, sep2));
+  param.time_interval.second =
+                  param.time_start + str2long(str.substr(sep2 + 1, str.size()));
+  param.time_start = param.time_interval.first;
+  return 0;
+}
+
+/* set percentiles of cohort from "typical,slow" */
+static int set_cohort(const string &str) {
+  vector<string> vals = split_string(str, ',');
+  if (vals.size() != 2) {
+    printf("ERROR: wrong cohort format!\n");
+    return 1;
+  }
+  param.cohort = {atof(vals[0].c_str()), atof(vals[1].c_str())};
+  if (param.cohort.first <= 0 || param.cohort.first >= param.cohort.second ||
+      param.cohort.second >= 100) {
+    printf("ERROR: cohort percentiles should be 0 < typical < slow < 100\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* set ancestor path from "name" or "name#min,max" of each level,
+ * separated by '>' from the outermost one, eg, "a>b#100,inf>c" */
+static int set_ancestor(const string &str) {
+  param.ancestor = str;
+  param.ancestors.clear();
+  for (const string &level : split_string(str, '>')) {
+    AncestorLevel al = {level, {0, UINT64_MAX}};
+    int sep = level.find_first_of('#');
+    if (sep != string::npos) {
+      al.name = level.substr(0, sep);
+      al.latency = get_interval_from_string(level.substr(sep + 1));
+    }
+    for (AncestorLevel &prev : param.ancestors) {
+      if (prev.name == al.name) {
+        printf("ERROR: function %s is repeated in ancestor path\n", al.name.c_str());
+        return 1;
+      }
+    }
+    if (al.name == "") {
+      printf("ERROR: wrong ancestor format!\n");
+      return 1;
+    }
+    param.ancestors.push_back(al);
+  }
+  if (param.ancestors.size() > ANCESTOR_MAX_LEVELS) {
+    printf("ERROR: ancestor path has more than %d levels\n", ANCESTOR_MAX_LEVELS);
+    return 1;
+  }
+  return 0;
+}
+
+/* reset ancestor flags of actions for the ancestor of current query */
+void ThreadJob::mark_ancestor() {
+  for (Action &action : actions) {
+    if (action.is_error) continue;
+    action.ancestor_begin = action.ancestor_end = false;
+    if (!param.ancestors.empty())
+      action.init_for_ancestor(action.from->ancestor_idx, action.to->ancestor_idx);
+  }
+}
+
+/*
+ * Pair the calls and returns of each level of ancestor path by stacks in
+ * one pass, so recursive calls are paired correctly, and mark the calls
+ * within the latency interval of their level. A call without its return
+ * is out of the interval. Return empty if no level has an interval.
+ */
+vector<bool> ThreadJob::pair_ancestors() {
+  vector<bool> in_interval;
+  bool has_interval = false;
+  for (AncestorLevel &level : param.ancestors) {
+    if (level.latency.first != 0 || level.latency.second != UINT64_MAX)
+      has_interval = true;
+  }
+  if (!has_interval)
+    return in_interval;
+
+  in_interval.resize(actions.size(), false);
+  vector<vector<uint32_t>> stacks(param.ancestors.size());
+  for (size_t i = 0; i < actions.size(); ++i) {
+    Action &action = actions[i];
+    if (action.is_error) {
+      // the calls are discarded by trace error
+      for (vector<uint32_t> &stack : stacks)
+        stack.clear();
+      continue;
+    }
+    if (action.ancestor_begin) {
+      stacks[action.ancestor_idx].push_back(i);
+    } else if (action.ancestor_end && !stacks[action.ancestor_idx].empty()) {
+      vector<uint32_t> &stack = stacks[action.ancestor_idx];
+      std::pair<uint64_t, uint64_t> &interval =
+        param.ancestors[action.ancestor_idx].latency;
+      uint64_t al = action.ts - actions[stack.back()].ts;
+      in_interval[stack.back()] = (al >= interval.first && al <= interval.second);
+      stack.pop_back();
+    }
+  }
+  return in_interval;
+}
+
+/* set from_target and to_target of actions for the idx-th target */
+void ThreadJob::mark_target(size_t idx) {
+  int target_idx = (int)idx;
+  for (Action &action : actions) {
+    if (action.is_error) continue;
+    action.from_target = (action.from->target_idx == target_idx);
+    action.to_target = (action.to->target_idx == target_idx);
+  }
+}
+
+/* if the invocation of target starting at ts is sampled, by the hash of
+ * ts, so all passes and runs on the trace pick the same invocations */
+static inline bool is_sampled(uint64_t ts, uint32_t sample) {
+  if (sample <= 1)
+    return true;
+  // finalizer of splitmix64
+  ts = (ts ^ (ts >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  ts = (ts ^ (ts >> 27)) * 0x94d049bb133111ebULL;
+  ts ^= ts >> 31;
+  return ts % sample == 0;
+}
+
+void ThreadJob::do_analyze(size_t idx) {
+  FuncStat &stat = stats[idx];
+  const std::string &target = stat.opt.target;
   vector<Action> stack;
   FuncStat::LatencyChild child;
 
@@ -178,11 +439,19 @@ void ThreadJob::do_analyze() {
 
  // to obtain miss trace time
   Action *target_begin = nullptr;
+  size_t target_call = 0;
   bool prev_target_error = false;
-
-  // for ancestor filter
-  bool check_ancestor = (param.ancestor != "");
-  Action *ancestor_begin = nullptr;
+  target_calls.clear();
+
+  // for ancestor filter, each level has a stack of its calls with if
+  // they are in the path, and the number of calls in the path
+  bool check_ancestor = !param.ancestors.empty();
+  size_t levels = param.ancestors.size();
+  vector<vector<bool>> ancestor_calls(levels);
+  vector<uint32_t> ancestor_active(levels, 0);
+  vector<bool> ancestor_in_interval;
+  if (check_ancestor)
+    ancestor_in_interval = pair_ancestors();
 
   Action *cursor = nullptr;
   // if current execution chain is wrong
@@ -191,13 +460,20 @@ void ThreadJob::do_analyze() {
   // if is not interruption from zero offset of target function
   bool no_hw_int_from_head = true;
 
+  // if current invocation of target is not sampled
+  bool skipping = false;
+
   /* clear execution chain */
   auto clear_context = [&]() {
+    if (trace_writer) trace_writer->discard();
     stack.clear();
     child.clear();
     sched_in_child = sched_in_target = 0;
     sched_begin = nullptr;
-    ancestor_begin = nullptr;
+    for (size_t l = 0; l < levels; ++l) {
+      ancestor_calls[l].clear();
+      ancestor_active[l] = 0;
+    }
   };
 
   /* add one child function latency */
@@ -210,8 +486,7 @@ void ThreadJob::do_analyze() {
     if (likely(param.call_line)) {
       if (unlikely(gather_call_line) && !param.unfold_gathered_line) {
         funcname_add_string_mark(child_name, GATHER_CALL_LINE);
-      } else if (child_name != param.target
-          && child_name != param.ancestor) {
+      } else if (child_name != target && a1->to->ancestor_idx < 0) {
         // show the source line of the call address
         funcname_add_addr(child_name, a1->from->addr);
       }
@@ -226,6 +501,8 @@ void ThreadJob::do_analyze() {
     child.add_target(child_name, lat_t);
     child.add_sched(child_name, lat_s);
     sched_in_child = 0;
+    if (trace_writer && !unknown)
+      trace_writer->add_event(a1->to->name, "child", a1->ts, lat_t);
   };
 
   /* add code block latency */
@@ -237,6 +514,8 @@ void ThreadJob::do_analyze() {
     uint64_t lat_s = sched_in_child;
     child.add_target(child_name, lat_t);
     child.add_sched(child_name, lat_s);
+    if (trace_writer)
+      trace_writer->add_event(child_name, "code_block", a1->ts, lat_t);
     // set to obtain srcline of code block
     if(!srcline_map.get(child_name + "_from"))
       srcline_map.put(child_name + "_from", a1->to->addr);
@@ -259,6 +538,17 @@ void ThreadJob::do_analyze() {
       continue;
     }
 
+    if (!action.from_target && !action.to_target &&
+        !action.sched_begin && !action.sched_end &&
+        !action.ancestor_begin && !action.ancestor_end) {
+      /* action of other targets */
+      continue;
+    }
+    if (!param.code_block && action.from_target && action.to_target) {
+      /* inner-function jump of current target */
+      continue;
+    }
+
     if (action.to->offset == 0 && action.to_target && no_hw_int_from_head) {
        /* new target function is called, add child function
         * of previous round */
@@ -282,6 +572,7 @@ void ThreadJob::do_analyze() {
        }
        /* this action is the start point for target function,
         * clear context in previous round. */
+       if (trace_writer) trace_writer->discard();
        stack.clear();
        stack.push_back(action);
        sched_in_target = sched_in_child = 0;
@@ -294,58 +585,57 @@ void ThreadJob::do_analyze() {
        if (unlikely(prev_target_error)) {
          /* if error occurs in previous round,
           * calculate the trace missing time */
-         if (target_begin)
+         if (target_begin && idx == 0)
            gstat.miss.fetch_add(action.ts - target_begin->ts);
          prev_target_error = false;
        }
        target_begin = &action;
+       target_call = i;
        wrong_chain = false; // reset
        cursor = &action;
+       skipping = !is_sampled(action.ts, stat.opt.sample);
+       if (skipping)
+         stack.clear();
        continue;
     }
 
     if (check_ancestor) {
-      /* filter actions by ancestor function */
-      if (action.ancestor_begin) {
-        // ancestor begin now
-        // clear_context();
-        ancestor_begin = &action;
-        gstat.ancestor_begin.fetch_add(1);
-        if (param.ancestor_latency.first != 0 ||
-            param.ancestor_latency.second != UINT64_MAX) {
-          // find the ancestor end in follow actions
-          Action *ancestor_end = nullptr;
-          for (size_t j = i; j < actions.size(); ++j) {
-            if (actions[j].ancestor_end) {
-              ancestor_end = &actions[j];
-              break;
-            }
-          }
-          if (ancestor_end) {
-            uint64_t al = ancestor_end->ts - ancestor_begin->ts;
-            if (al < param.ancestor_latency.first ||
-                al > param.ancestor_latency.second) {
-              // discard if not within ancestor latency
-              ancestor_begin = nullptr;
-            }
-          } else {
-            // incomplete ancestor calls
-            ancestor_begin = nullptr;
+      /* filter actions by ancestor path */
+      if (action.ancestor_begin || action.ancestor_end) {
+        size_t level = action.ancestor_idx;
+        vector<bool> &calls = ancestor_calls[level];
+        if (action.ancestor_begin) {
+          // in the path if the outer level is in the path,
+          // and its latency is within the interval
+          bool in_path = (level == 0 || ancestor_active[level - 1] > 0) &&
+            (ancestor_in_interval.empty() || ancestor_in_interval[i]);
+          calls.push_back(in_path);
+          if (in_path)
+            ++ancestor_active[level];
+          if (level + 1 == levels)
+            gstat.ancestor_begin.fetch_add(1);
+        } else {
+          if (!calls.empty()) {
+            if (calls.back())
+              --ancestor_active[level];
+            calls.pop_back();
           }
+          if (level + 1 == levels)
+            gstat.ancestor_end.fetch_add(1);
         }
         continue;
-      } else if (action.ancestor_end) {
-        /* ancestor is end */
-        ancestor_begin = nullptr;
-        gstat.ancestor_end.fetch_add(1);
-        continue;
-      } else if (!ancestor_begin) {
-        /* we only add target function within the ancestor,
+      } else if (!ancestor_active[levels - 1]) {
+        /* we only add target function within the ancestor path,
          * other targets is discard. */
         continue;
       }
     }
 
+    if (skipping) {
+      /* actions of the invocation not sampled */
+      continue;
+    }
+
     if (action.sched_begin) {
       /* thread is schedule-out */
       sched_begin = &action;
@@ -360,6 +650,8 @@ void ThreadJob::do_analyze() {
         sched_in_target += sched_time;
         sched_in_child += sched_time;
         ++stat.sched_count;
+        if (trace_writer)
+          trace_writer->add_event("sched-out", "sched", sched_begin->ts, sched_time);
         sched_begin = nullptr;
       } else {
         /* ERROR: the schedule has not started, but sched_end occurs. */
@@ -368,7 +660,10 @@ void ThreadJob::do_analyze() {
       continue;
     }
 
-    if ((action.type == PT_ACTION_JMP || action.type == PT_ACTION_JCC)) {
+    /* the branch type relative to current target, actions are shared
+     * by all targets, so do not change action.type */
+    uint8_t type = action.type;
+    if ((type == PT_ACTION_JMP || type == PT_ACTION_JCC)) {
       /* change jmp/jcc instruction to call/return */
       if (action.from_target && action.to_target) {
         // internal jump, just add code block latency
@@ -377,11 +672,11 @@ void ThreadJob::do_analyze() {
         continue;
       } else if (action.from_target) {
         // change jmp instruction to call/return
-        if (!action.to->offset) action.type = PT_ACTION_CALL;
-        else action.type = PT_ACTION_RETURN;
+        if (!action.to->offset) type = PT_ACTION_CALL;
+        else type = PT_ACTION_RETURN;
       } else {
         assert(action.to_target);
-        action.type = PT_ACTION_RETURN;
+        type = PT_ACTION_RETURN;
       }
     }
 
@@ -395,7 +690,7 @@ void ThreadJob::do_analyze() {
     }
 
     /* process one execution chain */
-    switch (action.type) {
+    switch (type) {
       case PT_ACTION_TR_START:
         /* for ipfiltering, usually means return from child. */
         if (!stack.empty() &&
@@ -422,6 +717,7 @@ void ThreadJob::do_analyze() {
         /* this is call to child function */
         if (param.code_block) add_code_block(cursor, &action);
         stack.push_back(action);
+        stack.back().type = type;
         if (sched_begin) {
           /* ERROR: the schedule is not finished when the child function is called */
           report_error_action("schedule begin in child", sched_begin, param.verbose);
@@ -439,11 +735,22 @@ void ThreadJob::do_analyze() {
         if (stack.size() == 1 && action.from_target && stack[0].to_target) {
           // the execution chain is done
           stat.add(stack[0], action, sched_in_target, child);
+          if (stat.in_interval(stack[0].ts, action.ts - stack[0].ts))
+            target_calls.push_back(target_call);
+          if (trace_writer) {
+            uint64_t lat = action.ts - stack[0].ts;
+            if (stat.in_interval(stack[0].ts, lat)) {
+              trace_writer->add_event(target, "target", stack[0].ts, lat);
+              trace_writer->commit();
+            } else {
+              trace_writer->discard();
+            }
+          }
           child.clear();
           sched_in_target = 0;
           stack.clear();
         } else if (!stack.empty() && stack.back().from_target
-            && action.type != PT_ACTION_TR_END_RETURN) {
+            && type != PT_ACTION_TR_END_RETURN) {
           bool gather_call_line = (action.type == PT_ACTION_IRET);
           /* for non-ipfiltering, return to target function from child function */
           add_one_child(&stack.back(), &action, false, gather_call_line);
@@ -469,14 +776,274 @@ void ThreadJob::do_analyze() {
   }
 }
 
+/*
+ * Build the calling-context tree below target function. Each call pushes a
+ * frame with the tree node of its call path, and it is closed by the return
+ * to its caller, so that tail calls and missing returns are also handled.
+ * Calls deeper than cct_depth have no node, their time is exclusive time of
+ * the deepest node. A recursive call of target is a child node of the tree.
+ * Only the calls of target counted by do_analyze are roots, so the tree has
+ * the same --li/--ti, ancestor and --sample filters.
+ */
+void ThreadJob::build_call_tree(size_t idx) {
+  FuncStat &stat = stats[idx];
+  struct Frame {
+    CallTreeNode *node;  // nullptr if deeper than cct_depth
+    Symbol *caller;
+    uint8_t type;
+    uint32_t depth;
+    uint64_t ts;
+    uint64_t child_incl;
+    uint64_t sched;
+    uint64_t child_sched;
+  };
+  vector<Frame> frames;
+  Action *sched_begin = nullptr;
+
+  auto push_frame = [&](Action &action, uint8_t type) {
+    Frame f = {&stat.cct, action.from, type, 0, action.ts, 0, 0, 0};
+    if (!frames.empty()) {
+      Frame &parent = frames.back();
+      f.depth = parent.depth + 1;
+      f.node = (parent.node && f.depth <= param.cct_depth) ?
+                  parent.node->get_child(action.to->name) : nullptr;
+    }
+    frames.push_back(f);
+  };
+  auto pop_frame = [&](uint64_t ts) {
+    Frame f = frames.back();
+    frames.pop_back();
+    uint64_t incl = ts - f.ts;
+    uint64_t sched_incl = f.sched + f.child_sched;
+    if (f.node) {
+      f.node->count++;
+      f.node->incl += incl;
+      f.node->excl += (incl > f.child_incl) ? incl - f.child_incl : 0;
+      f.node->sched_incl += sched_incl;
+      f.node->sched_excl += f.sched;
+    }
+    if (!frames.empty()) {
+      if (f.node) {
+        frames.back().child_incl += incl;
+        frames.back().child_sched += sched_incl;
+      } else {
+        // call without node is a part of its parent
+        frames.back().sched += sched_incl;
+      }
+    }
+  };
+
+  for (size_t i = 0; i < actions.size(); ++i) {
+    Action &action = actions[i];
+    if (unlikely(action.is_error)) {
+      /* discard current execution chain */
+      frames.clear();
+      sched_begin = nullptr;
+      continue;
+    }
+    if (action.sched_begin) {
+      sched_begin = &action;
+      continue;
+    }
+    if (action.sched_end) {
+      if (sched_begin && !frames.empty())
+        frames.back().sched += action.ts - sched_begin->ts;
+      sched_begin = nullptr;
+      continue;
+    }
+
+    uint8_t type = action.type;
+    if (type == PT_ACTION_JMP || type == PT_ACTION_JCC) {
+      if (action.from->equal(action.to)) {
+        // inner-function jump
+        continue;
+      }
+      type = action.to->offset ? PT_ACTION_RETURN : PT_ACTION_CALL;
+    }
+
+    switch (type) {
+      case PT_ACTION_HW_INT:
+      case PT_ACTION_TR_END_HW_INT:
+      case PT_ACTION_CALL:
+      case PT_ACTION_TR_END_SYSCALL:
+      case PT_ACTION_TR_END_CALL:
+      case PT_ACTION_TR_END:
+        if (!frames.empty()) {
+          push_frame(action, type);
+        } else if (action.to_target && action.to->offset == 0 &&
+                   is_target_call(i)) {
+          /* target function is called, it is the root of tree */
+          push_frame(action, type);
+        }
+        break;
+      case PT_ACTION_TR_START:
+        if (!frames.empty() && (frames.back().type == PT_ACTION_TR_END ||
+            frames.back().type == PT_ACTION_TR_END_HW_INT ||
+            frames.back().type == PT_ACTION_TR_END_CALL ||
+            frames.back().type == PT_ACTION_TR_END_SYSCALL)) {
+          pop_frame(action.ts);
+        } else {
+          frames.clear();
+        }
+        break;
+      case PT_ACTION_IRET:
+      case PT_ACTION_RETURN:
+      case PT_ACTION_TR_END_RETURN: {
+        if (frames.empty()) break;
+        /* return to the caller of one frame, close the frames above it */
+        size_t k = frames.size();
+        while (k > 0 && !frames[k - 1].caller->equal(action.to)) --k;
+        if (k == 0) {
+          // not a return of the calls, discard the chain
+          if (action.type != PT_ACTION_JMP && action.type != PT_ACTION_JCC)
+            frames.clear();
+          break;
+        }
+        while (frames.size() >= k) pop_frame(action.ts);
+        break;}
+      default:
+        break;
+    }
+  }
+}
+
+/*
+ * Aggregate latency of target function by its caller path. Calls and
+ * returns of all functions are kept in a shadow stack, the callers of
+ * target are read from it when target is called. Paths are merged in a
+ * tree, so that each call only adds to caller_depth nodes at most. As the
+ * calling-context tree, only the calls of target counted by do_analyze are
+ * added, with the same --li/--ti, ancestor and --sample filters.
+ */
+void ThreadJob::build_caller_tree(size_t idx) {
+  FuncStat &stat = stats[idx];
+  struct Frame {
+    Symbol *caller;
+    uint8_t type;
+  };
+  vector<Frame> frames;
+  Action *sched_begin = nullptr;
+
+  // the outermost call of target, its frame is frames[target_frame - 1]
+  size_t target_frame = 0;
+  uint64_t target_ts = 0;
+  uint64_t target_sched = 0;
+  vector<CallTreeNode *> path;
+
+  auto begin_target = [&](Action &action) {
+    path.clear();
+    path.push_back(&stat.caller_tree);
+    Symbol *caller = action.from;
+    size_t k = frames.size();
+    while (caller && path.size() <= param.caller_depth) {
+      path.push_back(path.back()->get_child(caller->name));
+      caller = k > 0 ? frames[--k].caller : nullptr;
+    }
+    target_frame = frames.size() + 1;
+    target_ts = action.ts;
+    target_sched = 0;
+  };
+  auto end_target = [&](uint64_t ts) {
+    for (CallTreeNode *node : path) {
+      node->count++;
+      node->incl += ts - target_ts;
+      node->sched_incl += target_sched;
+    }
+    target_frame = 0;
+  };
+  auto clear_context = [&]() {
+    frames.clear();
+    target_frame = 0;
+    sched_begin = nullptr;
+  };
+
+  for (size_t i = 0; i < actions.size(); ++i) {
+    Action &action = actions[i];
+    if (unlikely(action.is_error)) {
+      /* discard current execution chain */
+      clear_context();
+      continue;
+    }
+    if (action.sched_begin) {
+      sched_begin = &action;
+      continue;
+    }
+    if (action.sched_end) {
+      if (sched_begin && target_frame)
+        target_sched += action.ts - sched_begin->ts;
+      sched_begin = nullptr;
+      continue;
+    }
+
+    uint8_t type = action.type;
+    if (type == PT_ACTION_JMP || type == PT_ACTION_JCC) {
+      if (action.from->equal(action.to)) {
+        // inner-function jump
+        continue;
+      }
+      type = action.to->offset ? PT_ACTION_RETURN : PT_ACTION_CALL;
+    }
+
+    switch (type) {
+      case PT_ACTION_HW_INT:
+      case PT_ACTION_TR_END_HW_INT:
+      case PT_ACTION_CALL:
+      case PT_ACTION_TR_END_SYSCALL:
+      case PT_ACTION_TR_END_CALL:
+      case PT_ACTION_TR_END:
+        if (!target_frame && action.to_target && action.to->offset == 0 &&
+            is_target_call(i))
+          begin_target(action);
+        frames.push_back({action.from, type});
+        break;
+      case PT_ACTION_TR_START:
+        if (!frames.empty() && (frames.back().type == PT_ACTION_TR_END ||
+            frames.back().type == PT_ACTION_TR_END_HW_INT ||
+            frames.back().type == PT_ACTION_TR_END_CALL ||
+            frames.back().type == PT_ACTION_TR_END_SYSCALL)) {
+          frames.pop_back();
+          if (frames.size() < target_frame)
+            end_target(action.ts);
+        } else {
+          clear_context();
+        }
+        break;
+      case PT_ACTION_IRET:
+      case PT_ACTION_RETURN:
+      case PT_ACTION_TR_END_RETURN: {
+        /* return to the caller of one frame, close the frames above it,
+         * return from the bottom is for the calls before tracing */
+        if (frames.empty()) break;
+        size_t k = frames.size();
+        while (k > 0 && !frames[k - 1].caller->equal(action.to)) --k;
+        if (k == 0) {
+          // not a return of the calls, discard the chain
+          if (action.type != PT_ACTION_JMP && action.type != PT_ACTION_JCC)
+            clear_context();
+          break;
+        }
+        frames.resize(k - 1);
+        if (frames.size() < target_frame)
+          end_target(action.ts);
+        break;}
+      default:
+        break;
+    }
+  }
+}
+
 void ThreadJob::extract_actions() {
   uint32_t total_actions = 0;
-  vector<ParseJob *> &parse_jobs = *parse_jobs_ptr;
-  uint32_t parse_job_num = parse_jobs.size();
-  for (ParseJob *parse_job : parse_jobs) {
-    total_actions += parse_job->parsed_actions_num(tid);
-    total_actions += parse_job->error_actions_num(tid);
+  vector<ParseJob *> parse_jobs;
+  for (ParseJob *parse_job : *parse_jobs_ptr) {
+    size_t num = parse_job->parsed_actions_num(tid) +
+                 parse_job->error_actions_num(tid);
+    // only merge the parse jobs having actions of this thread
+    if (num > 0)
+      parse_jobs.push_back(parse_job);
+    total_actions += num;
   }
+  uint32_t parse_job_num = parse_jobs.size();
   actions.reserve(total_actions);
 
   // extract thread actions (parsed + error action) from mutiple parse job by merge sort
@@ -514,21 +1081,66 @@ void ThreadJob::extract_actions() {
   assert(actions.size() == total_actions);
 }
 
+/* if branches out of target functions are needed */
+static bool need_all_branches() {
+  return param.caller_depth || param.build_index || param.interactive;
+}
+
+/*
+ * The target index of symbol, cached in symbol to avoid string compare.
+ * The cache is written without lock, it is safe as only one thread writes
+ * a symbol: each parse job resolves the symbols of its own SymbolMgr, the
+ * shared index_sym_mgr is resolved by load_action_index before the parse
+ * jobs start, and set_query_targets resolves all symbols again between
+ * queries, while no job runs. ThreadJobs only read the cached index.
+ */
+static inline int get_target_idx(Symbol *sym) {
+  if (unlikely(sym->target_idx == SYMBOL_TARGET_UNKNOWN)) {
+    auto it = target_idx_map.find(sym->name);
+    sym->target_idx =
+      (it != target_idx_map.end()) ? it->second : SYMBOL_NOT_TARGET;
+  }
+  return sym->target_idx;
+}
+
+/* the level of symbol in ancestor path, cached like get_target_idx,
+ * under the same single writer rule */
+static inline int get_ancestor_idx(Symbol *sym) {
+  if (unlikely(sym->ancestor_idx == SYMBOL_TARGET_UNKNOWN)) {
+    auto it = ancestor_idx_map.find(sym->name);
+    sym->ancestor_idx =
+      (it != ancestor_idx_map.end()) ? it->second : SYMBOL_NOT_TARGET;
+  }
+  return sym->ancestor_idx;
+}
+
+/* set ancestor_idx_map from the levels of ancestor path */
+static void set_ancestor_idx_map() {
+  ancestor_idx_map.clear();
+  for (size_t i = 0; i < param.ancestors.size(); ++i) {
+    ancestor_idx_map[param.ancestors[i].name] = i;
+  }
+}
+
 void ParseJob::decode_to_actions() {
+  bool keep_all = (param.cct_depth || need_all_branches());
   auto init_action = [&](Action &action) -> void {
     if (action.pt_type != PT_ACTION_TYPE_BRANCH && 
         action.pt_type != PT_ACTION_TYPE_ERROR) {
       return;
     }
+    ++decoded;
     if (action.is_error) {
       /* add to error action set */
       add_error_action(action);
       return;
     }
-    action.from_target =
-      (action.from->name == param.target) ? true : false;
-    action.to_target =
-      (action.to->name == param.target) ? true : false;
+    /* mark the first target, ThreadJob marks others for multiple targets */
+    int from_idx = get_target_idx(action.from);
+    int to_idx = get_target_idx(action.to);
+    action.from_target = (from_idx == 0);
+    action.to_target = (to_idx == 0);
+    bool is_target = (from_idx >= 0 || to_idx >= 0);
 
     /* action for offcpu */
     action.sched_begin = action.sched_end = false;
@@ -536,46 +1148,84 @@ void ParseJob::decode_to_actions() {
       action.init_for_sched();
     }
 
-    /* action for ancestor function */
+    /* action for ancestor path */
     action.ancestor_begin = action.ancestor_end = false;
-    if (param.ancestor != "") {
-      action.init_for_ancestor(param.ancestor);
+    if (!param.ancestors.empty()) {
+      action.init_for_ancestor(get_ancestor_idx(action.from),
+                               get_ancestor_idx(action.to));
     }
 
-    if (!action.from_target && !action.to_target &&
+    if (!is_target && !keep_all &&
         !action.sched_begin && !action.sched_end &&
         !action.ancestor_begin && !action.ancestor_end) {
       /* current action does not contain target, ancestor,
-       * and sched functions, discard it */
+       * and sched functions, discard it, unless the calls
+       * below target are needed for calling-context tree, or
+       * all calls are needed for caller paths, index and queries */
       return;
     }
-    if (!param.code_block && action.from_target && action.to_target) {
-      /* inner-function jump, discard it */
+    if (!param.code_block && !param.build_index &&
+        from_idx >= 0 && from_idx == to_idx) {
+      /* inner-function jump, discard it, but keep it in the index for
+       * the queries of code blocks */
       return;
     }
     /* add to action set */
-    add_action(action);
+    add_action(action, is_target);
     return;
   };
 
-  if (param.compact_format) {
-    read_actions_from_compact_file(filename,
-        id, sym_mgr, init_action); 
+  if (param.history == 4) {
+    ActionIndexReader reader;
+    if (reader.open(filename)) {
+      bytes = reader.read_actions(index_sym_mgr, param.time_interval.first,
+          param.time_interval.second, init_action);
+      read_bytes.store(bytes);
+    }
+  } else if (param.compact_format) {
+    bytes = read_actions_from_compact_file(filename,
+        id, sym_mgr, init_action, &read_bytes); 
   } else {
-    read_actions_from_text_file(filename,
-        id, from, to, sym_mgr, init_action); 
+    bytes = read_actions_from_text_file(filename,
+        id, from, to, sym_mgr, init_action, &read_bytes); 
+  }
+}
+
+/* merge the stat of one thread into another */
+class StatMergeJob : public ParallelJob {
+public:
+  StatMergeJob(FuncStat *d, FuncStat *s) : dst(d), src(s) {}
+  void exec() override { dst->merge(*src); }
+  const char *job_name() override { return "merge"; }
+private:
+  FuncStat *dst;
+  FuncStat *src;
+};
+
+/* merge stats pairwise by workers, into the first one */
+static void merge_stats(vector<FuncStat *> &stats) {
+  for (size_t step = 1; step < stats.size(); step *= 2) {
+    vector<StatMergeJob> merge_jobs;
+    for (size_t i = 0; i + step < stats.size(); i += 2 * step) {
+      merge_jobs.emplace_back(stats[i], stats[i + step]);
+    }
+    for (size_t i = 0; i < merge_jobs.size(); ++i) {
+      worker_pool.add_job(&merge_jobs[i], i);
+    }
+    worker_pool.wait_all_idle();
   }
 }
 
-static void print_stat(FuncStat::Option &opt,
-    unordered_map<long, ThreadJob *> &thread_jobs) {
+static void print_stat(FuncStat::Option &opt, size_t idx,
+    unordered_map<long, ThreadJob *> &thread_jobs, ShardWriter *shard) {
   auto t1 = ut_time_now();
+  self_profiler.begin_phase("print stat");
   if (param.timeline) {
     vector<std::pair<long, ThreadJob *>> vec(thread_jobs.begin(), thread_jobs.end());
     std::sort(vec.begin(), vec.end());
     for (const auto &it: vec) {
       ThreadJob *thread_job = it.second;
-      FuncStat &stat = thread_job->get_stat();
+      FuncStat &stat = thread_job->get_stat(idx);
       char title[1024];
       snprintf(title, 1024, "\nThread %ld: ", thread_job->get_tid());
       print_title(title);
@@ -584,20 +1234,40 @@ static void print_stat(FuncStat::Option &opt,
   } else {
     FuncStat stat(opt, &srcline_map);
     /* merge all threads' latency */
+    vector<FuncStat *> stats;
     for (auto it = thread_jobs.begin(); it != thread_jobs.end(); ++it) {
-      ThreadJob *thread = it->second;
-      stat.merge(thread->get_stat());
+      stats.push_back(&it->second->get_stat(idx));
+    }
+    merge_stats(stats);
+    if (!stats.empty())
+      stat.merge(*stats[0]);
+    if (shard) {
+      // srclines are saved in shard, the binary may not exist when merging
+      if (opt.call_line)
+        stat.generate_srcline();
+      stat.save(*shard);
     }
     stat.print();
   }
+  self_profiler.end_phase();
   auto t2 = ut_time_now();
   printf("[ print stat has consumed %.2f seconds ]\n",
           ut_time_diff(t2, t1));
 }
 
 static void assign_parse_jobs(vector<ParseJob *> &parse_jobs) {
-  if (param.parallel_script) {
-    for (size_t i = 0; i < param.worker_num; ++i) {
+  if (param.history == 4) {
+    /* one parse job for each thread in the index */
+    vector<string> tids = split_string(param.tid, ',');
+    for (long tid : ActionIndexReader::list_threads(ACTION_INDEX_DIR)) {
+      if (!tids.empty() &&
+          std::find(tids.begin(), tids.end(), to_string(tid)) == tids.end())
+        continue;
+      string filename = ActionIndexReader::thread_file(ACTION_INDEX_DIR, tid);
+      parse_jobs.push_back(new ParseJob(filename, 0, UINT32_MAX, parse_jobs.size()));
+    }
+  } else if (param.parallel_script) {
+    for (size_t i = 0; i < param.script_files; ++i) {
       char filename[1024];
       sprintf(filename, SCRIPT_FILE_PREFIX "__%05d", i);
       parse_jobs.push_back(new ParseJob(string(filename), 0, UINT32_MAX, i));
@@ -624,7 +1294,8 @@ static void assign_thread_jobs(vector<ParseJob *> &parse_jobs,
     // create thread jobs
     parse_job->loop_parsed_actions([&](ActionSet &as) {
       long tid = as.tid;
-      if (!thread_jobs.count(tid) && as.target > 0) {
+      // the target of queries is unknown in interactive mode
+      if (!thread_jobs.count(tid) && (as.target > 0 || param.interactive)) {
          thread_jobs[tid] = new ThreadJob(tid, &parse_jobs);
       }
       gstat.update_real(as);
@@ -640,10 +1311,67 @@ static void assign_thread_jobs(vector<ParseJob *> &parse_jobs,
   printf("[ parsed %d actions, trace errors: %d ]\n", total_actions, error_actions);
 }
 
-/*
- * Main function for analyzing performance of function
- * */
-static void analyze_funcs() {
+/* save actions of all threads as the action index */
+static void build_action_index(vector<ParseJob *> &parse_jobs) {
+  auto t1 = ut_time_now();
+  self_profiler.begin_phase("build action index");
+  if (!check_path_exist(ACTION_INDEX_DIR) && create_directory(ACTION_INDEX_DIR)) {
+    printf("ERROR: Failed to create action index directory!\n");
+    exit(1);
+  }
+  ActionIndexWriter writer(ACTION_INDEX_DIR);
+  unordered_map<long, bool> tids;
+  for (ParseJob *parse_job : parse_jobs) {
+    writer.add_symbols(parse_job->get_sym_mgr());
+    parse_job->loop_parsed_actions([&](ActionSet &as) { tids[as.tid] = true; });
+    parse_job->loop_error_actions([&](ActionSet &as) { tids[as.tid] = true; });
+  }
+  if (!writer.write_symbols()) {
+    printf("ERROR: Failed to write symbols of action index!\n");
+    exit(1);
+  }
+
+  vector<IndexBuildJob *> build_jobs;
+  for (auto it = tids.begin(); it != tids.end(); ++it) {
+    build_jobs.push_back(new IndexBuildJob(it->first, &parse_jobs, &writer));
+    worker_pool.add_job(build_jobs.back(), build_jobs.size());
+  }
+  worker_pool.wait_all_idle();
+  for (IndexBuildJob *job : build_jobs) {
+    if (job->is_failed())
+      printf("ERROR: Failed to write action index of thread %ld\n", job->get_tid());
+    delete job;
+  }
+  self_profiler.end_phase();
+  auto t2 = ut_time_now();
+  printf("[ build action index of %lu threads has consumed %.2f seconds ]\n",
+          tids.size(), ut_time_diff(t2, t1));
+}
+
+/* load symbols of the action index, and mark the target functions */
+static void load_action_index() {
+  if (!check_path_exist(ACTION_INDEX_DIR "/" ACTION_INDEX_SYMBOLS)) {
+    printf("ERROR: action index is not found, build it by --build_index first\n");
+    exit(1);
+  }
+  if (!ActionIndexReader::load_symbols(ACTION_INDEX_DIR, index_sym_mgr))
+    exit(1);
+  // refuse an index of other version before any query
+  for (long tid : ActionIndexReader::list_threads(ACTION_INDEX_DIR)) {
+    ActionIndexReader reader;
+    if (!reader.open(ActionIndexReader::thread_file(ACTION_INDEX_DIR, tid)))
+      exit(1);
+    break;
+  }
+  // the target index is cached before parse jobs share the symbols
+  index_sym_mgr.loop_symbols([&](Symbol *sym) {
+    get_target_idx(sym);
+    get_ancestor_idx(sym);
+  });
+}
+
+/* stat option of each target function */
+static vector<FuncStat::Option> get_stat_options() {
   FuncStat::Option stat_opt = {
      param.target,
      param.offcpu,
@@ -655,52 +1383,596 @@ static void analyze_funcs() {
      param.timeline,
      param.time_start,
      param.timeline_unit,
-     param.ip_filtering};
-
-  /* 1. dispatch parse_jobs */
-  vector<ParseJob *> parse_jobs;
-  assign_parse_jobs(parse_jobs);
-  
-  // do parse jobs
-  auto t1 = ut_time_now();
-  for (size_t i = 0; i < parse_jobs.size(); ++i) {
-    worker_pool.add_job(parse_jobs[i], i);
+     param.ip_filtering,
+     param.cct_depth,
+     param.caller_depth,
+     param.top_k,
+     0, 0,
+     param.heatmap,
+     0,
+     param.max_keys,
+     param.sample,
+     false};
+  if (param.heatmap && gstat.real.second > gstat.real.first) {
+    // windows cover the real trace time
+    stat_opt.heatmap_unit =
+      (gstat.real.second - gstat.real.first) / param.heatmap + 1;
   }
-  worker_pool.wait_all_idle();
-  auto t2 = ut_time_now();
 
-  printf("[ parse actions has consumed %.2f seconds ]\n",
-          ut_time_diff(t2, t1));
+  vector<FuncStat::Option> stat_opts(param.targets.size(), stat_opt);
+  for (size_t k = 0; k < param.targets.size(); ++k) {
+    stat_opts[k].target = param.targets[k];
+  }
+  return stat_opts;
+}
 
-  /* 2. analyze function for each thread */
-  unordered_map<long, ThreadJob*> thread_jobs;
-  assign_thread_jobs(parse_jobs, thread_jobs);
-  stat_opt.time_start = param.time_start;
+/* print the latency of the finished thread jobs periodically until all
+ * of them are finished, the stats of finished jobs are only read */
+static void report_analyze_progress(unordered_map<long, ThreadJob*> &thread_jobs,
+    vector<FuncStat::Option> &stat_opts, std::chrono::steady_clock::time_point start) {
+  vector<FuncStat> partial;
+  for (FuncStat::Option &opt : stat_opts)
+    partial.emplace_back(opt, &srcline_map);
+  unordered_set<long> finished;
+  uint64_t actions = 0;
+  while (!worker_pool.wait_all_idle_for(param.progress)) {
+    for (auto it = thread_jobs.begin(); it != thread_jobs.end(); ++it) {
+      ThreadJob *job = it->second;
+      if (finished.count(it->first) || !job->is_done())
+        continue;
+      finished.insert(it->first);
+      actions += job->job_items();
+      for (size_t k = 0; k < partial.size(); ++k)
+        partial[k].merge_summary(job->get_stat(k));
+    }
+    printf("[ progress: analyzed %lu/%lu threads, %lu actions, %.2f seconds ]\n",
+           finished.size(), thread_jobs.size(), actions,
+           ut_time_diff(ut_time_now(), start));
+    for (FuncStat &stat : partial)
+      stat.print_summary(PROGRESS_TOP_CHILDREN);
+    fflush(stdout);
+  }
+}
 
-  // do thread job
+/* run the thread jobs to analyze target functions */
+static void run_thread_jobs(unordered_map<long, ThreadJob*> &thread_jobs,
+    vector<FuncStat::Option> &stat_opts, bool cohort_pass = false) {
   size_t i = 0;
-  t1 = ut_time_now();
+  auto t1 = ut_time_now();
+  self_profiler.begin_phase("analyze functions");
   for (auto it = thread_jobs.begin(); it != thread_jobs.end(); ++it, ++i) {
-    it->second->init_stat(stat_opt);
+    if (cohort_pass)
+      it->second->init_cohort(stat_opts);
+    else
+      it->second->init_stat(stat_opts);
     worker_pool.add_job(it->second, i);
   }
+  if (param.progress > 0)
+    report_analyze_progress(thread_jobs, stat_opts, t1);
   worker_pool.wait_all_idle();
-  t2 = ut_time_now();
+  self_profiler.end_phase();
+  auto t2 = ut_time_now();
 
   printf("[ analyze functions has consumed %.2f seconds ]\n",
           ut_time_diff(t2, t1));
+}
+
+/*
+ * Set the latency thresholds of typical and slow calls from the merged
+ * distribution of the first pass, then analyze again to gather the child
+ * latency of both cohorts. The actions are kept in thread jobs, and only
+ * do_analyze is run again.
+ * */
+static void split_cohort(unordered_map<long, ThreadJob*> &thread_jobs,
+    vector<FuncStat::Option> &stat_opts) {
+  for (size_t k = 0; k < stat_opts.size(); ++k) {
+    Distribution dist;
+    for (auto &it : thread_jobs) {
+      dist.merge_slots(it.second->get_stat(k).latency.target);
+    }
+    // slots are too coarse to split, slow calls are all in the slot of
+    // its percentile, and typical calls are below that slot
+    uint64_t slow_high = dist.get_percentile(param.cohort.second);
+    uint64_t slow_low = slow_high > 1 ? (slow_high + 1) / 2 : 1;
+    stat_opts[k].cohort_slow = slow_low;
+    stat_opts[k].cohort_fast =
+      std::min(dist.get_percentile(param.cohort.first), slow_low - 1);
+  }
+  // the global status is counted in the first pass
+  uint64_t miss = gstat.miss.load();
+  uint64_t ancestor_begin = gstat.ancestor_begin.load();
+  uint64_t ancestor_end = gstat.ancestor_end.load();
+  run_thread_jobs(thread_jobs, stat_opts, true);
+  gstat.miss.store(miss);
+  gstat.ancestor_begin.store(ancestor_begin);
+  gstat.ancestor_end.store(ancestor_end);
+}
+
+/* concatenate the trace events streamed by thread jobs */
+static void export_chrome_trace(unordered_map<long, ThreadJob*> &thread_jobs) {
+  vector<long> tids;
+  for (auto &it : thread_jobs)
+    tids.push_back(it.first);
+  std::sort(tids.begin(), tids.end());
+  if (!ChromeTraceWriter::concat(param.chrome_trace, tids))
+    printf("ERROR: Failed to write chrome trace %s\n", param.chrome_trace.c_str());
+  else
+    printf("[ chrome trace is saved to %s ]\n", param.chrome_trace.c_str());
+}
+
+/* write the head of stat shard, the stats are written after it. The shard
+ * is written to a temporary file, and renamed to 'file' when it is closed,
+ * so a reader never sees a partial shard. */
+static ShardWriter *open_shard(const string &file, size_t thread_num,
+    FuncGlobalStatus &status, size_t stat_num) {
+  ShardWriter *shard = new ShardWriter(file + ".tmp");
+  shard->put_u64(STAT_SHARD_MAGIC);
+  shard->put_u64(STAT_SHARD_VERSION);
+  shard->put_u64(thread_num);
+  shard->put_str(param.ancestor);
+  status.save(*shard);
+  shard->put_u64(stat_num);
+  return shard;
+}
+
+/* write the srclines of stats, and close the stat shard */
+static void close_shard(ShardWriter *shard, const string &file) {
+  vector<pair<string, string>> srclines;
+  srcline_map.loop_srcline([&](const string &name, const string &srcline) {
+    srclines.emplace_back(name, srcline);
+  });
+  shard->put_u64(srclines.size());
+  for (auto &it : srclines) {
+    shard->put_str(it.first);
+    shard->put_str(it.second);
+  }
+  string tmp_file = file + ".tmp";
+  if (!shard->close() || rename(tmp_file.c_str(), file.c_str())) {
+    printf("ERROR: Failed to write stat shard %s\n", file.c_str());
+    unlink(tmp_file.c_str());
+  } else {
+    printf("[ stat shard is saved to %s ]\n", file.c_str());
+  }
+  delete shard;
+}
+
+/* analyze target functions on the actions of threads, and print stats */
+static void analyze_threads(unordered_map<long, ThreadJob*> &thread_jobs) {
+  // one stat option for each target
+  vector<FuncStat::Option> stat_opts = get_stat_options();
+  uint64_t trace_time = (uint64_t)(param.trace_time * NSECS_PER_SECS);
+
+  // do thread job
+  run_thread_jobs(thread_jobs, stat_opts);
+  if (param.cohort.second > 0) {
+    self_profiler.begin_phase("split cohort");
+    split_cohort(thread_jobs, stat_opts);
+    self_profiler.end_phase();
+  }
+  if (param.chrome_trace != "") {
+    self_profiler.begin_phase("export chrome trace");
+    export_chrome_trace(thread_jobs);
+    self_profiler.end_phase();
+  }
 
   if (gstat.real_trace_time() > param.trace_time) {
     param.trace_time = gstat.real_trace_time();
-    stat_opt.trace_time = (uint64_t)(param.trace_time * NSECS_PER_SECS);
+    trace_time = (uint64_t)(param.trace_time * NSECS_PER_SECS);
   }
   gstat.print(thread_jobs.size(), param.ancestor);
-  stat_opt.trace_time -= gstat.miss.load();
+  trace_time -= gstat.miss.load();
+
+  ShardWriter *shard = nullptr;
+  if (param.shard_file != "")
+    shard = open_shard(param.shard_file, thread_jobs.size(),
+                       gstat, stat_opts.size());
 
   /* print summary */
-  print_stat(stat_opt, thread_jobs);
+  for (size_t k = 0; k < stat_opts.size(); ++k) {
+    stat_opts[k].trace_time = trace_time;
+    print_stat(stat_opts[k], k, thread_jobs, shard);
+  }
+
+  if (shard)
+    close_shard(shard, param.shard_file);
+}
+
+/* load the stats of one shard file */
+class ShardLoadJob : public ParallelJob {
+public:
+  ShardLoadJob(const string &f)
+    : filename(f), failed(false), version(STAT_SHARD_VERSION), thread_num(0) {}
+  void exec() override {
+    ShardReader r(filename);
+    uint64_t magic = r.get_u64();
+    if (magic == STAT_SHARD_MAGIC_V0) {
+      version = 0;
+      return;
+    }
+    if (magic != STAT_SHARD_MAGIC) {
+      failed = true;
+      return;
+    }
+    version = r.get_u64();
+    if (version != STAT_SHARD_VERSION)
+      return;
+    thread_num = r.get_u64();
+    ancestor = r.get_str();
+    status.load(r);
+    // miss time is averaged by threads in shard
+    status.miss.store(status.miss.load() * thread_num);
+    uint64_t n = r.get_len(sizeof(uint64_t));
+    for (uint64_t i = 0; i < n && r.good(); ++i) {
+      stats.emplace_back();
+      stats.back().load(r);
+      // shards of other samples are merged and compared by scaled counts
+      stats.back().scale_samples();
+    }
+    for (n = r.get_len(sizeof(uint64_t)); n > 0 && r.good(); --n) {
+      string name = r.get_str();
+      srclines.emplace_back(name, r.get_str());
+    }
+    failed = !r.good();
+  }
 
-  // free memory of all allocated job
+  /* exit if the shard can not be loaded */
+  void check() {
+    if (failed) {
+      printf("ERROR: invalid stat shard %s\n", filename.c_str());
+      exit(1);
+    }
+    if (version != STAT_SHARD_VERSION) {
+      printf("ERROR: stat shard %s is of version %lu, but version %d is "
+             "required, save it again by this func_latency\n",
+             filename.c_str(), version, STAT_SHARD_VERSION);
+      exit(1);
+    }
+  }
+
+  string filename;
+  bool failed;
+  uint64_t version;
+  uint64_t thread_num;
+  string ancestor;
+  FuncGlobalStatus status;
+  vector<FuncStat> stats;
+  vector<pair<string, string>> srclines;
+};
+
+/* merge stat shards of multiple runs, and print the report */
+static void merge_shards(int num, char *files[]) {
+  if (num < 1) {
+    printf("ERROR: merge mode requires at least one stat shard\n");
+    usage();
+    exit(1);
+  }
+  worker_pool.start(std::min((size_t)num, param.worker_num));
+  vector<ShardLoadJob *> load_jobs;
+  for (int i = 0; i < num; ++i) {
+    load_jobs.push_back(new ShardLoadJob(files[i]));
+    worker_pool.add_job(load_jobs.back(), i);
+  }
+  worker_pool.wait_all_idle();
+
+  ShardLoadJob *first = load_jobs[0];
+  uint64_t thread_num = 0;
+  for (ShardLoadJob *job : load_jobs) {
+    job->check();
+    bool same_targets = (job->stats.size() == first->stats.size());
+    for (size_t k = 0; same_targets && k < job->stats.size(); ++k) {
+      same_targets = (job->stats[k].opt.target == first->stats[k].opt.target);
+    }
+    if (!same_targets) {
+      printf("ERROR: target functions of %s are different from %s\n",
+             job->filename.c_str(), first->filename.c_str());
+      exit(1);
+    }
+    gstat.merge(job->status);
+    thread_num += job->thread_num;
+    for (auto &it : job->srclines) {
+      srcline_map.put_srcline(it.first, it.second);
+    }
+  }
+  printf("[ merge %d stat shards ]\n", num);
+  gstat.print(thread_num, first->ancestor);
+
+  for (size_t k = 0; k < first->stats.size(); ++k) {
+    FuncStat::Option opt = first->stats[k].opt;
+    vector<FuncStat *> stats;
+    for (ShardLoadJob *job : load_jobs) {
+      // shards are traced at the same time or are parts of one trace
+      opt.trace_time = std::max(opt.trace_time, job->stats[k].opt.trace_time);
+      // the confidence interval is only kept for the same sample
+      if (job->stats[k].opt.sample != opt.sample)
+        opt.sample = 0;
+      stats.push_back(&job->stats[k]);
+    }
+    merge_stats(stats);
+    FuncStat stat(opt, &srcline_map);
+    stat.merge(*stats[0]);
+    stat.print();
+  }
+  for (ShardLoadJob *job : load_jobs) {
+    delete job;
+  }
+}
+
+/* compare the stat shards of a base run and a new run */
+static void diff_shards(int argc, char *argv[]) {
+  vector<string> files;
+  bool flamegraph = false;
+  for (int i = 0; i < argc; ++i) {
+    if (!strcmp(argv[i], "-F") || !strcmp(argv[i], "--flamegraph"))
+      flamegraph = true;
+    else
+      files.push_back(argv[i]);
+  }
+  if (files.size() != 2) {
+    printf("ERROR: diff mode requires two stat shards, the base and the new one\n");
+    exit(1);
+  }
+
+  // analyze both runs in parallel
+  worker_pool.start(2);
+  ShardLoadJob base_job(files[0]), cur_job(files[1]);
+  worker_pool.add_job(&base_job, 0);
+  worker_pool.add_job(&cur_job, 1);
+  worker_pool.wait_all_idle();
+  for (ShardLoadJob *job : {&base_job, &cur_job}) {
+    job->check();
+  }
+  printf("[ base: %s, new: %s ]\n", files[0].c_str(), files[1].c_str());
+
+  ofstream folded;
+  if (flamegraph) {
+    folded.open("diff_flame.folded");
+    if (!folded.is_open()) {
+      printf("ERROR: Failed to open diff_flame.folded\n");
+      exit(1);
+    }
+  }
+  for (FuncStat &base : base_job.stats) {
+    FuncStat *cur = nullptr;
+    for (FuncStat &stat : cur_job.stats) {
+      if (stat.opt.target == base.opt.target)
+        cur = &stat;
+    }
+    if (!cur) {
+      printf("[ target %s is not in %s, skip it ]\n",
+             base.opt.target.c_str(), files[1].c_str());
+      continue;
+    }
+    FuncStatDiff diff(base, *cur);
+    diff.print();
+    if (flamegraph)
+      diff.write_folded(folded);
+  }
+
+  if (flamegraph) {
+    folded.close();
+    string cmd = param.scripts_home + "/flamegraph.pl --countname=\"ns\""
+                 " diff_flame.folded > diff_flame.svg";
+    system(cmd.c_str());
+    printf("[ Differential flamegraph has been saved to diff_flame.svg ]\n");
+  }
+}
+
+static void interactive_usage() {
+  printf(
+    "query options, the trace is decoded once and kept in memory:\n"
+    "\t-f / --func            --- target's function name, or comma separated names\n"
+    "\t-a / --ancestor        --- only analyze target function with 'ancestor' function in its call chain\n"
+    "\t-T / --tid             --- thread ID (comma separated list) to analyze\n"
+    "\t--li/--latency_interval--- show the trace between the latency interval (ns), format: \"min,max\"\n"
+    "\t--ti/--time_interval   --- show the trace between the time interval (ns), format:\"start,min,max\"\n"
+    "\t     --cct_depth       --- show the calling-context tree below target function up to this depth\n"
+    "\t     --caller_depth    --- show the latency of target function by its caller path\n"
+    "\t     --top_k           --- show the k slowest calls of target function\n"
+    "\t     --cohort          --- compare the child latency of typical and slow calls, eg, \"50,99\"\n"
+    "\t     --heatmap         --- show the latency heatmap of this number of time windows\n"
+    "\thelp / quit\n"
+  );
+}
+
+struct option query_opts[] = {
+  {"func", 1, NULL, 'f'},
+  {"ancestor", 1, NULL, 'a'},
+  {"tid", 1, NULL, 'T'},
+  {"latency_interval", 1, NULL, '0'},
+  {"li", 1, NULL, '0'},
+  {"time_interval", 1, NULL, '1'},
+  {"ti", 1, NULL, '1'},
+  {"cct_depth", 1, NULL, OPT_CCT_DEPTH},
+  {"caller_depth", 1, NULL, OPT_CALLER_DEPTH},
+  {"top_k", 1, NULL, OPT_TOP_K},
+  {"cohort", 1, NULL, OPT_COHORT},
+  {"heatmap", 1, NULL, OPT_HEATMAP},
+  {NULL, 0, NULL, 0}
+};
+const char *query_opt_str = "f:a:T:";
+
+/* set query options of param from one line, return false if it is invalid */
+static bool parse_query(const string &line) {
+  vector<string> words;
+  for (string &word : split_string(line, ' ')) {
+    if (word.size() >= 2 && (word[0] == '"' || word[0] == '\''))
+      word = word.substr(1, word.size() - 2);
+    if (word != "")
+      words.push_back(word);
+  }
+  vector<char *> argv = {(char *)"query"};
+  for (string &word : words)
+    argv.push_back(&word[0]);
+  argv.push_back(nullptr);
+
+  // options not set in the query are default
+  Param def;
+  param.target = "";
+  param.ancestor = def.ancestor;
+  param.ancestors.clear();
+  param.tid = "";
+  param.latency_interval = def.latency_interval;
+  param.time_interval = def.time_interval;
+  param.cct_depth = param.caller_depth = param.top_k = 0;
+  param.cohort = def.cohort;
+  param.heatmap = 0;
+
+  int c;
+  optind = 0;
+  opterr = 1;
+  while (-1 != (c = getopt_long(argv.size() - 1, argv.data(),
+                                query_opt_str, query_opts, NULL))) {
+    switch (c) {
+      case 'f':
+        param.target = string(optarg);
+        break;
+      case 'a':
+        if (set_ancestor(string(optarg)))
+          return false;
+        break;
+      case 'T':
+        param.tid = parse_number_range_to_sequence(string(optarg));
+        break;
+      case '0':
+        param.latency_interval = get_interval_from_string(string(optarg));
+        break;
+      case '1':
+        if (set_time_interval(string(optarg)))
+          return false;
+        break;
+      case OPT_CCT_DEPTH:
+        param.cct_depth = atol(optarg);
+        break;
+      case OPT_CALLER_DEPTH:
+        param.caller_depth = atol(optarg);
+        break;
+      case OPT_TOP_K:
+        param.top_k = atol(optarg);
+        break;
+      case OPT_HEATMAP:
+        param.heatmap = atol(optarg);
+        break;
+      case OPT_COHORT:
+        if (set_cohort(string(optarg)))
+          return false;
+        break;
+      default:
+        return false;
+    }
+  }
+  if (param.target == "") {
+    printf("ERROR: target function name is required\n");
+    return false;
+  }
+  // time_start of timeline is the start of trace
+  param.time_start = gstat.real.first;
+  return true;
+}
+
+/* mark target and ancestor functions of the query in symbols */
+static void set_query_targets(vector<ParseJob *> &parse_jobs) {
+  param.targets = split_string(param.target, ',');
+  param.target = param.targets[0];
+  target_idx_map.clear();
+  for (size_t i = 0; i < param.targets.size(); ++i) {
+    target_idx_map[param.targets[i]] = i;
+  }
+  set_ancestor_idx_map();
+  auto reset = [&](Symbol *sym) {
+    sym->target_idx = SYMBOL_TARGET_UNKNOWN;
+    get_target_idx(sym);
+    sym->ancestor_idx = SYMBOL_TARGET_UNKNOWN;
+    get_ancestor_idx(sym);
+  };
+  for (ParseJob *parse_job : parse_jobs)
+    parse_job->get_sym_mgr().loop_symbols(reset);
+  index_sym_mgr.loop_symbols(reset);
+}
+
+/* answer queries from stdin, by rerunning analysis on the kept actions */
+static void run_interactive(vector<ParseJob *> &parse_jobs,
+    unordered_map<long, ThreadJob*> &thread_jobs) {
+  // the shard is only saved for the stats of command line
+  param.shard_file = "";
+  interactive_usage();
+  string line;
+  while (true) {
+    printf("func_latency> ");
+    fflush(stdout);
+    if (!getline(cin, line))
+      break;
+    if (line.find_first_not_of(' ') == string::npos)
+      continue;
+    if (line == "quit" || line == "exit")
+      break;
+    if (line == "help" || !parse_query(line)) {
+      interactive_usage();
+      continue;
+    }
+    auto t1 = ut_time_now();
+    set_query_targets(parse_jobs);
+    gstat.miss.store(0);
+    gstat.ancestor_begin.store(0);
+    gstat.ancestor_end.store(0);
+
+    unordered_map<long, ThreadJob*> query_jobs;
+    vector<string> tids = split_string(param.tid, ',');
+    for (auto it = thread_jobs.begin(); it != thread_jobs.end(); ++it) {
+      if (tids.empty() || std::find(tids.begin(), tids.end(),
+            to_string(it->first)) != tids.end())
+        query_jobs.insert(*it);
+    }
+    analyze_threads(query_jobs);
+    auto t2 = ut_time_now();
+    printf("[ query has consumed %.2f seconds ]\n", ut_time_diff(t2, t1));
+  }
+}
+
+/* print the bytes read by parse jobs periodically until all of them are
+ * finished, the jobs of one file read parts of it */
+static void report_parse_progress(vector<ParseJob *> &parse_jobs, std::chrono::steady_clock::time_point start) {
+  size_t total = 0;
+  unordered_set<string> files;
+  for (ParseJob *job : parse_jobs) {
+    if (files.insert(job->get_filename()).second)
+      total += get_file_size(job->get_filename());
+  }
+  while (!worker_pool.wait_all_idle_for(param.progress)) {
+    size_t bytes = 0;
+    for (ParseJob *job : parse_jobs)
+      bytes += job->get_read_bytes();
+    printf("[ progress: parsed %.2f/%.2f MB (%.0f%%), %.2f seconds ]\n",
+           bytes / 1048576.0, total / 1048576.0,
+           total ? std::min(100.0, 100.0 * bytes / total) : 0,
+           ut_time_diff(ut_time_now(), start));
+    fflush(stdout);
+  }
+}
+
+/* decode the actions of script files by parse jobs */
+static void parse_actions(vector<ParseJob *> &parse_jobs) {
+  assign_parse_jobs(parse_jobs);
+  
+  // do parse jobs
+  auto t1 = ut_time_now();
+  self_profiler.begin_phase("parse actions");
+  for (size_t i = 0; i < parse_jobs.size(); ++i) {
+    worker_pool.add_job(parse_jobs[i], i);
+  }
+  if (param.progress > 0)
+    report_parse_progress(parse_jobs, t1);
+  worker_pool.wait_all_idle();
+  self_profiler.end_phase();
+  auto t2 = ut_time_now();
+
+  printf("[ parse actions has consumed %.2f seconds ]\n",
+          ut_time_diff(t2, t1));
+}
+
+/* free memory of all allocated job */
+static void free_jobs(vector<ParseJob *> &parse_jobs,
+    unordered_map<long, ThreadJob*> &thread_jobs) {
+  size_t i;
   vector<MemoryFreeJob> memfree_jobs(parse_jobs.size() + thread_jobs.size());
   for (i = 0; i < parse_jobs.size(); ++i) {
     memfree_jobs[i].set_to_free(parse_jobs[i]);
@@ -714,6 +1986,146 @@ static void analyze_funcs() {
   worker_pool.wait_all_idle();
 }
 
+/* save the profile of phases and jobs of func_latency itself */
+static void save_self_profile() {
+  if (param.self_profile != "") {
+    if (!self_profiler.write_summary(param.self_profile))
+      printf("ERROR: Failed to write self profile %s\n", param.self_profile.c_str());
+    else
+      printf("[ self profile is saved to %s ]\n", param.self_profile.c_str());
+  }
+  if (param.self_trace != "") {
+    if (!self_profiler.write_trace(param.self_trace))
+      printf("ERROR: Failed to write self trace %s\n", param.self_trace.c_str());
+    else
+      printf("[ self trace is saved to %s ]\n", param.self_trace.c_str());
+  }
+}
+
+/*
+ * Main function for analyzing performance of function
+ * */
+static void analyze_funcs() {
+  /* 1. dispatch parse_jobs */
+  vector<ParseJob *> parse_jobs;
+  parse_actions(parse_jobs);
+
+  if (param.build_index) {
+    build_action_index(parse_jobs);
+  }
+
+  /* 2. analyze function for each thread */
+  unordered_map<long, ThreadJob*> thread_jobs;
+  self_profiler.begin_phase("assign thread jobs");
+  assign_thread_jobs(parse_jobs, thread_jobs);
+  self_profiler.end_phase();
+  if (!param.targets.empty())
+    analyze_threads(thread_jobs);
+
+  if (param.interactive)
+    run_interactive(parse_jobs, thread_jobs);
+
+  self_profiler.begin_phase("free jobs");
+  free_jobs(parse_jobs, thread_jobs);
+  self_profiler.end_phase();
+
+  if (self_profiler.is_enabled())
+    save_self_profile();
+}
+
+/*
+ * Trace short windows periodically, and keep the stats of all windows
+ * aggregated. Only the merged stats are kept between windows, so the
+ * memory is bounded by the number of functions, not by the trace time.
+ * */
+static void run_continuous(PerfOption &perf_option) {
+  vector<FuncStat::Option> stat_opts = get_stat_options();
+  vector<FuncStat> stats;
+  for (FuncStat::Option &opt : stat_opts) {
+    stats.emplace_back(opt, &srcline_map);
+  }
+  FuncGlobalStatus status;
+  string snapshot = param.shard_file != "" ? param.shard_file :
+                      get_current_dir() + "/" CONTINUOUS_SNAPSHOT;
+  uint64_t window_time = (uint64_t)(param.trace_time * NSECS_PER_SECS);
+  uint64_t trace_time = 0;
+
+  uint32_t window;
+  for (window = 1;
+       !param.continuous_windows || window <= param.continuous_windows;
+       ++window) {
+    auto t1 = ut_time_now();
+    perf_record(perf_option);
+    auto t2 = ut_time_now();
+    perf_script(perf_option);
+    vector<ParseJob *> parse_jobs;
+    parse_actions(parse_jobs);
+    auto t3 = ut_time_now();
+
+    unordered_map<long, ThreadJob*> thread_jobs;
+    assign_thread_jobs(parse_jobs, thread_jobs);
+    run_thread_jobs(thread_jobs, stat_opts);
+    uint64_t calls = 0;
+    for (size_t k = 0; k < stats.size(); ++k) {
+      vector<FuncStat *> thread_stats;
+      for (auto &it : thread_jobs)
+        thread_stats.push_back(&it.second->get_stat(k));
+      merge_stats(thread_stats);
+      if (!thread_stats.empty()) {
+        calls += thread_stats[0]->latency.target.get_count();
+        stats[k].merge(*thread_stats[0]);
+      }
+    }
+    // the window status is averaged by threads as one-shot trace
+    if (!thread_jobs.empty())
+      gstat.miss.store(gstat.miss.load() / thread_jobs.size());
+    status.merge(gstat);
+    trace_time += window_time - std::min(window_time, gstat.miss.load());
+    gstat.miss.store(0);
+    gstat.real = {UINT64_MAX, 0};
+    gstat.ancestor_begin.store(0);
+    gstat.ancestor_end.store(0);
+    free_jobs(parse_jobs, thread_jobs);
+    clear_record_files();
+    clear_script_files();
+    auto t4 = ut_time_now();
+
+    // save the snapshot of aggregated stats
+    for (FuncStat &stat : stats) {
+      stat.opt.trace_time = trace_time;
+      if (stat.opt.call_line)
+        stat.generate_srcline();
+    }
+    ShardWriter *shard = open_shard(snapshot, 1, status, stats.size());
+    for (FuncStat &stat : stats) {
+      stat.save(*shard);
+    }
+    close_shard(shard, snapshot);
+
+    printf("[ window %u: record %.2f, decode %.2f, analyze %.2f seconds,"
+           " %lu target calls ]\n", window, ut_time_diff(t2, t1),
+           ut_time_diff(t3, t2), ut_time_diff(t4, t3), calls);
+    fflush(stdout);
+
+    if (continuous_stop ||
+        (param.continuous_windows && window == param.continuous_windows))
+      break;
+    double left = param.continuous_period - ut_time_diff(ut_time_now(), t1);
+    if (left > 0)
+      usleep((useconds_t)(left * 1000000));
+    if (continuous_stop)
+      break;
+  }
+  if (continuous_stop)
+    printf("[ interrupted after window %u ]\n", window);
+
+  /* print the aggregated stats of all windows */
+  status.print(0, param.ancestor);
+  for (FuncStat &stat : stats) {
+    stat.print();
+  }
+}
+
 static string get_record_filter() {
   if (!param.ip_filtering)
     return "";
@@ -723,13 +2135,14 @@ static string get_record_filter() {
   string filter2 = "";
   if (param.offcpu)
     filter2 = param.offcpu_filter;
-  if (param.ancestor != "") {
+  if (!param.ancestors.empty()) {
     if (param.offcpu) {
       printf("ERROR: under ip_filter, offcpu and ancestor filter "
              "can not be set at the same time.\n");
       exit(0);
     }
-    filter2 = "filter " + param.ancestor + " #0 @ " + binary + ",";
+    for (AncestorLevel &level : param.ancestors)
+      filter2 += "filter " + level.name + " #0 @ " + binary + ",";
   }
   if (binary == "") {
     // kernel function
@@ -738,8 +2151,12 @@ static string get_record_filter() {
     // user function
     binary = "@ " + binary;
   }
-  record_filter = "--filter '" + filter2 + "filter " + param.target +
-                  " " + param.func_idx + " " + binary + "'";
+  string target_filter = "";
+  for (const string &target : param.targets) {
+    if (target_filter != "") target_filter += ",";
+    target_filter += "filter " + target + " " + param.func_idx + " " + binary;
+  }
+  record_filter = "--filter '" + filter2 + target_filter + "'";
   return record_filter;
 }
 
@@ -748,11 +2165,16 @@ static string get_script_filter() {
   // ip filter
   if (param.parallel_script) {
     if (!param.ip_filtering && param.flamegraph == "") {
-      if (param.target != "") {
-        script_filter << " --func_filter=\"" << param.target;
-        if (param.ancestor != "")
-          script_filter << "," << param.ancestor;
+      if (param.target != "" && !need_all_branches()) {
+        script_filter << " --func_filter=\"";
+        for (size_t i = 0; i < param.targets.size(); ++i) {
+          script_filter << (i ? "," : "") << param.targets[i];
+        }
+        for (AncestorLevel &level : param.ancestors)
+          script_filter << "," << level.name;
         script_filter << "\"";
+        if (param.cct_depth > 0)
+          script_filter << " --func_filter_extent=1";
       }
       if (param.binary != "") {
         script_filter << " --opt_dso_name=\"" << param.binary << "\"";
@@ -774,8 +2196,10 @@ static string get_script_filter() {
              param.time_interval.second % NSECS_PER_SECS);
     script_filter << time_filter;
   }
-  /* use dl filter to discard internal jump of target function, if not analyze code block latency */
-  if (!param.code_block && access(param.perf_dlfilter.c_str(), F_OK) != -1) {
+  /* use dl filter to discard internal jump of target function, if not analyze code block latency,
+   * the index and queries keep them for code blocks */
+  if (!param.code_block && !need_all_branches() &&
+      access(param.perf_dlfilter.c_str(), F_OK) != -1) {
     script_filter << " --dlfilter=" << param.perf_dlfilter;
   }
   return script_filter.str();
@@ -784,6 +2208,14 @@ static string get_script_filter() {
 static void check_parameter() {
   if (param.verbose) dump_options();
 
+  // multiple target functions are separated by comma
+  param.targets = split_string(param.target, ',');
+  if (!param.targets.empty())
+    param.target = param.targets[0];
+  for (size_t i = 0; i < param.targets.size(); ++i) {
+    target_idx_map[param.targets[i]] = i;
+  }
+
   if (system("addr2line --help &> /dev/null")) {
     printf("Warning: addr2line command not found, run without src_line/call_line.\n");
     param.call_line = false;
@@ -792,13 +2224,15 @@ static void check_parameter() {
     printf("Warning: binary path is empty, run without src_line/call_line.\n");
     param.call_line = false;
   }
-  if (param.ancestor == param.target) {
-    param.ancestor = "";
+  if (param.ancestors.size() == 1 && param.ancestors[0].name == param.target) {
     param.latency_interval.first =
-      std::max(param.latency_interval.first, param.ancestor_latency.first);
+      std::max(param.latency_interval.first, param.ancestors[0].latency.first);
     param.latency_interval.second =
-      std::min(param.latency_interval.second, param.ancestor_latency.second);
+      std::min(param.latency_interval.second, param.ancestors[0].latency.second);
+    param.ancestor = "";
+    param.ancestors.clear();
   }
+  set_ancestor_idx_map();
   if (param.offcpu && getuid() != 0) {
     printf("Error: offcpu time needs root privilege, please use sudo command\n");
     exit(0);
@@ -816,10 +2250,83 @@ static void check_parameter() {
     printf("Warning: ip filtering is not support for CPU tracing, turn it off\n");
     param.ip_filtering = false;
   }
-  if (param.flamegraph == "" && param.target == "") {
+  if (param.flamegraph == "" && param.target == "" &&
+      !param.build_index && !param.interactive) {
     printf("ERROR: target function name is required if is not in flamegraph mode\n");
     exit(0);
   }
+  if (param.cct_depth > 0 && param.ip_filtering) {
+    printf("Warning: ip filtering only traces target function, "
+           "calling-context tree is limited to depth 1\n");
+    param.cct_depth = 1;
+  }
+  if (param.build_index) {
+    if (param.history == 4 || param.flamegraph != "") {
+      printf("Warning: action index is built from perf script, turn it off\n");
+      param.build_index = false;
+    } else if (param.ip_filtering) {
+      printf("Warning: with ip filtering, action index only has target functions\n");
+    }
+  }
+  if (param.shard_file != "" && param.timeline) {
+    printf("Warning: stat shard is not support for timeline mode, turn it off\n");
+    param.shard_file = "";
+  }
+  if (param.chrome_trace != "" && param.continuous_period) {
+    printf("Warning: chrome trace is not support for continuous mode, turn it off\n");
+    param.chrome_trace = "";
+  }
+  if ((param.self_profile != "" || param.self_trace != "") &&
+      (param.continuous_period || param.flamegraph != "")) {
+    printf("Warning: self profile is not support for continuous and flamegraph mode, turn it off\n");
+    param.self_profile = param.self_trace = "";
+  }
+  if (param.progress > 0 && param.continuous_period) {
+    printf("Warning: progress is not support for continuous mode, turn it off\n");
+    param.progress = 0;
+  }
+  if (param.sample > 1 && param.timeline) {
+    printf("Warning: sample is not support for timeline mode, turn it off\n");
+    param.sample = 0;
+  }
+  if (param.heatmap && (param.timeline || param.continuous_period)) {
+    printf("Warning: heatmap is not support for timeline and continuous mode, turn it off\n");
+    param.heatmap = 0;
+  }
+  if (param.cohort.second > 0 && (param.timeline || param.continuous_period)) {
+    printf("Warning: cohort is not support for timeline and continuous mode, turn it off\n");
+    param.cohort = {0, 0};
+  }
+  if (param.continuous_period) {
+    if (param.history || param.sub_command != "" || param.flamegraph != "" ||
+        param.timeline || param.interactive || param.build_index) {
+      printf("ERROR: continuous mode only traces the running process, "
+             "without history, command, flamegraph, timeline, interactive and index\n");
+      exit(0);
+    }
+    if (param.continuous_period < param.trace_time) {
+      printf("Warning: the period is shorter than duration, windows are traced one by one\n");
+    }
+  }
+  if (param.history == 4) {
+    if (param.flamegraph != "") {
+      printf("ERROR: flamegraph can not use the action index\n");
+      exit(0);
+    }
+  }
+  if (param.caller_depth > 0 && param.ip_filtering) {
+    printf("Warning: ip filtering only traces target function, "
+           "caller paths are not available\n");
+    param.caller_depth = 0;
+  }
+  if (param.threaded_script) {
+    if (!param.per_thread_mode) {
+      printf("Warning: threaded script requires per_thread mode, use parallel script\n");
+      param.threaded_script = false;
+    }
+    param.parallel_script = true;
+  }
+
   if (param.compact_format) {
     if (!param.parallel_script || param.flamegraph != "") {
       param.compact_format = false;
@@ -829,9 +2336,20 @@ static void check_parameter() {
   if (param.pt_config.find("cyc=1") == std::string::npos) {
     pt::ActionSet::out_of_order = true;
   }
+  if (param.unordered_queues) {
+    // actions of one thread may come from multiple cpu queues
+    pt::ActionSet::out_of_order = true;
+  }
 
   if (param.worker_num == 1) {
     param.parallel_script = false;
+    param.threaded_script = false;
+  }
+
+  // each chunk of parallel script has its output file, in trace order
+  param.script_files = param.worker_num;
+  if (param.parallel_script && !param.threaded_script) {
+    param.script_files = param.worker_num * SCRIPT_CHUNKS_PER_WORKER;
   }
 }
 
@@ -840,6 +2358,15 @@ int main(int argc, char *argv[]) {
     usage();
     exit(-1);
   }
+
+  if (!strcmp(argv[1], "merge")) {
+    merge_shards(argc - 2, argv + 2);
+    exit(0);
+  }
+  if (!strcmp(argv[1], "diff")) {
+    diff_shards(argc - 2, argv + 2);
+    exit(0);
+  }
   
   if (check_system()) exit(-1);
 
@@ -884,21 +2411,10 @@ int main(int argc, char *argv[]) {
         string str = string(optarg);
         param.latency_interval = get_interval_from_string(str);
         break;}
-      case '1': {
-        string str = string(optarg);
-        int sep1 = str.find_first_of(',');
-        int sep2 = str.find_last_of(',');
-        if (sep1 == string::npos || sep1 == sep2) {
-          printf("ERROR: wrong time_interval format!\n");
+      case '1':
+        if (set_time_interval(string(optarg)))
           exit(1);
-        }
-        param.time_start = str2long(str.substr(0, sep1));
-        param.time_interval.first =
-                        param.time_start + str2long(str.substr(sep1 + 1, sep2));
-        param.time_interval.second =
-                        param.time_start + str2long(str.substr(sep2 + 1, str.size()));
-        param.time_start = param.time_interval.first;
-        break;}
+        break;
       case '3':
         param.timeline_unit = atol(optarg);
         break;
@@ -925,17 +2441,82 @@ int main(int argc, char *argv[]) {
       case 'c':
         param.code_block = true;
         break;
-      case 'a': {
-        string str = string(optarg);
-        int sep = str.find_first_of('#');
-        if (sep != string::npos) {
-          param.ancestor = str.substr(0, sep);
-          param.ancestor_latency =
-            get_interval_from_string(str.substr(sep + 1, str.size() - sep));
-        } else {
-          param.ancestor = str;
+      case OPT_CCT_DEPTH:
+        param.cct_depth = atol(optarg);
+        break;
+      case OPT_CALLER_DEPTH:
+        param.caller_depth = atol(optarg);
+        break;
+      case OPT_TOP_K:
+        param.top_k = atol(optarg);
+        break;
+      case OPT_HEATMAP:
+        param.heatmap = atol(optarg);
+        break;
+      case OPT_MAX_KEYS:
+        param.max_keys = atol(optarg);
+        break;
+      case OPT_SAMPLE:
+        param.sample = atol(optarg);
+        break;
+      case OPT_PROGRESS:
+        param.progress = atof(optarg);
+        break;
+      case OPT_COHORT:
+        if (set_cohort(string(optarg)))
+          exit(1);
+        break;
+      case '7':
+        param.unordered_queues = true;
+        break;
+      case '8':
+        param.threaded_script = true;
+        break;
+      case OPT_BUILD_INDEX:
+        param.build_index = true;
+        break;
+      case OPT_INTERACTIVE:
+        param.interactive = true;
+        break;
+      case OPT_SAVE_SHARD:
+        // the work directory may be switched to result_dir
+        param.shard_file = string(optarg);
+        if (param.shard_file[0] != '/')
+          param.shard_file = get_current_dir() + "/" + param.shard_file;
+        break;
+      case OPT_CHROME_TRACE:
+        param.chrome_trace = string(optarg);
+        if (param.chrome_trace[0] != '/')
+          param.chrome_trace = get_current_dir() + "/" + param.chrome_trace;
+        break;
+      case OPT_SELF_PROFILE:
+        param.self_profile = string(optarg);
+        if (param.self_profile[0] != '/')
+          param.self_profile = get_current_dir() + "/" + param.self_profile;
+        break;
+      case OPT_SELF_TRACE:
+        param.self_trace = string(optarg);
+        if (param.self_trace[0] != '/')
+          param.self_trace = get_current_dir() + "/" + param.self_trace;
+        break;
+      case OPT_CONTINUOUS: {
+        vector<string> vals = split_string(string(optarg), ',');
+        param.continuous_period = atof(vals[0].c_str());
+        if (vals.size() > 1)
+          param.continuous_windows = atol(vals[1].c_str());
+        break;}
+      case '9': {
+        string dir = string(optarg);
+        if (!check_path_exist(dir) && create_directory(dir)) {
+          printf("ERROR: Failed to create instruction cache directory!\n");
+          exit(1);
         }
+        param.insn_cache_dir = resolve_path(dir);
         break;}
+      case 'a':
+        if (set_ancestor(string(optarg)))
+          exit(1);
+        break;
       case '2':
         param.history = atol(optarg);
         break;
@@ -984,28 +2565,41 @@ int main(int argc, char *argv[]) {
     "-F-event,-period,+tid,+cpu,+time,+addr,-comm,+flags,-dso",
     "be",
     param.worker_num,
+    param.script_files,
     param.compact_format,
+    param.unordered_queues,
+    param.threaded_script,
+    param.insn_cache_dir,
     param.sub_command,
     param.history,
     param.verbose};
 
   if (param.result_dir != "")
     switch_work_dir(param.result_dir);
+  if (param.history == 4)
+    load_action_index();
 
   // perf record
   perf_option.intel_pt_config = "intel_pt/" + param.pt_config +
                                 "/" + (param.offcpu ? ' ' : 'u');
   perf_option.record_filter = get_record_filter();
-  perf_record(perf_option);
+  if (!param.continuous_period)
+    perf_record(perf_option);
 
   // create worker pool
   worker_pool.start(param.worker_num);
+  if (param.self_profile != "" || param.self_trace != "")
+    self_profiler.enable(&worker_pool);
 
   // init srcline map
   srcline_map.init(param.binary);
 
   // perf script
   perf_option.script_filter = get_script_filter();
+  if (param.continuous_period) {
+    run_continuous(perf_option);
+    exit(0);
+  }
   if (param.flamegraph == "cpu") {
     perf_option.itrace = "i10usg127";
     perf_option.fields = "";
@@ -1015,6 +2609,11 @@ int main(int argc, char *argv[]) {
   if (param.history < 3) {
     perf_script(perf_option);
   }
+  if (param.parallel_script && param.history != 4) {
+    size_t files = count_script_files();
+    if (files)
+      param.script_files = files;
+  }
 
   if (param.flamegraph != "") {
     // flamegraph mode
@@ -1024,6 +2623,7 @@ int main(int argc, char *argv[]) {
       param.pt_flame_home,
       param.parallel_script,
       param.worker_num,
+      param.script_files,
       param.verbose};
     print_flame_graph(flame_option);
   } else {
@@ -1,4 +1,5 @@
 #include <cstring>
+#include <memory>
 #include "sys_tools.h"
 #include "pt_action.h"
 
@@ -20,13 +21,15 @@ void Action::init_for_sched() {
     sched_end = true;
   }
 }
-void Action::init_for_ancestor(const string &ancestor) {
-  if (to->name == ancestor && to->offset == 0 &&
+void Action::init_for_ancestor(int from_idx, int to_idx) {
+  if (to_idx >= 0 && to->offset == 0 &&
       (type == PT_ACTION_CALL || type == PT_ACTION_TR_START)) {
     ancestor_begin = true;
-  } else if (from->name == ancestor && (type == PT_ACTION_RETURN ||
+    ancestor_idx = to_idx;
+  } else if (from_idx >= 0 && (type == PT_ACTION_RETURN ||
               type == PT_ACTION_TR_END_RETURN)) {
     ancestor_end = true;
+    ancestor_idx = from_idx;
   }
 }
 
@@ -217,9 +220,14 @@ void SrclineMap::process_address() {
   vector<string> filename_vec;
   vector<uint> line_nr_vec;
   for (auto it = addr_map.begin(); it != addr_map.end(); ++it) {
+    // skip the resolved ones, for the stats of multiple targets
+    if (srcline_map.count(it->first))
+      continue;
     func_vec.push_back(it->first);
     addr_vec.push_back(it->second);
   }
+  if (addr_vec.empty())
+    return;
   addr2line(binary, addr_vec, filename_vec, line_nr_vec);
   if (filename_vec.size() != addr_vec.size()) {
     printf("ERROR: addr2line failed !!!");
@@ -241,6 +249,13 @@ uint64_t SrclineMap::get(const std::string &function) {
   return 0;
 }
 
+void SrclineMap::put_srcline(const std::string &function,
+    const std::string &srcline) {
+  m_lock.x_lock();
+  defer _(nullptr, [&](...) {m_lock.x_unlock();});
+  srcline_map[function] = srcline;
+}
+
 void SrclineMap::put(const std::string &function, uint64_t addr) {
   m_lock.x_lock();
   defer _(nullptr, [&](...) {m_lock.x_unlock();});
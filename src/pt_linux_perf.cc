@@ -72,9 +72,20 @@ void perf_script(PerfOption &opt) {
   if (opt.compact_format) {
     cmd << " " << "--compact_format=1";
   }
+  if (opt.unordered_queues) {
+    cmd << " " << "--unordered_queues=1";
+  }
+  if (opt.insn_cache_dir != "") {
+    cmd << " " << "--insn_cache_dir=" << opt.insn_cache_dir;
+  }
   cmd << " " << opt.fields << " " << opt.script_filter;
-  if (opt.parallel_script) {
+  if (opt.parallel_script && opt.threaded_script) {
+    // one process decodes the queues by threads
+    cmd << " --parallel_threads=" << opt.worker_num
+        << " " << (opt.verbose ? "" : "&> /dev/null");
+  } else if (opt.parallel_script) {
     cmd << " --parallel=" << opt.worker_num
+        << " --parallel_chunks=" << opt.script_files
         << " " << (opt.verbose ? "" : "&> /dev/null");
   } else {
     cmd << " > script_out";
@@ -95,6 +106,21 @@ void clear_script_files() {
   system("rm -f script_out*");
 }
 
+/* number of parallel script files, counted by their names, as perf may
+ * write less chunks than requested, and the output may be of a run with
+ * other options */
+size_t count_script_files() {
+  char filename[128];
+  size_t n = 0;
+  while (true) {
+    snprintf(filename, 128, SCRIPT_FILE_PREFIX "__%05zu", n);
+    if (access(filename, F_OK) == -1)
+      break;
+    ++n;
+  }
+  return n;
+}
+
 void print_flame_graph(FlameGraphOption &opt) {
   stringstream cmd;
   char filename[128];
@@ -103,9 +129,11 @@ void print_flame_graph(FlameGraphOption &opt) {
     /* latency flamegraph */
     cmd << opt.pt_flame_home << "/bin/pt_flame -j " << opt.worker_num;
     if (opt.parallel_script) {
-      for (size_t i = 0; i < opt.worker_num; ++i) {
+      for (size_t i = 0; i < opt.script_files; ++i) {
         snprintf(filename, 128, SCRIPT_FILE_PREFIX "__%05d", i);
-        cmd << " " << filename;
+        if (access(filename, F_OK) != -1) {
+          cmd << " " << filename;
+        }
       }
     } else {
       cmd << " " SCRIPT_FILE_PREFIX;
@@ -116,7 +144,7 @@ void print_flame_graph(FlameGraphOption &opt) {
     /* cpu flamegraph */
     cmd << "cat ";
     if (opt.parallel_script) {
-      for (size_t i = 0; i < opt.worker_num; ++i) {
+      for (size_t i = 0; i < opt.script_files; ++i) {
         snprintf(filename, 128, SCRIPT_FILE_PREFIX "__%05d", i);
         if (access(filename, F_OK) != -1) {
           cmd << " " << filename;
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <algorithm>
+#include "self_profile.h"
+#include "sys_tools.h"
+#include "trace_export.h"
+
+namespace pt {
+using namespace std;
+
+/* main thread of phases in chrome trace, workers are after it */
+#define SELF_TRACE_MAIN_TID 0
+
+void SelfProfiler::enable(ParallelWorkerPool *p) {
+  pool = p;
+  pool->set_profiling(true);
+  origin = job_time_now();
+}
+
+void SelfProfiler::begin_phase(const char *name) {
+  if (!pool)
+    return;
+  // jobs before the phase are not counted in it
+  pool->take_profiles();
+  reset_peak_rss();
+  Phase phase;
+  phase.name = name;
+  phase.start = job_time_now();
+  phase.end = phase.start;
+  phase.cpu_time = get_cpu_time();
+  phase.peak_rss = 0;
+  phases.push_back(phase);
+}
+
+void SelfProfiler::end_phase() {
+  if (!pool || phases.empty())
+    return;
+  Phase &phase = phases.back();
+  phase.end = job_time_now();
+  phase.cpu_time = get_cpu_time() - phase.cpu_time;
+  phase.peak_rss = get_peak_rss();
+  phase.jobs = pool->take_profiles();
+  std::sort(phase.jobs.begin(), phase.jobs.end(),
+            [](const JobProfile &a, const JobProfile &b) {
+              return a.start < b.start;
+            });
+}
+
+static inline double to_secs(uint64_t ns) {
+  return ns / (double)NSECS_PER_SECS;
+}
+
+bool SelfProfiler::write_summary(const string &file) {
+  FILE *fp = fopen(file.c_str(), "w");
+  if (!fp)
+    return false;
+  uint32_t workers = pool ? pool->size() : 0;
+  uint64_t wall = phases.empty() ? 0 : phases.back().end - origin;
+  fprintf(fp, "{\n  \"workers\": %u,\n  \"wall_s\": %.6f,\n"
+          "  \"cpu_s\": %.6f,\n  \"peak_rss_kb\": %lu,\n  \"phases\": [",
+          workers, to_secs(wall), get_cpu_time(),
+          get_peak_rss());
+  for (size_t p = 0; p < phases.size(); ++p) {
+    Phase &phase = phases[p];
+    uint64_t phase_wall = phase.end - phase.start;
+    uint64_t items = 0, bytes = 0, wait_total = 0, wait_max = 0;
+    vector<uint64_t> busy(workers, 0);
+    vector<uint32_t> worker_jobs(workers, 0);
+    for (JobProfile &job : phase.jobs) {
+      items += job.items;
+      bytes += job.bytes;
+      wait_total += job.start - job.enqueue;
+      wait_max = std::max(wait_max, job.start - job.enqueue);
+      busy[job.worker] += job.end - job.start;
+      ++worker_jobs[job.worker];
+    }
+    /* busy time of the slowest worker to the mean one of used workers,
+     * and the idle time of used workers before the phase ends */
+    uint64_t busy_total = 0, busy_max = 0, idle = 0;
+    uint32_t used = 0;
+    for (size_t w = 0; w < busy.size(); ++w) {
+      if (!worker_jobs[w])
+        continue;
+      ++used;
+      busy_total += busy[w];
+      busy_max = std::max(busy_max, busy[w]);
+      idle += phase_wall > busy[w] ? phase_wall - busy[w] : 0;
+    }
+    double imbalance = busy_total ? busy_max * used / (double)busy_total : 0;
+
+    fprintf(fp, "%s\n    {\"name\": \"%s\", \"start_s\": %.6f, \"wall_s\": %.6f, "
+            "\"cpu_s\": %.6f, \"peak_rss_kb\": %lu,\n"
+            "     \"jobs\": %lu, \"items\": %lu, \"bytes\": %lu, "
+            "\"queue_wait_s\": %.6f, \"queue_wait_max_s\": %.6f,\n"
+            "     \"busy_max_s\": %.6f, \"imbalance\": %.3f, \"worker_idle_s\": %.6f,\n"
+            "     \"workers\": [",
+            p ? "," : "", phase.name.c_str(), to_secs(phase.start - origin),
+            to_secs(phase_wall), phase.cpu_time, phase.peak_rss,
+            phase.jobs.size(), items, bytes, to_secs(wait_total),
+            to_secs(wait_max), to_secs(busy_max), imbalance, to_secs(idle));
+    bool first = true;
+    for (size_t w = 0; w < busy.size(); ++w) {
+      if (!worker_jobs[w])
+        continue;
+      fprintf(fp, "%s{\"id\": %lu, \"jobs\": %u, \"busy_s\": %.6f}",
+              first ? "" : ", ", w, worker_jobs[w], to_secs(busy[w]));
+      first = false;
+    }
+    fprintf(fp, "],\n     \"job_list\": [");
+    for (size_t j = 0; j < phase.jobs.size(); ++j) {
+      JobProfile &job = phase.jobs[j];
+      fprintf(fp, "%s\n       {\"name\": \"%s\", \"worker\": %u, \"enqueue_s\": %.6f, "
+              "\"start_s\": %.6f, \"end_s\": %.6f, \"items\": %lu, \"bytes\": %lu}",
+              j ? "," : "", job.name, job.worker, to_secs(job.enqueue - origin),
+              to_secs(job.start - origin), to_secs(job.end - origin),
+              job.items, job.bytes);
+    }
+    fprintf(fp, "%s]}", phase.jobs.empty() ? "" : "\n     ");
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
+
+bool SelfProfiler::write_trace(const string &file) {
+  vector<long> tids = {SELF_TRACE_MAIN_TID};
+  for (uint32_t w = 0; pool && w < pool->size(); ++w)
+    tids.push_back(w + 1);
+  vector<ChromeTraceWriter *> writers;
+  bool ok = true;
+  for (long tid : tids) {
+    writers.push_back(new ChromeTraceWriter(file, tid));
+    ok = ok && writers.back()->good();
+  }
+  for (size_t i = 0; ok && i < phases.size(); ++i) {
+    Phase &phase = phases[i];
+    writers[0]->add_event(phase.name, "phase", phase.start - origin,
+                          phase.end - phase.start);
+    for (JobProfile &job : phase.jobs) {
+      writers[job.worker + 1]->add_event(job.name, "job", job.start - origin,
+                                         job.end - job.start);
+    }
+  }
+  for (ChromeTraceWriter *writer : writers) {
+    writer->commit();
+    delete writer;
+  }
+  return ChromeTraceWriter::concat(file, tids) && ok;
+}
+};
@@ -54,6 +54,39 @@ static void print_multi_line_text(uint32_t max_width,
   }
 }
 
+/*
+ * The top max_keys keys, the others are folded into BUCKET_OTHERS. The
+ * keys are ranked by the upper bound of total (total + err) to keep the
+ * guarantee of Space-Saving. To print, they are ranked by the exact total,
+ * and the keys with total less than err are folded too, as they are not
+ * sure to be heavy hitters.
+ */
+unordered_set<std::string> Bucket::get_top_keys(bool by_total) {
+  vector<pair<uint64_t, std::string>> order;
+  for (auto it = slots.begin(); it != slots.end(); ++it) {
+    const Element &el = it->second;
+    if (it->first == BUCKET_OTHERS)
+      continue;
+    if (!by_total)
+      order.emplace_back(el.total + el.err, it->first);
+    else
+      order.emplace_back(el.total >= el.err ? el.total : 0, it->first);
+  }
+  size_t keep = std::min((size_t)max_keys, order.size());
+  if (by_total) {
+    std::sort(order.rbegin(), order.rend());
+    while (keep > 0 && order[keep - 1].first == 0)
+      --keep;
+  } else {
+    std::nth_element(order.begin(), order.begin() + keep, order.end(),
+                     std::greater<pair<uint64_t, std::string>>());
+  }
+  unordered_set<std::string> keys;
+  for (size_t i = 0; i < keep; ++i)
+    keys.insert(order[i].second);
+  return keys;
+}
+
 uint32_t HistogramBucket::get_print_width(uint32_t bucket_num) {
   uint32_t print_width = 0;
   print_width += max_key_length;
@@ -151,6 +184,7 @@ void Distribution::assign_slot(uint64_t val) {
     slots.resize(i + 1, 0);
   ++slots[i];
   total += val;
+  total_sq += (double)val * val;
   ++count;
 }
 
@@ -162,9 +196,26 @@ void Distribution::merge_slots(Distribution &dist) {
     slots[i] += dist.slots[i];
   }
   total += dist.total;
+  total_sq += dist.total_sq;
   count += dist.count;
 }
 
+void Distribution::scale(uint32_t n) {
+  for (uint32_t &slot : slots)
+    slot *= n;
+  total *= n;
+  total_sq *= n;
+  count *= n;
+}
+
+double Distribution::get_stddev() {
+  if (count < 2)
+    return 0;
+  double avg = (double)total / count;
+  double var = total_sq / count - avg * avg;
+  return var > 0 ? sqrt(var) : 0;
+}
+
 void Distribution::init_val_max() {
   val_max = 0;
   for (size_t i=0; i<slots.size(); ++i) {
@@ -174,6 +225,16 @@ void Distribution::init_val_max() {
   }
 }
 
+uint64_t Distribution::get_percentile(double pct) {
+  uint64_t n = 0;
+  for (size_t i = 0; i < slots.size(); ++i) {
+    n += slots[i];
+    if (n * 100.0 >= pct * count)
+      return (1ULL << (i + 1)) - 1;
+  }
+  return 0;
+}
+
 uint32_t HistogramDist::get_print_width(uint32_t dist_num) {
   uint32_t print_width = 0;
   print_width += 27;
@@ -223,6 +284,65 @@ void HistogramDist::print() {
   }
 }
 
+void Heatmap::merge(Heatmap &map) {
+  if (map.empty())
+    return;
+  if (empty()) {
+    init(map.start, map.unit, map.windows.size());
+  }
+  for (size_t i = 0; i < map.windows.size(); ++i) {
+    // windows of another trace are put in the nearest window
+    uint64_t ts = map.start + i * map.unit;
+    size_t idx = ts < start ? 0 :
+        std::min((ts - start) / unit, (uint64_t)windows.size() - 1);
+    windows[idx].merge_slots(map.windows[i]);
+  }
+}
+
+void Heatmap::print() {
+  const char shades[] = " .:-=+*#%@";
+  const int levels = sizeof(shades) - 2;
+  size_t slot_size = 0, slot_min = SIZE_MAX;
+  uint32_t cell_max = 0;
+  for (Distribution &dist : windows) {
+    const vector<uint32_t> &slots = dist.get_slots();
+    slot_size = std::max(slot_size, slots.size());
+    for (size_t i = 0; i < slots.size(); ++i) {
+      cell_max = std::max(cell_max, slots[i]);
+      if (slots[i])
+        slot_min = std::min(slot_min, i);
+    }
+  }
+  if (!cell_max)
+    return;
+
+  /* cells of high latency are on the top, darker for more calls in log scale */
+  printf("%*s%-*s : time ->\n", 10, "", 14, "ns");
+  for (size_t i = slot_size; i-- > slot_min; ) {
+    uint64_t low = (1ULL << (i + 1)) >> 1;
+    uint64_t high = (1ULL << (i + 1)) - 1;
+    if (low == high)
+      low -= 1;
+    printf("%*lu -> %-*lu |", 10, low, 10, high);
+    for (Distribution &dist : windows) {
+      const vector<uint32_t> &slots = dist.get_slots();
+      uint32_t cnt = i < slots.size() ? slots[i] : 0;
+      int level = cnt ? (int)ceil(levels * log(cnt + 1.0) / log(cell_max + 1.0)) : 0;
+      printf("%c", shades[level]);
+    }
+    printf("|\n");
+  }
+
+  printf("\n%-12s %-12s %-12s %-12s %-12s\n", "time(ms)", "calls/s",
+         "avg(ns)", "p50(<=ns)", "p99(<=ns)");
+  for (size_t i = 0; i < windows.size(); ++i) {
+    Distribution &dist = windows[i];
+    printf("%-12.3f %-12.0f %-12lu %-12lu %-12lu\n",
+           (double)i * unit / 1000000, (double)dist.get_count() * NSECS_PER_SECS / unit,
+           dist.get_avg(), dist.get_percentile(50), dist.get_percentile(99));
+  }
+}
+
 void FuncStat::init_print_width() {
   uint32_t num = 1;
   if (opt.offcpu) num += 1;
@@ -250,10 +370,7 @@ void FuncStat::add(Action &action_call, Action &action_return,
       funcname_add_addr(caller, action_call.from->addr);
     }
   }
-  if (lat_t < opt.latency_interval.first ||
-			lat_t > opt.latency_interval.second ||
-      action_call.ts < opt.time_interval.first ||
-			action_call.ts > opt.time_interval.second) {
+  if (!in_interval(action_call.ts, lat_t)) {
     return;
   }
 
@@ -267,6 +384,11 @@ void FuncStat::add(Action &action_call, Action &action_return,
     }
   } else {
     add_latency(lat_t, lat_s, caller);
+    if (opt.heatmap_windows) {
+      if (heatmap.empty())
+        heatmap.init(opt.time_start, opt.heatmap_unit, opt.heatmap_windows);
+      heatmap.add(action_call.ts, lat_t);
+    }
     if (!opt.code_block) {
       // add latency of target function self
       child.add_target(TARGET_SELF,
@@ -275,6 +397,24 @@ void FuncStat::add(Action &action_call, Action &action_return,
           lat_s > child.sched_total ? lat_s - child.sched_total : 0);
     }
     add_child_latency(child, caller);
+    if (opt.cohort_slow) {
+      if (lat_t <= opt.cohort_fast) {
+        fast_children.add_child(child);
+        ++fast_count;
+      } else if (lat_t >= opt.cohort_slow) {
+        slow_children.add_child(child);
+        ++slow_count;
+      }
+    }
+    if (opt.top_k && (outliers.size() < opt.top_k ||
+                      lat_t > outliers.front().latency)) {
+      Outlier outlier = {action_call.ts, action_return.tid,
+                         lat_t, lat_s, caller, {}};
+      child.target.loop_for_element([&](Bucket::Element &el) {
+        outlier.children.push_back({el.name, {el.total, el.count}});
+      });
+      add_outlier(outlier);
+    }
   }
 }
 
@@ -311,6 +451,33 @@ void FuncStat::print_latency(FuncStat::Latency &latency) {
     printf("sched count: %*lu,   sched latency: %*lu ns, cpu percent: %d \%\n",
           width1, sched_cnt, width2, sched_avg, cpu_pct);
   }
+  if (opt.sample > 1)
+    print_sample_ci(latency.target);
+}
+
+/* 95% confidence intervals of the latency estimated from the sampled
+ * invocations, by the normal approximation of the sample mean and of the
+ * rank of percentiles. The bounds of percentiles are slot bounds. */
+void FuncStat::print_sample_ci(Distribution &dist) {
+  const double z = 1.96;
+  double n = (double)dist.get_count() / opt.sample;
+  if (n < 1)
+    return;
+  // correction for sampling without replacement from n * sample calls
+  double fpc = sqrt(1.0 - 1.0 / opt.sample);
+  double half = z * dist.get_stddev() / sqrt(n) * fpc;
+  double avg = dist.get_avg();
+  printf("sampled 1/%u: %.0f calls, average latency: %.0f ns (95%% CI: %.0f - %.0f ns)\n",
+         opt.sample, n, avg, std::max(0.0, avg - half), avg + half);
+  for (double pct : {50.0, 99.0}) {
+    double p = pct / 100;
+    double rank_half = z * sqrt(n * p * (1 - p)) * fpc;
+    double low = std::max(1e-9, 100 * (n * p - rank_half) / n);
+    double high = std::min(100.0, 100 * (n * p + rank_half) / n);
+    printf("p%-2.0f latency: <= %lu ns (95%% CI: <= %lu - %lu ns)\n", pct,
+           dist.get_percentile(pct), dist.get_percentile(low),
+           dist.get_percentile(high));
+  }
 }
 
 void FuncStat::print_child(FuncStat::LatencyChild &child) {
@@ -346,6 +513,8 @@ void FuncStat::print_child(FuncStat::LatencyChild &child) {
         el.val_str = "[gathered]";
       } else if (el.name == TARGET_SELF) {
         srcline_map->get(opt.target, el.val_str);
+      } else if (el.name == BUCKET_OTHERS) {
+        el.val_str = BUCKET_OTHERS;
       } else {
         srcline_map->get(el.name, el.val_str);
       }
@@ -366,8 +535,255 @@ void FuncStat::print_child(FuncStat::LatencyChild &child) {
     oncpu.set_scale(opt.trace_time / 100);
     hist.add_extra_bucket(&oncpu);
   }
+  Bucket max_err("max_err");
+  if (child.target.has_folded()) {
+    // keys beyond max_keys are folded, show the error bound of others
+    child.target.loop_for_element([&](Bucket::Element &el) {
+      max_err.add_val(el.name, el.name == BUCKET_OTHERS ? "-" : std::to_string(el.err));
+    });
+    hist.add_extra_bucket(&max_err);
+  }
 
   hist.print();
+  if (child.target.has_folded()) {
+    printf("children beyond top %u are folded into %s, max_err is the upper bound of\n"
+           "total latency (ns) missed by each child\n", opt.max_keys, BUCKET_OTHERS);
+  }
+}
+
+static void print_call_tree_node(const std::string &name, CallTreeNode &node,
+    uint64_t root_incl, uint32_t depth, bool offcpu) {
+  printf("%-10lu %-12lu %-12lu %-8.2f", node.count,
+         node.incl / node.count, node.excl / node.count,
+         root_incl ? 100.0 * node.incl / root_incl : 0.0);
+  if (offcpu) {
+    printf(" %-14lu %-14lu", node.sched_incl / node.count,
+           node.sched_excl / node.count);
+  }
+  printf(" %*s%s\n", depth * 2, "", name.c_str());
+
+  /* children with larger latency first */
+  vector<pair<uint64_t, const std::string *>> order;
+  for (auto &it : node.children) {
+    if (it.second->count)
+      order.emplace_back(it.second->incl, &it.first);
+  }
+  std::sort(order.rbegin(), order.rend());
+  for (auto &it : order) {
+    print_call_tree_node(*it.second, *node.children[*it.second],
+                         root_incl, depth + 1, offcpu);
+  }
+}
+
+void FuncStat::print_call_tree() {
+  char title[1024];
+  snprintf(title, 1024,
+           "Calling-context tree of [%s], depth %u (average latency in ns):",
+           opt.target.c_str(), opt.cct_depth);
+  print_title(title);
+  printf("%-10s %-12s %-12s %-8s", "cnt", "incl", "excl", "incl(%)");
+  if (opt.offcpu)
+    printf(" %-14s %-14s", "sched_incl", "sched_excl");
+  printf(" name\n");
+  print_call_tree_node(opt.target, cct, cct.incl, 0, opt.offcpu);
+}
+
+static void print_caller_tree_node(const std::string &name, CallTreeNode &node,
+    uint64_t root_count, uint32_t depth, bool offcpu) {
+  printf("%-10lu %-12lu %-8.2f", node.count, node.incl / node.count,
+         root_count ? 100.0 * node.count / root_count : 0.0);
+  if (offcpu)
+    printf(" %-14lu", node.sched_incl / node.count);
+  printf(" %*s%s%s\n", depth * 2, "", depth ? "<- " : "", name.c_str());
+
+  /* callers with more calls first */
+  vector<pair<uint64_t, const std::string *>> order;
+  for (auto &it : node.children) {
+    if (it.second->count)
+      order.emplace_back(it.second->count, &it.first);
+  }
+  std::sort(order.rbegin(), order.rend());
+  for (auto &it : order) {
+    print_caller_tree_node(*it.second, *node.children[*it.second],
+                           root_count, depth + 1, offcpu);
+  }
+}
+
+void FuncStat::print_caller_tree() {
+  char title[1024];
+  snprintf(title, 1024,
+           "Caller paths of [%s], depth %u (average latency in ns):",
+           opt.target.c_str(), opt.caller_depth);
+  print_title(title);
+  printf("%-10s %-12s %-8s", "cnt", "latency", "cnt(%)");
+  if (opt.offcpu)
+    printf(" %-14s", "sched");
+  printf(" path\n");
+  print_caller_tree_node(opt.target, caller_tree, caller_tree.count, 0, opt.offcpu);
+}
+
+void FuncStat::print_outliers() {
+  char title[1024];
+  snprintf(title, 1024,
+           "Outliers - %zu slowest calls of [%s] (latency in ns):",
+           outliers.size(), opt.target.c_str());
+  print_title(title);
+  vector<Outlier> sorted(outliers);
+  std::sort(sorted.begin(), sorted.end());
+  printf("%-12s", "latency");
+  if (opt.offcpu)
+    printf(" %-12s", "sched");
+  printf(" %-10s %-40s caller\n", "tid", "time_interval");
+  for (Outlier &outlier : sorted) {
+    // the same format as --time_interval
+    char interval[64];
+    snprintf(interval, 64, "%lu,0,%lu", outlier.ts, outlier.latency);
+    printf("%-12lu", outlier.latency);
+    if (opt.offcpu)
+      printf(" %-12lu", outlier.sched);
+    printf(" %-10ld %-40s %s\n", outlier.tid, interval,
+           funcname_get_name(outlier.caller).c_str());
+
+    std::sort(outlier.children.begin(), outlier.children.end(),
+        [](const pair<string, pair<uint64_t, uint64_t>> &a,
+           const pair<string, pair<uint64_t, uint64_t>> &b) {
+      return a.second.first > b.second.first;
+    });
+    for (auto &it : outlier.children) {
+      printf("%12s %-12lu %-10lu %s\n", "", it.second.first, it.second.second,
+             funcname_get_name(it.first).c_str());
+    }
+  }
+}
+
+void FuncStat::print_cohort() {
+  char title[1024];
+  snprintf(title, 1024,
+           "Cohort - Child functions of [%s] in slow calls (>= %lu ns, %lu calls)\n"
+           "         and typical calls (<= %lu ns, %lu calls), by growth of share:",
+           opt.target.c_str(), opt.cohort_slow, slow_count,
+           opt.cohort_fast, fast_count);
+  print_title(title);
+
+  struct Row {
+    std::string name;
+    double fast_avg, slow_avg;
+    double fast_pct, slow_pct;
+  };
+  unordered_map<string, Row> rows;
+  auto add_rows = [&](LatencyChild &cohort, uint64_t calls, bool slow) {
+    uint64_t total = 0;
+    cohort.target.loop_for_element([&](Bucket::Element &el) {
+      total += el.total;
+    });
+    cohort.target.loop_for_element([&](Bucket::Element &el) {
+      string name = funcname_get_name(el.name);
+      Row &row = rows.emplace(name, Row{name, 0, 0, 0, 0}).first->second;
+      double avg = calls ? (double)el.total / calls : 0;
+      double pct = total ? 100.0 * el.total / total : 0;
+      (slow ? row.slow_avg : row.fast_avg) += avg;
+      (slow ? row.slow_pct : row.fast_pct) += pct;
+    });
+  };
+  add_rows(fast_children, fast_count, false);
+  add_rows(slow_children, slow_count, true);
+
+  vector<Row> sorted;
+  for (auto &it : rows)
+    sorted.push_back(it.second);
+  std::sort(sorted.begin(), sorted.end(), [](const Row &a, const Row &b) {
+    return a.slow_pct - a.fast_pct > b.slow_pct - b.fast_pct;
+  });
+  printf("%-12s %-12s %-10s %-10s %-10s name\n", "typical(ns)", "slow(ns)",
+         "typical(%)", "slow(%)", "growth(%)");
+  for (Row &row : sorted) {
+    printf("%-12.0f %-12.0f %-10.2f %-10.2f %+-10.2f %s\n", row.fast_avg,
+           row.slow_avg, row.fast_pct, row.slow_pct,
+           row.slow_pct - row.fast_pct, row.name.c_str());
+  }
+}
+
+/* fold the callers beyond the top max_keys by latency, like Bucket */
+void FuncStat::fold_callers(bool by_total) {
+  vector<pair<uint64_t, std::string>> order;
+  for (auto &it : callers) {
+    if (it.first != BUCKET_OTHERS && it.first != "unknown")
+      order.emplace_back(it.second.get_total() - (by_total ? it.second.err : 0),
+                         it.first);
+  }
+  if (order.size() <= opt.max_keys)
+    return;
+  std::nth_element(order.begin(), order.begin() + opt.max_keys, order.end(),
+                   std::greater<pair<uint64_t, std::string>>());
+  LatencyCaller &others = callers[BUCKET_OTHERS];
+  others.children.set_max_keys(opt.max_keys);
+  for (size_t i = opt.max_keys; i < order.size(); ++i) {
+    auto it = callers.find(order[i].second);
+    others.merge(it->second);
+    caller_floor = std::max(caller_floor, it->second.get_total());
+    callers.erase(it);
+  }
+}
+
+/* fold callers and children to max_keys by the exact latency to print */
+void FuncStat::trim_keys() {
+  if (callers.size() > opt.max_keys)
+    fold_callers(true);
+  children.trim_keys();
+  for (auto &it : callers)
+    it.second.children.trim_keys();
+  // both cohorts keep the top children of either, to compare the same rows
+  unordered_set<std::string> keep = fast_children.target.get_top_keys();
+  for (const std::string &key : slow_children.target.get_top_keys())
+    keep.insert(key);
+  fast_children.fold_keys_to(keep);
+  slow_children.fold_keys_to(keep);
+}
+
+void FuncStat::scale_samples() {
+  uint32_t n = opt.sample;
+  if (n <= 1 || opt.sample_scaled)
+    return;
+  opt.sample_scaled = true;
+  latency.scale(n);
+  children.scale(n);
+  for (auto &it : callers) {
+    it.second.latency.scale(n);
+    it.second.children.scale(n);
+    it.second.err *= n;
+  }
+  caller_floor *= n;
+  sched_count *= n;
+  fast_children.scale(n);
+  slow_children.scale(n);
+  fast_count *= n;
+  slow_count *= n;
+  heatmap.scale(n);
+  cct.scale(n);
+  caller_tree.scale(n);
+}
+
+void FuncStat::merge_callers(FuncStat &stat) {
+  if (stat.caller_floor) {
+    // callers not in stat may have been folded by it
+    for (auto &it : callers) {
+      if (!stat.callers.count(it.first))
+        it.second.err += stat.caller_floor;
+    }
+  }
+  for (auto &it : stat.callers) {
+    auto found = callers.find(it.first);
+    if (found == callers.end()) {
+      found = callers.emplace(it.first, LatencyCaller()).first;
+      found->second.err = caller_floor;
+      found->second.children.set_max_keys(opt.max_keys);
+    }
+    found->second.merge(it.second);
+    found->second.err += it.second.err;
+  }
+  caller_floor += stat.caller_floor;
+  if (opt.max_keys && callers.size() > 2 * opt.max_keys)
+    fold_callers();
 }
 
 void FuncStat::add_addr_from_funcname(const std::string &name) {
@@ -400,6 +816,9 @@ void FuncStat::generate_srcline() {
 void FuncStat::print() {
   char title[1024];
 
+  scale_samples();
+  if (opt.max_keys)
+    trim_keys();
 	init_print_width();
   if (opt.call_line) {
     generate_srcline();
@@ -427,11 +846,36 @@ void FuncStat::print() {
     print_title(title);
 		print_child(children);
   }
+  if (opt.cct_depth && cct.count) {
+    print_cross_line('-');
+    print_call_tree();
+  }
+  if (opt.caller_depth && caller_tree.count) {
+    print_cross_line('-');
+    print_caller_tree();
+  }
+  if (opt.top_k && !outliers.empty()) {
+    print_cross_line('-');
+    print_outliers();
+  }
+  if (opt.cohort_slow && slow_count) {
+    print_cross_line('-');
+    print_cohort();
+  }
+  if (opt.heatmap_windows && !heatmap.empty()) {
+    print_cross_line('-');
+    snprintf(title, 1024,
+             "Heatmap - Latency of [%s] in %u windows of %.3f ms:",
+             opt.target.c_str(), opt.heatmap_windows,
+             (double)opt.heatmap_unit / 1000000);
+    print_title(title);
+    heatmap.print();
+  }
 
   for (auto &it : callers) {
     string caller_name = it.first;
     auto &caller = it.second;
-    if (opt.call_line) {
+    if (opt.call_line && caller_name != BUCKET_OTHERS) {
       string srcline;
       srcline_map->get(caller_name, srcline);
       caller_name = funcname_get_name(caller_name) + "(" + srcline + ")";
@@ -448,6 +892,8 @@ void FuncStat::print() {
              opt.target.c_str(), caller_name.c_str());
       print_title(title);
       print_latency(caller.latency);
+      if (caller.err)
+        printf("latency missed by max_keys: at most %lu ns\n", caller.err);
       print_cross_line('-');
     }
 
@@ -462,6 +908,310 @@ void FuncStat::print() {
   print_cross_line('=');
 }
 
+void FuncStat::save(ShardWriter &w) {
+  w.put_str(opt.target);
+  w.put_u64(opt.offcpu);
+  w.put_u64(opt.call_line);
+  w.put_u64(opt.code_block);
+  w.put_u64(opt.latency_interval.first);
+  w.put_u64(opt.latency_interval.second);
+  w.put_u64(opt.time_interval.first);
+  w.put_u64(opt.time_interval.second);
+  w.put_u64(opt.trace_time);
+  w.put_u64(opt.ip_filtering);
+  w.put_u64(opt.cct_depth);
+  w.put_u64(opt.caller_depth);
+  w.put_u64(opt.top_k);
+  w.put_u64(opt.cohort_fast);
+  w.put_u64(opt.cohort_slow);
+  w.put_u64(opt.heatmap_windows);
+  w.put_u64(opt.heatmap_unit);
+  w.put_u64(opt.max_keys);
+  w.put_u64(opt.sample);
+
+  latency.save(w);
+  children.save(w);
+  w.put_u64(callers.size());
+  for (auto &it : callers) {
+    w.put_str(it.first);
+    it.second.save(w);
+  }
+  w.put_u64(caller_floor);
+  w.put_u64(sched_count);
+  cct.save(w);
+  caller_tree.save(w);
+  w.put_u64(outliers.size());
+  for (Outlier &outlier : outliers) {
+    outlier.save(w);
+  }
+  fast_children.save(w);
+  slow_children.save(w);
+  w.put_u64(fast_count);
+  w.put_u64(slow_count);
+  heatmap.save(w);
+}
+
+void FuncStat::load(ShardReader &r) {
+  opt.target = r.get_str();
+  opt.offcpu = r.get_u64();
+  opt.call_line = r.get_u64();
+  opt.code_block = r.get_u64();
+  opt.latency_interval.first = r.get_u64();
+  opt.latency_interval.second = r.get_u64();
+  opt.time_interval.first = r.get_u64();
+  opt.time_interval.second = r.get_u64();
+  opt.trace_time = r.get_u64();
+  opt.ip_filtering = r.get_u64();
+  opt.cct_depth = r.get_u64();
+  opt.caller_depth = r.get_u64();
+  opt.top_k = r.get_u64();
+  opt.cohort_fast = r.get_u64();
+  opt.cohort_slow = r.get_u64();
+  opt.heatmap_windows = r.get_u64();
+  opt.heatmap_unit = r.get_u64();
+  opt.max_keys = r.get_u64();
+  opt.sample = r.get_u64();
+  opt.sample_scaled = false;
+  opt.timeline = false;
+  opt.time_start = 0;
+  opt.timeline_unit = 1;
+
+  latency.load(r);
+  children.load(r);
+  for (uint64_t n = r.get_len(sizeof(uint64_t)); n > 0 && r.good(); --n) {
+    std::string name = r.get_str();
+    callers[name].load(r);
+  }
+  caller_floor = r.get_u64();
+  set_max_keys();
+  for (auto &it : callers)
+    it.second.children.set_max_keys(opt.max_keys);
+  sched_count = r.get_u64();
+  cct.load(r);
+  caller_tree.load(r);
+  for (uint64_t n = r.get_len(sizeof(uint64_t)); n > 0 && r.good(); --n) {
+    Outlier outlier;
+    outlier.load(r);
+    add_outlier(outlier);
+  }
+  fast_children.load(r);
+  slow_children.load(r);
+  fast_count = r.get_u64();
+  slow_count = r.get_u64();
+  heatmap.load(r);
+}
+
+static void print_diff_value(double base, double cur) {
+  printf(" %-12.0f %-12.0f %+-12.0f", base, cur, cur - base);
+  if (base > 0)
+    printf(" %+-10.2f", 100.0 * (cur - base) / base);
+  else
+    printf(" %-10s", "-");
+}
+
+void FuncStatDiff::print_latency() {
+  Distribution &b = base.latency.target;
+  Distribution &c = cur.latency.target;
+  const vector<uint32_t> &b_slots = b.get_slots();
+  const vector<uint32_t> &c_slots = c.get_slots();
+  size_t slot_size = std::max(b_slots.size(), c_slots.size());
+
+  printf("%*s%-*s : %-10s %-10s %-10s\n", 10, "", 14, "ns",
+         "base", "new", "delta");
+  bool skip = true;
+  for (size_t i = 0; i < slot_size; ++i) {
+    uint64_t low = (1ULL << (i + 1)) >> 1;
+    uint64_t high = (1ULL << (i + 1)) - 1;
+    if (low == high)
+      low -= 1;
+    uint32_t b_cnt = i < b_slots.size() ? b_slots[i] : 0;
+    uint32_t c_cnt = i < c_slots.size() ? c_slots[i] : 0;
+    if (!b_cnt && !c_cnt && skip)
+      continue;
+    skip = false;
+    printf("%*lu -> %-*lu : %-10u %-10u %+ld\n", 10, low, 10, high,
+           b_cnt, c_cnt, (long)c_cnt - (long)b_cnt);
+  }
+
+  printf("\n%-14s %-12s %-12s %-12s %-10s\n", "", "base", "new", "delta", "delta(%)");
+  printf("%-14s", "count");
+  print_diff_value(b.get_count() + base.latency.unknown_count,
+                   c.get_count() + cur.latency.unknown_count);
+  printf("\n%-14s", "avg (ns)");
+  print_diff_value(b.get_avg(), c.get_avg());
+  const double pcts[] = {50, 90, 99};
+  for (double pct : pcts) {
+    char name[32];
+    snprintf(name, 32, "p%.0f (<= ns)", pct);
+    printf("\n%-14s", name);
+    print_diff_value(b.get_percentile(pct), c.get_percentile(pct));
+  }
+  if (base.opt.offcpu || cur.opt.offcpu) {
+    printf("\n%-14s", "sched (ns)");
+    print_diff_value(
+        b.get_count() ? base.latency.sched.get_total() / b.get_count() : 0,
+        c.get_count() ? cur.latency.sched.get_total() / c.get_count() : 0);
+  }
+  printf("\n");
+}
+
+/* rows of both runs are matched by function name, the addresses
+ * of call lines may be changed by the patch */
+static void add_bucket_rows(vector<FuncStatDiff::Row> &rows,
+    unordered_map<string, size_t> &row_idx, Bucket &bucket,
+    double calls, bool is_base) {
+  bucket.loop_for_element([&](Bucket::Element &el) {
+    string name = funcname_get_name(el.name);
+    auto it = row_idx.find(name);
+    if (it == row_idx.end()) {
+      it = row_idx.emplace(name, rows.size()).first;
+      rows.push_back({name, 0, 0, 0, 0});
+    }
+    FuncStatDiff::Row &row = rows[it->second];
+    double time = calls > 0 ? el.total / calls : 0;
+    if (is_base) {
+      row.base_time += time;
+      row.base_count += el.count;
+    } else {
+      row.cur_time += time;
+      row.cur_count += el.count;
+    }
+  });
+}
+
+void FuncStatDiff::add_child_rows(vector<Row> &rows) {
+  unordered_map<string, size_t> row_idx;
+  add_bucket_rows(rows, row_idx, base.children.target,
+                  base.latency.target.get_count(), true);
+  add_bucket_rows(rows, row_idx, cur.children.target,
+                  cur.latency.target.get_count(), false);
+}
+
+void FuncStatDiff::add_caller_rows(vector<Row> &rows) {
+  Bucket b_callers, c_callers;
+  for (auto &it : base.callers) {
+    Distribution &lat = it.second.latency.target;
+    if (it.first != "unknown" && lat.get_count())
+      b_callers.add_val(it.first, lat.get_total());
+  }
+  for (auto &it : cur.callers) {
+    Distribution &lat = it.second.latency.target;
+    if (it.first != "unknown" && lat.get_count())
+      c_callers.add_val(it.first, lat.get_total());
+  }
+  unordered_map<string, size_t> row_idx;
+  add_bucket_rows(rows, row_idx, b_callers,
+                  base.latency.target.get_count(), true);
+  add_bucket_rows(rows, row_idx, c_callers,
+                  cur.latency.target.get_count(), false);
+  /* count of caller is the calls of target, not the bucket's add times */
+  for (Row &row : rows) {
+    row.base_count = row.cur_count = 0;
+    for (auto &it : base.callers) {
+      if (funcname_get_name(it.first) == row.name)
+        row.base_count += it.second.latency.target.get_count();
+    }
+    for (auto &it : cur.callers) {
+      if (funcname_get_name(it.first) == row.name)
+        row.cur_count += it.second.latency.target.get_count();
+    }
+  }
+}
+
+void FuncStatDiff::print_rows(const char *title, vector<Row> &rows) {
+  /* rows with larger absolute time change first */
+  std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+    return std::fabs(a.delta()) > std::fabs(b.delta());
+  });
+  print_title(title);
+  printf("%-12s %-12s %-12s %-10s %-10s %-10s name\n",
+         "base(ns)", "new(ns)", "delta(ns)", "delta(%)", "base_cnt", "new_cnt");
+  for (Row &row : rows) {
+    printf("%-12.0f %-12.0f %+-12.0f", row.base_time, row.cur_time, row.delta());
+    if (row.base_time > 0)
+      printf(" %+-10.2f", 100.0 * row.delta() / row.base_time);
+    else
+      printf(" %-10s", "new");
+    printf(" %-10lu %-10lu %s\n", row.base_count, row.cur_count, row.name.c_str());
+  }
+}
+
+void FuncStatDiff::print() {
+  char title[1024];
+  base.init_print_width();
+  print_cross_line('=');
+  snprintf(title, 1024, "Histogram - Latency diff of [%s] (base -> new):",
+           base.opt.target.c_str());
+  print_title(title);
+  print_latency();
+
+  vector<Row> rows;
+  add_child_rows(rows);
+  if (!rows.empty()) {
+    print_cross_line('-');
+    snprintf(title, 1024,
+             "Child functions's time diff of [%s] (ns per call of target):",
+             base.opt.target.c_str());
+    print_rows(title, rows);
+  }
+
+  rows.clear();
+  add_caller_rows(rows);
+  if (!rows.empty()) {
+    print_cross_line('-');
+    snprintf(title, 1024,
+             "Caller's time diff of [%s] (ns per call of target):",
+             base.opt.target.c_str());
+    print_rows(title, rows);
+  }
+  print_cross_line('=');
+}
+
+void FuncStatDiff::write_folded_node(ostream &os, const string &path,
+    CallTreeNode *base_node, CallTreeNode *cur_node) {
+  uint64_t b_calls = base.cct.count, c_calls = cur.cct.count;
+  uint64_t b_excl = base_node && b_calls ? base_node->excl / b_calls : 0;
+  uint64_t c_excl = cur_node && c_calls ? cur_node->excl / c_calls : 0;
+  if (b_excl || c_excl)
+    os << path << " " << b_excl << " " << c_excl << "\n";
+
+  vector<string> names;
+  if (base_node) {
+    for (auto &it : base_node->children) names.push_back(it.first);
+  }
+  if (cur_node) {
+    for (auto &it : cur_node->children) {
+      if (!base_node || !base_node->children.count(it.first))
+        names.push_back(it.first);
+    }
+  }
+  for (const string &name : names) {
+    CallTreeNode *b = nullptr, *c = nullptr;
+    if (base_node && base_node->children.count(name))
+      b = base_node->children[name].get();
+    if (cur_node && cur_node->children.count(name))
+      c = cur_node->children[name].get();
+    write_folded_node(os, path + ";" + funcname_get_name(name), b, c);
+  }
+}
+
+void FuncStatDiff::write_folded(ostream &os) {
+  if (base.cct.count && cur.cct.count) {
+    write_folded_node(os, base.opt.target, &base.cct, &cur.cct);
+    return;
+  }
+  /* without calling-context tree, only the children of target */
+  vector<Row> rows;
+  add_child_rows(rows);
+  for (Row &row : rows) {
+    string path = base.opt.target;
+    if (row.name != TARGET_SELF)
+      path += ";" + row.name;
+    os << path << " " << (uint64_t)row.base_time << " "
+       << (uint64_t)row.cur_time << "\n";
+  }
+}
+
 void FuncStat::print_timeline() {
   graphs::options gopt;
   gopt.type = graphs::type_braille;
@@ -477,6 +1227,31 @@ void FuncStat::print_timeline() {
     graphs::plot(100, 160, 0, 0, 0, 0, timeline, gopt);
 }
 
+void FuncStat::print_summary(uint32_t top) {
+  Distribution &dist = latency.target;
+  uint64_t count = dist.get_count() * std::max(opt.sample, 1U);
+  printf("[%s] calls: %lu%s, average latency: %lu ns, p99 latency: <= %lu ns\n",
+         opt.target.c_str(), count, opt.sample > 1 ? " (sampled)" : "",
+         dist.get_avg(), dist.get_percentile(99));
+  /* share of children in the total latency of target */
+  vector<pair<uint64_t, string>> order;
+  children.target.loop_for_element([&](Bucket::Element &el) {
+    if (el.total)
+      order.emplace_back(el.total, el.name);
+  });
+  size_t num = std::min((size_t)top, order.size());
+  if (!num || !dist.get_total())
+    return;
+  std::partial_sort(order.begin(), order.begin() + num, order.end(),
+                    std::greater<pair<uint64_t, string>>());
+  printf("    top children:");
+  for (size_t i = 0; i < num; ++i) {
+    printf("%s %s %.1f%%", i ? "," : "", funcname_get_name(order[i].second).c_str(),
+           100.0 * order[i].first / dist.get_total());
+  }
+  printf("\n");
+}
+
 void FuncGlobalStatus::print(size_t thread_num, const std::string &ancestor) {
   printf("[ real trace time: %0.2f seconds ]\n", real_trace_time());
 
@@ -9,6 +9,7 @@
 #include <stdexcept>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <cstring>
 #include <pwd.h>
 
@@ -48,7 +49,8 @@ std::pair<uint64_t, uint64_t> get_interval_from_string(const std::string &str) {
     return {0, UINT64_MAX};
   }
   res.first = str2long(str.substr(0, sep));
-  res.second = str2long(str.substr(sep + 1, str.size()));
+  std::string max = str.substr(sep + 1, str.size());
+  res.second = (max == "inf") ? UINT64_MAX : str2long(max);
   return res;
 }
 size_t get_file_linecount(const std::string &path) {
@@ -61,6 +63,13 @@ size_t get_file_linecount(const std::string &path) {
   return total;
 }
 
+size_t get_file_size(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st))
+    return 0;
+  return st.st_size;
+}
+
 std::string parse_number_range_to_sequence(const std::string &str) {
   std::stringstream ss(str);
   std::string range;
@@ -83,6 +92,17 @@ std::string parse_number_range_to_sequence(const std::string &str) {
   return res;
 }
 
+std::vector<std::string> split_string(const std::string &str, char sep) {
+  std::stringstream ss(str);
+  std::string item;
+  std::vector<std::string> res;
+  while (getline(ss, item, sep)) {
+    if (item != "")
+      res.push_back(item);
+  }
+  return res;
+}
+
 bool create_directory(const std::string &path) {
   if (mkdir(path.c_str(), 0755)) {
     printf("ERROR: Directory %s created failed.\n", path.c_str());
@@ -323,3 +343,29 @@ std::string resolve_path(const std::string &path) {
   return absolute_path;
 }
 
+uint64_t get_peak_rss() {
+  std::ifstream ifs("/proc/self/status");
+  std::string line;
+  while (getline(ifs, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return strtoull(line.c_str() + 6, nullptr, 10);
+  }
+  return 0;
+}
+
+void reset_peak_rss() {
+  // "5" resets the peak resident memory to the current one, linux >= 4.0
+  FILE *fp = fopen("/proc/self/clear_refs", "w");
+  if (fp) {
+    fputs("5", fp);
+    fclose(fp);
+  }
+}
+
+double get_cpu_time() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
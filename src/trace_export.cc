@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "trace_export.h"
+
+namespace pt {
+using namespace std;
+
+#define TRACE_WRITE_BUFFER (1 << 20)
+
+ChromeTraceWriter::ChromeTraceWriter(const string &file, long t)
+    : tid(t), first(true) {
+  fp = fopen(part_file(file, tid).c_str(), "w");
+  if (fp)
+    setvbuf(fp, nullptr, _IOFBF, TRACE_WRITE_BUFFER);
+}
+
+ChromeTraceWriter::~ChromeTraceWriter() {
+  if (fp)
+    fclose(fp);
+}
+
+static void write_json_string(FILE *fp, const string &str) {
+  fputc('"', fp);
+  for (char c : str) {
+    if (c == '"' || c == '\\')
+      fputc('\\', fp);
+    fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+void ChromeTraceWriter::commit() {
+  if (!fp) {
+    pending.clear();
+    return;
+  }
+  for (Event &ev : pending) {
+    // timestamps of trace event are in us
+    fprintf(fp, "%s{\"name\":", first ? "" : ",\n");
+    write_json_string(fp, ev.name);
+    fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lu.%03lu,"
+            "\"dur\":%lu.%03lu,\"pid\":0,\"tid\":%ld}",
+            ev.cat, ev.ts / 1000, ev.ts % 1000,
+            ev.dur / 1000, ev.dur % 1000, tid);
+    first = false;
+  }
+  pending.clear();
+}
+
+bool ChromeTraceWriter::concat(const string &file, const vector<long> &tids) {
+  FILE *out = fopen(file.c_str(), "w");
+  if (!out)
+    return false;
+  fprintf(out, "{\"traceEvents\":[\n");
+  bool empty = true;
+  vector<char> buf(TRACE_WRITE_BUFFER);
+  for (long tid : tids) {
+    string part = part_file(file, tid);
+    FILE *in = fopen(part.c_str(), "r");
+    if (!in)
+      continue;
+    size_t n = fread(buf.data(), 1, buf.size(), in);
+    if (n > 0 && !empty)
+      fprintf(out, ",\n");
+    while (n > 0) {
+      fwrite(buf.data(), 1, n, out);
+      empty = false;
+      n = fread(buf.data(), 1, buf.size(), in);
+    }
+    fclose(in);
+    unlink(part.c_str());
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  bool ok = !ferror(out);
+  fclose(out);
+  return ok;
+}
+};
@@ -5,6 +5,7 @@
 void ParallelWorker::run() {
   while(!should_stop.load()) {
     job_doing = nullptr;
+    uint64_t enqueue = 0;
     {
       std::unique_lock<std::mutex> ul(m_mutex);
       if (jobs.empty()) {
@@ -15,10 +16,19 @@ void ParallelWorker::run() {
         assert(should_stop.load());
         break;
       }
-      job_doing = jobs.front();
+      job_doing = jobs.front().first;
+      enqueue = jobs.front().second;
       jobs.pop();
     }
-    if (job_doing) {
+    if (job_doing && profiling->load()) {
+      uint64_t start = job_time_now();
+      job_doing->exec();
+      JobProfile profile = {job_doing->job_name(), idx, enqueue ? enqueue : start,
+                            start, job_time_now(), job_doing->job_items(),
+                            job_doing->job_bytes()};
+      std::unique_lock<std::mutex> ul(m_mutex);
+      profiles.push_back(profile);
+    } else if (job_doing) {
       job_doing->exec();
     }
   }
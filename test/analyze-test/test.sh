@@ -0,0 +1,139 @@
+#! /bin/bash
+
+# Analysis test on a synthetic trace, no Intel PT is required.
+#
+# The trace is a text script_out of 'perf script', the calls of 3 threads
+# are generated by gen_trace with fixed timestamps:
+#   main -> top -> mid -> foo -> baz                 (n % 4 == 0)
+#   main -> mid -> foo -> baz                        (n % 4 == 1)
+#   main -> top -> mid -> mid -> foo -> baz, slow    (n % 4 == 2)
+#   main -> top -> foo -> baz                        (n % 4 == 3)
+# and foo is scheduled out once in each call. The cases are replayed with
+# '--history=3' and compared with the result in res/. The trace of index
+# cases also has an inner jump of foo, the action index is built from it
+# and queried with '--history=4 -c'. The stat shards of a full and of a
+# sampled run are merged and compared by the merge and diff modes.
+#
+# usage:
+#   ./test.sh -r 1        record the result to res/
+#   ./test.sh             run and compare with res/
+
+dir=`pwd`
+func_latency=$dir/../../func_latency
+record=0
+
+get_key_value()
+{
+  echo "$1" | sed 's/^-[a-zA-Z_-]*=//'
+}
+
+parse_options()
+{
+  while test $# -gt 0
+  do
+    case "$1" in
+    -r=*) record=`get_key_value "$1"`;;
+    -r) shift; record=`get_key_value "$1"`;;
+    *)
+      echo "Unknown option '$1'"
+      exit 1;;
+    esac
+    shift
+  done
+}
+parse_options "$@"
+
+gen_trace() {
+  awk -v jumps="$1" 'BEGIN {
+    ts = 1000000000
+    addr["main"] = 4194304; addr["top"] = 4198400; addr["mid"] = 4202496
+    addr["foo"] = 4206592; addr["baz"] = 4210688; addr["__schedule"] = 4214784
+    for (n = 0; n < 2000; ++n) {
+      tid = 100 + n % 3
+      r = n % 4
+      if (r == 0) { call("main", "top"); call("top", "mid"); foo(); ret("mid", "top"); ret("top", "main") }
+      if (r == 1) { call("main", "mid"); foo(); ret("mid", "main") }
+      if (r == 2) { call("main", "top"); call("top", "mid"); call("mid", "mid"); foo();
+                    ret("mid", "mid"); ts += 500; ret("mid", "top"); ret("top", "main") }
+      if (r == 3) { call("main", "top"); call("top", "foo"); call("foo", "baz"); ret("baz", "foo");
+                    ret("foo", "top"); ret("top", "main") }
+    }
+  }
+  function foo() {
+    call("mid", "foo")
+    if (jumps) line("jmp", "foo", 32, "foo", 48)
+    call("foo", "baz"); ret("baz", "foo")
+    call("foo", "__schedule"); ts += 100; ret("__schedule", "foo"); ret("foo", "mid")
+  }
+  function line(type, from, from_off, to, to_off) {
+    ts += 5 + (ts * 7) % 31
+    printf("%8d [001] %d.%09d:   %-8s %x %s+0x%x =>   %x %s+0x%x\n", tid,
+           int(ts / 1000000000), ts % 1000000000, type, addr[from] + from_off,
+           from, from_off, addr[to] + to_off, to, to_off)
+  }
+  function call(from, to) { line("call", from, 16, to, 0) }
+  function ret(from, to) { line("return", from, 128, to, 21) }'
+}
+
+run_case() {
+  echo "%%%%%%%%%%%%% run case $@"
+  $func_latency -f foo -o --history=3 -w 3 --script_format=text "$@" 2>&1 | \
+    grep -v "has consumed\|addr2line\|^ \|^$\|Usage\|Report bugs"
+}
+
+run_cases() {
+  run_case -a "top>mid"
+  run_case -a "top>mid#400,inf"
+  run_case --sample 4
+  run_case --sample 4 -a "top>mid"
+  run_case --sample 4 -a "mid#0,300"
+  run_case --cct_depth 2 --li 0,100
+  run_case --cct_depth 2 --sample 4 -a "top>mid#400,inf"
+  run_case --caller_depth 3 --li 0,100
+  run_case --caller_depth 3 --sample 4 -a "mid#0,300"
+}
+
+# code blocks of the index should be the same as the ones of the trace
+run_index_cases() {
+  mkdir -p index
+  cd index
+  gen_trace 1 > script_out
+  run_case -c
+  run_case --build_index > /dev/null
+  run_case --history=4 -c
+  cd ..
+}
+
+run_shard() {
+  echo "%%%%%%%%%%%%% run $@"
+  $func_latency "$@" 2>&1 | grep -v "has consumed\|^$"
+}
+
+# shards of different samples are merged and compared by scaled counts
+run_shard_cases() {
+  run_case --save_shard=full.shard > /dev/null
+  run_case --sample 4 --save_shard=sampled.shard > /dev/null
+  run_shard merge full.shard sampled.shard
+  run_shard merge sampled.shard sampled.shard
+  run_shard diff full.shard sampled.shard
+}
+
+mkdir -p trace
+cd trace
+gen_trace > script_out
+if [ x"$record" = x"1" ]; then
+  mkdir -p $dir/res
+  (run_cases; run_index_cases; run_shard_cases) > $dir/res/analyze.log
+  echo "%%%%%%%%%%%%%% record $dir/res/analyze.log"
+  cd $dir
+  exit 0
+fi
+(run_cases; run_index_cases; run_shard_cases) > $dir/analyze.log
+cd $dir
+echo "%%%%%%%%%%%%%% compare res/analyze.log analyze.log"
+# calls not sampled should not leave unknown children
+if grep -q "(unknown latency)" analyze.log; then
+  echo "ERROR: unknown child latency is found"
+  exit 1
+fi
+diff res/analyze.log analyze.log
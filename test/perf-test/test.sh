@@ -0,0 +1,211 @@
+#! /bin/bash
+
+# Phase timing regression test of func_latency on recorded traces.
+#
+# Each case directory holds the trace of one target function, as the
+# text/<func> and compact/<func> directories of mysql-test. The cases are
+# replayed with '--history=3' (script_out) or '--history=2' (perf.data)
+# over a matrix of worker num, script format and extra options. The wall
+# time of every "[ ... has consumed X seconds ]" phase, with the wall/CPU
+# time and peak RSS of the process, is written to a csv file:
+#
+#   case,format,workers,options,metric,value
+#
+# and compared with the baseline csv. A metric is a regression if it is
+# slower than the baseline by more than the threshold (in percent).
+#
+# usage:
+#   ./test.sh -r 1        record the baseline to res/baseline.csv
+#   ./test.sh             run and compare with res/baseline.csv
+#
+# The baseline depends on the machine, so record it on the machine which
+# runs the test, with the same trace data (see ../config.sh).
+
+dir=`pwd`
+func_latency=$dir/../../func_latency
+binary=$dir/../mysql-test/mysqld
+case_root=$dir/../mysql-test/test2
+record=0
+history=3
+workers="5 10 32"
+formats="text compact"
+# extra options of the matrix, separated by ';', '-' for no option
+extra_opts="-;-o;-c"
+ancestor=""
+rounds=1
+threshold=20
+# ignore phases shorter than it (seconds) in baseline, which are noises
+min_seconds=0.1
+baseline=$dir/res/baseline.csv
+output=$dir/result.csv
+
+get_key_value()
+{
+  echo "$1" | sed 's/^-[a-zA-Z_-]*=//'
+}
+
+usage()
+{
+  echo "usage ./test.sh [-r 0|1] [-b binary] [-d case_root] [-H 2|3] [-w \"5 10 32\"]"
+  echo "                [-m \"text compact\"] [-x \"-;-o;-c\"] [-a ancestor] [-n rounds]"
+  echo "                [-t threshold] [-B baseline] [-O output]"
+  echo "  -r --- 1: record the baseline, 0: compare with the baseline (by default)"
+  echo "  -b --- binary of the traced program, ../mysql-test/mysqld by default"
+  echo "  -d --- root of cases, with <format>/<func> directories, ../mysql-test/test2 by default"
+  echo "  -H --- history mode to replay, 3: script_out (by default), 2: perf.data"
+  echo "  -w --- worker nums of the matrix"
+  echo "  -m --- script formats of the matrix"
+  echo "  -x --- extra options of the matrix, separated by ';', '-' for no option"
+  echo "  -a --- ancestor of '--ancestor', adds it to the matrix, eg, 'do_command#0,1000000'"
+  echo "  -n --- run each case some rounds, and keep the fastest one"
+  echo "  -t --- threshold of regression in percent, 20 by default"
+  echo "  -B --- baseline csv, res/baseline.csv by default"
+  echo "  -O --- output csv, result.csv by default"
+}
+
+parse_options()
+{
+  while test $# -gt 0
+  do
+    case "$1" in
+    -r=*) record=`get_key_value "$1"`;;
+    -r) shift; record=`get_key_value "$1"`;;
+    -b=*) binary=`get_key_value "$1"`;;
+    -b) shift; binary=`get_key_value "$1"`;;
+    -d=*) case_root=`get_key_value "$1"`;;
+    -d) shift; case_root=`get_key_value "$1"`;;
+    -H=*) history=`get_key_value "$1"`;;
+    -H) shift; history=`get_key_value "$1"`;;
+    -w=*) workers=`get_key_value "$1"`;;
+    -w) shift; workers=`get_key_value "$1"`;;
+    -m=*) formats=`get_key_value "$1"`;;
+    -m) shift; formats=`get_key_value "$1"`;;
+    -x=*) extra_opts=`get_key_value "$1"`;;
+    -x) shift; extra_opts=`get_key_value "$1"`;;
+    -a=*) ancestor=`get_key_value "$1"`;;
+    -a) shift; ancestor=`get_key_value "$1"`;;
+    -n=*) rounds=`get_key_value "$1"`;;
+    -n) shift; rounds=`get_key_value "$1"`;;
+    -t=*) threshold=`get_key_value "$1"`;;
+    -t) shift; threshold=`get_key_value "$1"`;;
+    -B=*) baseline=`get_key_value "$1"`;;
+    -B) shift; baseline=`get_key_value "$1"`;;
+    -O=*) output=`get_key_value "$1"`;;
+    -O) shift; output=`get_key_value "$1"`;;
+    -h) usage; exit 0;;
+    *)
+      echo "Unknown option '$1'"
+      usage
+      exit 1;;
+    esac
+    shift
+  done
+}
+parse_options "$@"
+
+if [ x"$ancestor" != x"" ]; then
+  extra_opts="$extra_opts;-a $ancestor"
+fi
+
+# run one case, and print "metric,value" of it
+run_case() {
+  func=$1
+  opts=$2
+  log=`mktemp`
+  if [ -x /usr/bin/time ]; then
+    /usr/bin/time -f "@time %e %U %S %M" -o $log.time \
+      $func_latency -b "$binary" -f "$func" -s -t --history=$history $opts > $log 2>&1
+    read tag wall user sys rss < $log.time
+  else
+    # no peak RSS without GNU time
+    TIMEFORMAT="%R %U %S"
+    { time $func_latency -b "$binary" -f "$func" -s -t --history=$history $opts \
+        > $log 2>&1 ; } 2> $log.time
+    read wall user sys < $log.time
+    rss=""
+  fi
+  grep "has consumed" $log | \
+    sed 's/^\[ \(.*\) has consumed \([0-9.]*\) seconds \]$/\1,\2/; s/ /_/g'
+  echo "wall_time,$wall"
+  echo "cpu_time,`echo "$user $sys" | awk '{print $1 + $2}'`"
+  if [ x"$rss" != x"" ]; then
+    echo "peak_rss_kb,$rss"
+  fi
+  rm -f $log $log.time
+}
+
+run_matrix() {
+  for format in $formats
+  do
+    for case_dir in $case_root/$format/*/
+    do
+      func=`basename $case_dir`
+      cd $case_dir
+      for worker in $workers
+      do
+        echo "$extra_opts" | tr ';' '\n' | while read extra
+        do
+          opts="-w $worker --script_format=$format"
+          if [ x"$extra" != x"-" ]; then
+            opts="$opts $extra"
+          fi
+          echo "%%%%%%%%%%%%% run case [$func] $opts" >&2
+          # label of options in csv, without spaces and commas
+          label=`echo "$extra" | tr ' ,' '_:'`
+          for ((i = 0; i < $rounds; i++))
+          do
+            run_case "$func" "$opts" | awk -v key="$func,$format,$worker,$label" '{print key "," $0}'
+          done
+        done
+      done
+      cd $dir
+    done
+  done | awk -F, '
+    # keep the fastest round of each metric
+    { key = $1 "," $2 "," $3 "," $4 "," $5
+      if (!(key in best) || $6 < best[key]) best[key] = $6
+      if (!(key in order)) { order[key] = n; keys[n++] = key } }
+    END { for (i = 0; i < n; i++) print keys[i] "," best[keys[i]] }'
+}
+
+compare() {
+  awk -F, -v threshold=$threshold -v min_seconds=$min_seconds '
+    NR == FNR { base[$1 "," $2 "," $3 "," $4 "," $5] = $6; next }
+    { key = $1 "," $2 "," $3 "," $4 "," $5
+      if (!(key in base)) { printf("%-80s %12s %12s     new\n", key, "-", $6); next }
+      b = base[key]
+      if ($5 != "peak_rss_kb" && b < min_seconds) next
+      diff = b > 0 ? ($6 - b) * 100 / b : 0
+      flag = diff > threshold ? "REGRESSION" : ""
+      if (flag != "") ++regressions
+      printf("%-80s %12s %12s %+7.1f%% %s\n", key, b, $6, diff, flag) }
+    END {
+      printf("\n%d regressions over %d%%\n", regressions, threshold)
+      exit regressions > 0 }' $1 $2
+}
+
+if [ ! -x $func_latency ]; then
+  echo "ERROR: $func_latency is not found, build it first"
+  exit 1
+fi
+if [ ! -d $case_root ]; then
+  echo "ERROR: $case_root is not found, prepare the trace data by ../config.sh"
+  exit 1
+fi
+
+if [ x"$record" = x"1" ]; then
+  mkdir -p `dirname $baseline`
+  echo "%%%%%%%%%%%%%% record baseline $baseline"
+  run_matrix > $baseline
+  exit 0
+fi
+
+if [ ! -f $baseline ]; then
+  echo "ERROR: $baseline is not found, record it by './test.sh -r 1'"
+  exit 1
+fi
+echo "%%%%%%%%%%%%%% run $output"
+run_matrix > $output
+echo "%%%%%%%%%%%%%% compare $baseline $output"
+printf "%-80s %12s %12s %8s\n" "case,format,workers,options,metric" "baseline" "current" "diff"
+compare $baseline $output
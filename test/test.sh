@@ -3,6 +3,7 @@
 record=0
 save_log=0
 clear_log=0
+perf_test=0
 
 get_key_value()
 {
@@ -29,6 +30,11 @@ parse_options()
     -c)
       shift
       clear_log=`get_key_value "$1"`;;
+    -p=*)
+      perf_test=`get_key_value "$1"`;;
+    -p)
+      shift
+      perf_test=`get_key_value "$1"`;;
     *)
       echo "Unknown option '$1'"
       exit 1;;
@@ -76,3 +82,30 @@ else
   rm -rf *.log
 fi
 cd ..
+
+## analyze-test: synthetic trace, Intel PT is not required
+echo "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%% analyze-test %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%"
+cd analyze-test
+if [ x"$clear_log" = x"0" ]; then
+  echo "./test.sh -r $record"
+  ./test.sh -r $record
+  if [ x"$save_log" = x"0" ]; then
+    rm -rf *.log trace
+  fi
+else
+  rm -rf *.log trace
+fi
+cd ..
+
+## perf-test: phase timing, compared with the baseline of this machine
+if [ x"$perf_test" = x"1" ]; then
+  echo "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%% perf-test %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%"
+  cd perf-test
+  if [ x"$clear_log" = x"0" ]; then
+    echo "sudo ./test.sh -r $record"
+    sudo ./test.sh -r $record
+  else
+    rm -rf result.csv
+  fi
+  cd ..
+fi
@@ -2221,7 +2221,7 @@ static void process_event(struct perf_script *script,
 	struct perf_event_attr *attr = &evsel->core.attr;
 	unsigned int type = output_type(attr->type);
 	struct evsel_script *es = evsel->priv;
-	FILE *fp = es->fp;
+	FILE *fp = parallel_thread_fp ? parallel_thread_fp : es->fp;
 	char str[PAGE_SIZE_NAME_LEN];
 	const char *arch = perf_env__arch(machine->env);
 
@@ -4080,12 +4080,23 @@ int cmd_script(int argc, const char **argv)
 		   "File name prefix for parallel PT output"),
 	OPT_INTEGER(0, "parallel", &parallel_worker,
 		    "the number of parallel_worker"),
+	OPT_INTEGER(0, "parallel_threads", &parallel_threads,
+		    "the number of threads to decode per-thread trace in one process, "
+		    "the queues are decoded in segments split at mmap/comm/exit events"),
+	OPT_INTEGER(0, "parallel_chunks", &parallel_chunks,
+		    "split the trace into this number of chunks, decoded by at most parallel_worker processes at a time"),
 	OPT_INTEGER(0, "parallel_by_events", &parallel_by_events,
 		    "dispatch script work by event number, otherwise will by auxtrace size, 0 by default"),
 	OPT_INTEGER(0, "compact_format", &opt_compact_format,
 		    "print intel-pt actions with compact binary format"),
+	OPT_INTEGER(0, "unordered_queues", &opt_unordered_queues,
+		    "decode each intel-pt queue to completion without global timestamp order, 0 by default"),
+	OPT_STRING(0, "insn_cache_dir", &opt_insn_cache_dir, "dir",
+		   "load and save intel-pt instruction cache by dso build-id in this directory"),
 	OPT_STRING(0, "func_filter", &func_filter_str, "func_filter",
 		   "only decode specified functions, with comma as separator"),
+	OPT_INTEGER(0, "func_filter_extent", &opt_func_filter_extent,
+		    "keep all branches inside the calls of func_filter functions, 0 by default"),
 	OPT_STRING(0, "opt_dso_name", &opt_dso_name, "opt_dso_name",
 		   "dso name for decoding trace"),
 	OPTS_EVSWITCH(&script.evswitch),
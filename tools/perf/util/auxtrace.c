@@ -62,10 +62,15 @@
 #include <internal/lib.h>
 #include "util/sample.h"
 #include "util/thread.h"
+#include "time-utils.h"
 #include "include/perf/pt_compact_format.h"
 
 int parallel_worker = 1; // worker number to do perf script
+int parallel_threads = 0; // thread number to decode queues in one process
+__thread FILE *parallel_thread_fp = NULL; // output file of decoding thread
 int parallel_by_events = 0;
+int parallel_chunks = 0; // chunk number, one chunk per worker if not more
+static int parallel_nr_chunks = 0;
 const char *parallel_prefix = "script_out_";
 int parallel_file_count = 0;
 static size_t total_event = 0;
@@ -84,16 +89,106 @@ static size_t auxtrace_size_added = 0;
 
 // script filter
 #define MAX_FILTER_SYMBOL 1024
+#define FUNC_FILTER_HASH_SIZE (MAX_FILTER_SYMBOL * 2)
 const char *func_filter_str = "";
+int opt_func_filter_extent = 0;
 const char *opt_dso_name = "";
 
 const char *func_filter[MAX_FILTER_SYMBOL];
 size_t func_filter_num = 0;
-struct symbol fil_syms[MAX_FILTER_SYMBOL];
+/* open addressing set of filter names, for O(1) name match */
+static const char *func_filter_hash[FUNC_FILTER_HASH_SIZE];
+/* sorted and merged address ranges of filter symbols in 'opt_dso_name' */
+struct func_filter_range fil_syms[MAX_FILTER_SYMBOL];
 size_t fil_syms_size = 0;
 
 int *worker_pids = NULL;
 
+/*
+ * Chunks are dispatched to a pool of parallel_worker processes. Each chunk
+ * is decoded by a child process in a free worker slot, and written to the
+ * output file of its chunk index, so the outputs stay in trace order.
+ */
+struct parallel_chunk_time {
+	u64 start;
+	u64 end;
+	int slot;
+};
+static struct parallel_chunk_time *chunk_times = NULL;
+static int *free_slots = NULL;
+static int nr_free_slots = 0;
+static int running_workers = 0;
+static u64 parallel_start_ns = 0;
+
+static void parallel_release_worker(int k)
+{
+	worker_pids[k] = 0;
+	chunk_times[k].end = rdclock();
+	free_slots[nr_free_slots++] = chunk_times[k].slot;
+	running_workers--;
+}
+
+static void parallel_reap_worker(void)
+{
+	int status, k;
+	pid_t pid;
+
+	do {
+		pid = waitpid(-1, &status, 0);
+	} while (pid < 0 && errno == EINTR);
+
+	if (pid < 0) {
+		/* no child is left (ECHILD), the workers can not be waited */
+		pr_err("Parallel: waitpid failed: %s\n", strerror(errno));
+		for (k = 0; k < parallel_file_count; k++) {
+			if (worker_pids[k])
+				parallel_release_worker(k);
+		}
+		running_workers = 0;
+		return;
+	}
+	for (k = 0; k < parallel_file_count; k++) {
+		if (worker_pids[k] == pid) {
+			parallel_release_worker(k);
+			break;
+		}
+	}
+}
+
+static void parallel_print_summary(void)
+{
+	u64 wall = rdclock() - parallel_start_ns;
+	u64 min_chunk = ULLONG_MAX, max_chunk = 0, min_busy = ULLONG_MAX, max_busy = 0;
+	u64 *busy = calloc(parallel_worker, sizeof(u64));
+	int *chunks = calloc(parallel_worker, sizeof(int));
+	int k;
+
+	if (!busy || !chunks)
+		goto out_free;
+	for (k = 0; k < parallel_file_count; k++) {
+		u64 t = chunk_times[k].end - chunk_times[k].start;
+
+		busy[chunk_times[k].slot] += t;
+		chunks[chunk_times[k].slot]++;
+		min_chunk = t < min_chunk ? t : min_chunk;
+		max_chunk = t > max_chunk ? t : max_chunk;
+	}
+	for (k = 0; k < parallel_worker; k++) {
+		fprintf(stderr, "Parallel worker %d: %d chunks, busy %.3f s\n",
+			k, chunks[k], busy[k] / 1e9);
+		min_busy = busy[k] < min_busy ? busy[k] : min_busy;
+		max_busy = busy[k] > max_busy ? busy[k] : max_busy;
+	}
+	fprintf(stderr,
+		"Parallel summary: %d chunks, %d workers, wall %.3f s, chunk %.3f-%.3f s, "
+		"worker busy %.3f-%.3f s\n",
+		parallel_file_count, parallel_worker, wall / 1e9,
+		min_chunk / 1e9, max_chunk / 1e9, min_busy / 1e9, max_busy / 1e9);
+out_free:
+	free(busy);
+	free(chunks);
+}
+
 #define MAX_CPUS 2048
 struct parallel_cache_entry cpu_batch_events[MAX_CPUS];
 
@@ -101,24 +196,63 @@ struct auxtrace_cache *thread_batch_events = NULL;
 size_t cpu_thread_size = 0; // cpu or thread size in current parallel batch
 size_t cpu_thread_last_psb_add = 0; // the number last psb add in parallel batch
 
+static inline u32 func_filter_hash_str(const char *name) {
+	/* FNV-1a */
+	u32 h = 2166136261u;
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void func_filter_hash_add(const char *name) {
+	u32 i = func_filter_hash_str(name) & (FUNC_FILTER_HASH_SIZE - 1);
+	while (func_filter_hash[i]) {
+		if (!strcmp(func_filter_hash[i], name))
+			return;
+		i = (i + 1) & (FUNC_FILTER_HASH_SIZE - 1);
+	}
+	func_filter_hash[i] = name;
+}
+
+static int func_filter_range_cmp(const void *a, const void *b) {
+	const struct func_filter_range *r1 = a, *r2 = b;
+	if (r1->start != r2->start)
+		return r1->start < r2->start ? -1 : 1;
+	return 0;
+}
+
 static struct dso *load_dso(const char *name);
 static void func_filter_generate_fil_sym(void) {
+  size_t i, n;
   if (func_filter_num && strlen(opt_dso_name) > 0) {
     // find all symbols with 'func_filter' name
     struct dso *dso = load_dso(opt_dso_name);
     struct symbol *sym = dso__first_symbol(dso);
     while (sym) {
-      for (size_t i = 0; i < func_filter_num; ++i) {
-        const char *func_name = func_filter[i];
-        if (!arch__compare_symbol_names(func_name, sym->name) && fil_syms_size < MAX_FILTER_SYMBOL){
-          fil_syms[fil_syms_size].start = sym->start;
-          fil_syms[fil_syms_size].end = sym->end;
-          fil_syms_size++;
-        }
+      if (func_filter_match(sym->name) && fil_syms_size < MAX_FILTER_SYMBOL) {
+        fil_syms[fil_syms_size].start = sym->start;
+        fil_syms[fil_syms_size].end = sym->end;
+        fil_syms_size++;
       }
       sym = dso__next_symbol(sym);
     }
   }
+  if (fil_syms_size < 2)
+    return;
+  // sort by start address and merge the overlapped ranges, so that
+  // one address matches at most one range for binary search
+  qsort(fil_syms, fil_syms_size, sizeof(fil_syms[0]), func_filter_range_cmp);
+  for (i = 1, n = 0; i < fil_syms_size; ++i) {
+    if (fil_syms[i].start <= fil_syms[n].end) {
+      if (fil_syms[i].end > fil_syms[n].end)
+        fil_syms[n].end = fil_syms[i].end;
+    } else {
+      fil_syms[++n] = fil_syms[i];
+    }
+  }
+  fil_syms_size = n + 1;
 }
 
 static void func_filter_init(void) {
@@ -128,34 +262,77 @@ static void func_filter_init(void) {
 	p = (char *) func_filter_str;
 	func_filter[func_filter_num++] = p;
 	while (*p != '\0') {
-		if (*p == ',' && *(p+1) != '\0') {
+		if (*p == ',' && *(p+1) != '\0' && func_filter_num < MAX_FILTER_SYMBOL) {
 			*p = '\0';
 			func_filter[func_filter_num++] = p + 1;
 		}
 		p++;
 	}
+	for (size_t i = 0; i < func_filter_num; ++i)
+		func_filter_hash_add(func_filter[i]);
 
 	func_filter_generate_fil_sym();
 }
 
 bool func_filter_match(const char *name) {
-	for (size_t i = 0; i < func_filter_num; ++i) {
-		const char *func_name = func_filter[i];
-		if (!strcmp(name, func_name))
+	u32 i;
+	if (!func_filter_num)
+		return false;
+	i = func_filter_hash_str(name) & (FUNC_FILTER_HASH_SIZE - 1);
+	while (func_filter_hash[i]) {
+		if (!strcmp(name, func_filter_hash[i]))
 			return true;
+		i = (i + 1) & (FUNC_FILTER_HASH_SIZE - 1);
 	}
 	return false;
 }
 
+bool func_filter_match_ip(u64 addr) {
+	const struct func_filter_range *base = fil_syms;
+	size_t n = fil_syms_size;
+
+	if (!n)
+		return false;
+	// branchless lower bound, the ternary is compiled to cmov
+	while (n > 1) {
+		size_t half = n / 2;
+		base = (base[half].start <= addr) ? base + half : base;
+		n -= half;
+	}
+	return base->start <= addr && base->end >= addr;
+}
+
+/* decode each queue independently, not in global timestamp order */
+int opt_unordered_queues = 0;
+
+/* directory of instruction caches persisted by dso build-id */
+const char *opt_insn_cache_dir = NULL;
+
 /* For compact output */
 int opt_compact_format = 0;
-struct auxtrace_cache *output_symbols = NULL;
-size_t global_sym_id = 0;
-static void output_symbol_cache_init(void) {
-	if (opt_compact_format) {
-		output_symbols = auxtrace_cache__new(12,
-			sizeof(struct output_symbol_entry), 10000);
-	}
+/* per decoding thread, each output file has its own symbol ids */
+__thread struct auxtrace_cache *output_symbols = NULL;
+static __thread size_t global_sym_id = 0;
+struct auxtrace_cache *output_symbol_cache_new(void) {
+	return auxtrace_cache__new(12, sizeof(struct output_symbol_entry), 10000);
+}
+
+void output_symbol_cache_init(void) {
+	global_sym_id = 0;
+	if (opt_compact_format)
+		output_symbols = output_symbol_cache_new();
+}
+
+/* switch the calling thread to the symbols of an output file */
+void output_symbol_state_load(struct output_symbol_state *state) {
+	output_symbols = state->cache;
+	global_sym_id = state->next_id;
+}
+
+void output_symbol_state_save(struct output_symbol_state *state) {
+	state->cache = output_symbols;
+	state->next_id = global_sym_id;
+	output_symbols = NULL;
 }
 
 struct output_symbol_entry* output_symbols_lookup_and_add(
@@ -541,7 +718,14 @@ int auxtrace_queues__add_event(struct auxtrace_queues *queues,
 		}
 		if (parallel_child_pid != 0 && !in_batch &&
 		    total_event_added < total_event) {
+			// wait for a free worker before starting the new batch
+			while (running_workers >= parallel_worker)
+				parallel_reap_worker();
+			chunk_times[parallel_file_count].slot = free_slots[--nr_free_slots];
+			chunk_times[parallel_file_count].start = rdclock();
 			// start new child process to deal the new batch
+			fflush(stdout);
+			fflush(stderr);
 			parallel_child_pid = fork();
 			if (parallel_child_pid == 0) {
 				parallel_file_offset_start = data_offset;
@@ -557,6 +741,7 @@ int auxtrace_queues__add_event(struct auxtrace_queues *queues,
 				}
 			} else {
 				worker_pids[parallel_file_count] = parallel_child_pid;
+				running_workers++;
 			}
 			parallel_file_count++;
 			in_batch = true; // now in new batch
@@ -1197,6 +1382,103 @@ int auxtrace_index__process(int fd, u64 size, struct perf_session *session,
 	return 0;
 }
 
+/*
+ * Reference window: the decoder sets the reference (TSC for Intel PT) range
+ * of a time filter, so buffers outside it are not queued. The trace of a
+ * buffer is before its reference, and after the reference of the previous
+ * buffer in the same queue. One buffer before the window is kept, so that
+ * the decoder can start at the last PSB before the window.
+ */
+u64 auxtrace_ref_start = 0;
+u64 auxtrace_ref_end = 0; /* 0 for no end */
+
+struct auxtrace_ref_queue {
+	size_t nr;
+	size_t first;
+	size_t last;
+	u64 prev_ref;
+	bool no_ref;
+};
+
+static unsigned long *auxtrace_index_skip = NULL;
+
+static int auxtrace_index__ref_window(struct perf_session *session)
+{
+	struct auxtrace_ref_queue *rq = NULL, *q;
+	struct auxtrace_index *auxtrace_index;
+	struct auxtrace_index_entry *ent;
+	unsigned int *ent_idx = NULL, nr_rq = 0;
+	size_t *ent_nr = NULL, total = 0, n = 0, skipped = 0, i;
+	char buf[PERF_SAMPLE_MAX_SIZE];
+	union perf_event *event;
+	int err = -ENOMEM;
+
+	if (!auxtrace_ref_start && !auxtrace_ref_end)
+		return 0;
+
+	list_for_each_entry(auxtrace_index, &session->auxtrace_index, list)
+		total += auxtrace_index->nr;
+	ent_idx = calloc(total, sizeof(*ent_idx));
+	ent_nr = calloc(total, sizeof(*ent_nr));
+	auxtrace_index_skip = bitmap_zalloc(total);
+	if (!ent_idx || !ent_nr || !auxtrace_index_skip)
+		goto out_free;
+
+	list_for_each_entry(auxtrace_index, &session->auxtrace_index, list) {
+		for (i = 0; i < auxtrace_index->nr; i++, n++) {
+			ent = &auxtrace_index->entries[i];
+			ent_idx[n] = UINT_MAX;
+			if (perf_session__peek_event(session, ent->file_offset, buf,
+						     PERF_SAMPLE_MAX_SIZE, &event, NULL) ||
+			    event->header.type != PERF_RECORD_AUXTRACE)
+				continue;
+			if (event->auxtrace.idx >= nr_rq) {
+				unsigned int new_nr = event->auxtrace.idx + 32;
+
+				q = realloc(rq, new_nr * sizeof(*rq));
+				if (!q)
+					goto out_free;
+				memset(q + nr_rq, 0, (new_nr - nr_rq) * sizeof(*rq));
+				for (; nr_rq < new_nr; nr_rq++)
+					q[nr_rq].last = SIZE_MAX;
+				rq = q;
+			}
+			q = &rq[event->auxtrace.idx];
+			ent_idx[n] = event->auxtrace.idx;
+			ent_nr[n] = q->nr;
+			if (!event->auxtrace.reference)
+				q->no_ref = true;
+			if (event->auxtrace.reference < auxtrace_ref_start)
+				q->first = q->nr;
+			if (auxtrace_ref_end && q->nr && q->prev_ref > auxtrace_ref_end &&
+			    q->last == SIZE_MAX)
+				q->last = q->nr - 1;
+			q->prev_ref = event->auxtrace.reference;
+			q->nr++;
+		}
+	}
+
+	for (n = 0; n < total; n++) {
+		if (ent_idx[n] == UINT_MAX)
+			continue;
+		q = &rq[ent_idx[n]];
+		if (!q->no_ref && (ent_nr[n] < q->first || ent_nr[n] > q->last)) {
+			set_bit(n, auxtrace_index_skip);
+			skipped++;
+		}
+	}
+	fprintf(stderr, "Auxtrace: skip %zu of %zu buffers outside the time range\n",
+		skipped, total);
+	err = 0;
+out_free:
+	if (err)
+		zfree(&auxtrace_index_skip);
+	free(rq);
+	free(ent_idx);
+	free(ent_nr);
+	return err;
+}
+
 static int auxtrace_queues__process_index_entry(struct auxtrace_queues *queues,
 						struct perf_session *session,
 						struct auxtrace_index_entry *ent)
@@ -1210,31 +1492,45 @@ int auxtrace_queues__process_index(struct auxtrace_queues *queues,
 {
 	struct auxtrace_index *auxtrace_index;
 	struct auxtrace_index_entry *ent;
-	size_t i;
+	size_t i, n;
 	int err;
 
 	if (auxtrace__dont_decode(session))
 		return 0;
 
+	err = auxtrace_index__ref_window(session);
+	if (err)
+		return err;
+
 	if (parallel_worker > 1) {
 		// get total index events and auxtrace size to dispatch
+		n = 0;
 		list_for_each_entry(auxtrace_index, &session->auxtrace_index,
 				    list) {
-			for (i = 0; i < auxtrace_index->nr; i++) {
+			for (i = 0; i < auxtrace_index->nr; i++, n++) {
+				if (auxtrace_index_skip && test_bit(n, auxtrace_index_skip))
+					continue;
 				ent = &auxtrace_index->entries[i];
 				total_event++;
 				total_auxtrace_size += auxtrace_queues__get_auxtrace_size(session, ent->file_offset, ent->sz);
 			}
 		}
-		parallel_step = total_event / parallel_worker + 1;
-		parallel_auxtrace_size = total_auxtrace_size / parallel_worker + 1;
+		parallel_nr_chunks = parallel_chunks > parallel_worker ?
+				     parallel_chunks : parallel_worker;
+		parallel_step = total_event / parallel_nr_chunks + 1;
+		parallel_auxtrace_size = total_auxtrace_size / parallel_nr_chunks + 1;
 		fprintf(stderr,
-			"Parallel: workers: %d, total_events: %lu, events_step: %lu, auxtrace_size_step: %lu\n",
-			parallel_worker, total_event, parallel_step, parallel_auxtrace_size);
+			"Parallel: workers: %d, chunks: %d, total_events: %lu, events_step: %lu, auxtrace_size_step: %lu\n",
+			parallel_worker, parallel_nr_chunks, total_event, parallel_step,
+			parallel_auxtrace_size);
 		fflush(stderr);
 		fflush(stdout);
-		worker_pids = (int *)malloc(sizeof(int) * parallel_worker);
-		memset(worker_pids, 0, sizeof(int) * parallel_worker);
+		worker_pids = (int *)calloc(parallel_nr_chunks, sizeof(int));
+		chunk_times = calloc(parallel_nr_chunks, sizeof(*chunk_times));
+		free_slots = calloc(parallel_worker, sizeof(int));
+		for (nr_free_slots = 0; nr_free_slots < parallel_worker; nr_free_slots++)
+			free_slots[nr_free_slots] = parallel_worker - 1 - nr_free_slots;
+		parallel_start_ns = rdclock();
 		memset(cpu_batch_events, 0, sizeof(struct parallel_cache_entry) * MAX_CPUS);
 		thread_batch_events = auxtrace_cache__new(12, sizeof(struct parallel_cache_entry), 10000);
 	}
@@ -1245,8 +1541,11 @@ int auxtrace_queues__process_index(struct auxtrace_queues *queues,
 	/* init output symbol cache */
 	output_symbol_cache_init();
 
+	n = 0;
 	list_for_each_entry(auxtrace_index, &session->auxtrace_index, list) {
-		for (i = 0; i < auxtrace_index->nr; i++) {
+		for (i = 0; i < auxtrace_index->nr; i++, n++) {
+			if (auxtrace_index_skip && test_bit(n, auxtrace_index_skip))
+				continue;
 			ent = &auxtrace_index->entries[i];
 			err = auxtrace_queues__process_index_entry(queues,
 								   session,
@@ -1255,6 +1554,7 @@ int auxtrace_queues__process_index(struct auxtrace_queues *queues,
 				return err;
 		}
 	}
+	zfree(&auxtrace_index_skip);
 
 	if (parallel_worker > 1) {
 		if (parallel_child_pid == 0) {
@@ -1266,12 +1566,12 @@ int auxtrace_queues__process_index(struct auxtrace_queues *queues,
 			fflush(stdout);
 		} else {
 			// wait for all workers done
-			for (int k=0; k<parallel_worker; k++) {
-				if (worker_pids[k] != 0) {
-					waitpid(worker_pids[k], NULL, 0);
-				}
-			}
+			while (running_workers > 0)
+				parallel_reap_worker();
+			parallel_print_summary();
 			free(worker_pids);
+			free(chunk_times);
+			free(free_slots);
 			auxtrace_cache__free(thread_batch_events);
 			if (output_symbols) {
 				auxtrace_cache__free(output_symbols);
@@ -2009,7 +2309,8 @@ int perf_event__process_auxtrace_error(struct perf_session *session,
 	if (auxtrace__dont_decode(session))
 		return 0;
 
-	perf_event__fprintf_auxtrace_error(event, stdout);
+	perf_event__fprintf_auxtrace_error(event,
+			parallel_thread_fp ? parallel_thread_fp : stdout);
 	return 0;
 }
 
@@ -2364,6 +2665,28 @@ void *auxtrace_cache__lookup(struct auxtrace_cache *c, u32 key)
 	return NULL;
 }
 
+int auxtrace_cache__for_each(struct auxtrace_cache *c,
+			     int (*fn)(struct auxtrace_cache_entry *entry, void *data),
+			     void *data)
+{
+	struct auxtrace_cache_entry *entry;
+	size_t i;
+	int err;
+
+	if (!c)
+		return 0;
+
+	for (i = 0; i < c->sz; i++) {
+		hlist_for_each_entry(entry, &c->hashtable[i], hash) {
+			err = fn(entry, data);
+			if (err)
+				return err;
+		}
+	}
+
+	return 0;
+}
+
 static void addr_filter__free_str(struct addr_filter *filt)
 {
 	zfree(&filt->str);
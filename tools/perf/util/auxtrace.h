@@ -20,7 +20,10 @@
 #include <asm/barrier.h>
 
 extern int parallel_worker;
+extern int parallel_threads;
+extern __thread FILE *parallel_thread_fp;
 extern int parallel_by_events;
+extern int parallel_chunks;
 extern const char *parallel_prefix;
 extern int parallel_file_count;
 extern size_t parallel_event_added;
@@ -30,9 +33,21 @@ extern u64 parallel_file_offset_start;
 extern size_t cpu_thread_size;
 extern size_t cpu_thread_last_psb_add;
 extern const char *func_filter_str;
+extern int opt_func_filter_extent;
 extern const char *opt_dso_name;
 extern int opt_compact_format;
+extern int opt_unordered_queues;
+extern const char *opt_insn_cache_dir;
+extern u64 auxtrace_ref_start;
+extern u64 auxtrace_ref_end;
+extern size_t fil_syms_size;
 bool func_filter_match(const char *name);
+bool func_filter_match_ip(u64 addr);
+
+struct func_filter_range {
+	u64 start;
+	u64 end;
+};
 
 union perf_event;
 struct perf_session;
@@ -590,7 +605,16 @@ struct output_symbol_entry {
 };
 extern struct parallel_cache_entry cpu_batch_events[];
 extern struct auxtrace_cache *thread_batch_events;
-extern struct auxtrace_cache *output_symbols;
+extern __thread struct auxtrace_cache *output_symbols;
+/* symbol ids of one output file, kept across threaded decoding segments */
+struct output_symbol_state {
+	struct auxtrace_cache *cache;
+	size_t next_id;
+};
+void output_symbol_cache_init(void);
+struct auxtrace_cache *output_symbol_cache_new(void);
+void output_symbol_state_load(struct output_symbol_state *state);
+void output_symbol_state_save(struct output_symbol_state *state);
 struct output_symbol_entry* output_symbols_lookup_and_add(
     uint64_t addr, uint32_t offs, const char *name, FILE *fp);
 
@@ -603,6 +627,9 @@ int auxtrace_cache__add(struct auxtrace_cache *c, u32 key,
 			struct auxtrace_cache_entry *entry);
 void auxtrace_cache__remove(struct auxtrace_cache *c, u32 key);
 void *auxtrace_cache__lookup(struct auxtrace_cache *c, u32 key);
+int auxtrace_cache__for_each(struct auxtrace_cache *c,
+			     int (*fn)(struct auxtrace_cache_entry *entry, void *data),
+			     void *data);
 
 struct auxtrace_record *auxtrace_record__init(struct evlist *evlist,
 					      int *err);
@@ -9,10 +9,14 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
 #include <linux/kernel.h>
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/zalloc.h>
+#include <linux/hash.h>
 
 #include "session.h"
 #include "machine.h"
@@ -53,11 +57,31 @@
 #define INTEL_PT_CFG_EVT_EN	BIT_ULL(31)
 #define INTEL_PT_CFG_TNT_DIS	BIT_ULL(55)
 
-extern struct symbol fil_syms[];
 extern size_t func_filter_num;
-extern size_t fil_syms_size;
-static size_t current_decode_cpu = (size_t)-2;
-static size_t current_decode_tid = (size_t)-2;
+static __thread size_t current_decode_cpu = (size_t)-2;
+static __thread size_t current_decode_tid = (size_t)-2;
+
+/*
+ * For threaded decoding (--parallel_threads), the symbol and map state is
+ * shared by all decoding threads, and only changed by sideband events while
+ * no thread runs. The instruction cache is protected by a rwlock, and event
+ * delivery and symbol lookup are serialized.
+ */
+static bool intel_pt_mt;
+static pthread_rwlock_t intel_pt_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t intel_pt_deliver_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void intel_pt_deliver_lock_acquire(void)
+{
+	if (intel_pt_mt)
+		pthread_mutex_lock(&intel_pt_deliver_lock);
+}
+
+static inline void intel_pt_deliver_lock_release(void)
+{
+	if (intel_pt_mt)
+		pthread_mutex_unlock(&intel_pt_deliver_lock);
+}
 
 #define MAX_CPUS 2048
 
@@ -97,6 +121,24 @@ struct intel_pt {
 	u64 switch_ip;
 	u64 ptss_ip;
 	u64 first_timestamp;
+	u32 filter_cache_gen;
+	bool unordered;
+	bool threaded;
+	unsigned int next_queue;
+	u64 decoder_runs;
+	/* output files of decoding threads, kept open across segments */
+	FILE **thread_fps;
+	/* symbol ids of each output file, so they never restart in a file */
+	struct output_symbol_state *thread_symbols;
+	unsigned int threaded_segments;
+	/* filter verdicts shared by the queues of decoding threads */
+	struct intel_pt_filter_entry *shared_filter_cache;
+
+	/* instruction walk statistics of freed queues */
+	u64 insn_cache_hits;
+	u64 insn_cache_misses;
+	u64 insn_cnt;
+	u64 start_ns;
 
 	struct perf_tsc_conversion tc;
 	bool cap_user_time_zero;
@@ -197,6 +239,10 @@ struct intel_pt_queue {
 	union perf_event *event_buf;
 	bool on_heap;
 	bool stop;
+	u64 unordered_ts; /* next timestamp of queue, used in unordered mode */
+	u64 insn_cache_hits;
+	u64 insn_cache_misses;
+	u64 insn_cnt;
 	bool step_through_buffers;
 	bool use_buffer_pid_tid;
 	bool sync_switch;
@@ -234,6 +280,11 @@ struct intel_pt_queue {
 	unsigned int cbr_seen;
 	char insn[INTEL_PT_INSN_BUF_SZ];
 	struct intel_pt_pebs_event pebs[INTEL_PT_MAX_PEBS];
+	struct intel_pt_filter_entry *filter_cache;
+	/* nesting of target calls of an unknown thread, for func_filter_extent */
+	unsigned int filter_extent;
+	/* decoding thread owning the queue in threaded mode, -1 if none */
+	int decode_thread;
 };
 
 static void intel_pt_dump(struct intel_pt *pt __maybe_unused,
@@ -670,6 +721,224 @@ static unsigned int intel_pt_cache_size(struct dso *dso,
 	return 32 - __builtin_clz(size);
 }
 
+/*
+ * Instruction cache file: the cache of a dso is saved as a header and an
+ * array of records, named by build-id in --insn_cache_dir, and loaded when
+ * the cache of a dso with the same build-id is created. The file is only
+ * read at that time, so the workers of one run do not warm each other, but
+ * later runs on the same binary start warm.
+ */
+#define INTEL_PT_INSN_CACHE_MAGIC 0x43495450 /* "PTIC" */
+
+struct intel_pt_insn_cache_hdr {
+	u32 magic;
+	u32 rec_size;
+	u64 nr;
+};
+
+struct intel_pt_insn_cache_rec {
+	u32 offset;
+	u8 op;
+	u8 branch;
+	u8 emulated_ptwrite;
+	u8 length;
+	s32 rel;
+	u32 reserved;
+	u64 insn_cnt;
+	u64 byte_cnt;
+	char insn[INTEL_PT_INSN_BUF_SZ];
+};
+
+static u64 intel_pt_insn_cache_loaded;
+static u64 intel_pt_insn_cache_load_ns;
+
+static int intel_pt_insn_cache_path(struct dso *dso, char *path, size_t sz)
+{
+	char sbuild_id[SBUILD_ID_SIZE];
+
+	if (!opt_insn_cache_dir || !dso->has_build_id)
+		return -1;
+	build_id__sprintf(&dso->bid, sbuild_id);
+	snprintf(path, sz, "%s/%s.insn", opt_insn_cache_dir, sbuild_id);
+	return 0;
+}
+
+static void intel_pt_insn_cache_load(struct auxtrace_cache *c, struct dso *dso)
+{
+	struct intel_pt_insn_cache_hdr hdr;
+	struct intel_pt_insn_cache_rec rec;
+	struct intel_pt_cache_entry *e;
+	char path[PATH_MAX];
+	u64 t0 = rdclock(), i;
+	FILE *fp;
+
+	if (intel_pt_insn_cache_path(dso, path, sizeof(path)))
+		return;
+	fp = fopen(path, "rb");
+	if (!fp)
+		return;
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != INTEL_PT_INSN_CACHE_MAGIC ||
+	    hdr.rec_size != sizeof(rec)) {
+		pr_warning("Intel PT: ignore invalid instruction cache %s\n", path);
+		goto out_close;
+	}
+	for (i = 0; i < hdr.nr && fread(&rec, sizeof(rec), 1, fp) == 1; i++) {
+		e = auxtrace_cache__alloc_entry(c);
+		if (!e)
+			break;
+		e->insn_cnt = rec.insn_cnt;
+		e->byte_cnt = rec.byte_cnt;
+		e->op = rec.op;
+		e->branch = rec.branch;
+		e->emulated_ptwrite = rec.emulated_ptwrite;
+		e->length = rec.length;
+		e->rel = rec.rel;
+		memcpy(e->insn, rec.insn, INTEL_PT_INSN_BUF_SZ);
+		if (auxtrace_cache__add(c, rec.offset, &e->entry))
+			auxtrace_cache__free_entry(c, e);
+	}
+	intel_pt_insn_cache_loaded += i;
+out_close:
+	fclose(fp);
+	intel_pt_insn_cache_load_ns += rdclock() - t0;
+}
+
+static int intel_pt_insn_cache_write_rec(struct auxtrace_cache_entry *entry,
+					 void *data)
+{
+	struct intel_pt_cache_entry *e =
+		container_of(entry, struct intel_pt_cache_entry, entry);
+	struct intel_pt_insn_cache_rec rec = {
+		.offset = entry->key,
+		.op = e->op,
+		.branch = e->branch,
+		.emulated_ptwrite = e->emulated_ptwrite,
+		.length = e->length,
+		.rel = e->rel,
+		.insn_cnt = e->insn_cnt,
+		.byte_cnt = e->byte_cnt,
+	};
+
+	memcpy(rec.insn, e->insn, INTEL_PT_INSN_BUF_SZ);
+	return fwrite(&rec, sizeof(rec), 1, data) == 1 ? 0 : -EIO;
+}
+
+static int intel_pt_insn_cache_count_rec(struct auxtrace_cache_entry *entry __maybe_unused,
+					 void *data)
+{
+	(*(u64 *)data)++;
+	return 0;
+}
+
+/* append the records of the saved file that are not in cache 'c' */
+static int intel_pt_insn_cache_merge_saved(struct auxtrace_cache *c,
+					   const char *path, FILE *out, u64 *nr)
+{
+	struct intel_pt_insn_cache_hdr hdr;
+	struct intel_pt_insn_cache_rec rec;
+	FILE *fp = fopen(path, "rb");
+	int err = 0;
+	u64 i;
+
+	if (!fp)
+		return 0;
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != INTEL_PT_INSN_CACHE_MAGIC ||
+	    hdr.rec_size != sizeof(rec))
+		goto out_close;
+	for (i = 0; i < hdr.nr && fread(&rec, sizeof(rec), 1, fp) == 1; i++) {
+		if (auxtrace_cache__lookup(c, rec.offset))
+			continue;
+		if (fwrite(&rec, sizeof(rec), 1, out) != 1) {
+			err = -EIO;
+			break;
+		}
+		(*nr)++;
+	}
+out_close:
+	fclose(fp);
+	return err;
+}
+
+/*
+ * Parallel workers may save the same dso concurrently. The saves are
+ * serialized by a lock file, and the records already saved by other
+ * workers are kept, so the file has the union of their caches instead of
+ * the cache of the last writer. Each one writes a temporary file and
+ * renames it, so the file is always complete for readers.
+ */
+static void intel_pt_insn_cache_save(struct dso *dso)
+{
+	struct intel_pt_insn_cache_hdr hdr = {
+		.magic = INTEL_PT_INSN_CACHE_MAGIC,
+		.rec_size = sizeof(struct intel_pt_insn_cache_rec),
+	};
+	char path[PATH_MAX], tmp[PATH_MAX + 32], lock[PATH_MAX + 32];
+	int err, lock_fd;
+	FILE *fp;
+
+	if (!dso->auxtrace_cache || intel_pt_insn_cache_path(dso, path, sizeof(path)))
+		return;
+	auxtrace_cache__for_each(dso->auxtrace_cache,
+				 intel_pt_insn_cache_count_rec, &hdr.nr);
+	if (!hdr.nr)
+		return;
+
+	snprintf(lock, sizeof(lock), "%s.lock", path);
+	/* without the lock, the merge is best effort */
+	lock_fd = open(lock, O_CREAT | O_RDWR, 0644);
+	if (lock_fd >= 0 && flock(lock_fd, LOCK_EX)) {
+		close(lock_fd);
+		lock_fd = -1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fp = fopen(tmp, "wb");
+	if (!fp) {
+		pr_warning("Intel PT: failed to save instruction cache %s\n", path);
+		goto out_unlock;
+	}
+	err = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 ? 0 : -EIO;
+	if (!err)
+		err = auxtrace_cache__for_each(dso->auxtrace_cache,
+					       intel_pt_insn_cache_write_rec, fp);
+	if (!err)
+		err = intel_pt_insn_cache_merge_saved(dso->auxtrace_cache,
+						      path, fp, &hdr.nr);
+	/* rewrite the number of records with the merged ones */
+	if (!err && (fseek(fp, 0, SEEK_SET) ||
+		     fwrite(&hdr, sizeof(hdr), 1, fp) != 1))
+		err = -EIO;
+	if (fclose(fp) || err || rename(tmp, path)) {
+		pr_warning("Intel PT: failed to save instruction cache %s\n", path);
+		unlink(tmp);
+	}
+out_unlock:
+	if (lock_fd >= 0)
+		close(lock_fd);
+}
+
+static void intel_pt_insn_cache_report(struct intel_pt *pt)
+{
+	struct dso *dso;
+	double secs = (rdclock() - pt->start_ns) / 1e9;
+
+	if (opt_insn_cache_dir) {
+		dsos__for_each_with_build_id(dso, &pt->machine->dsos.head)
+			intel_pt_insn_cache_save(dso);
+	}
+	if (!pt->insn_cnt)
+		return;
+
+	fprintf(stderr,
+		"Intel PT instruction cache: warm-up %.3f ms, %" PRIu64 " entries loaded, "
+		"%" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " insns in %.3f s (%.0f insn/s)\n",
+		intel_pt_insn_cache_load_ns / 1e6, intel_pt_insn_cache_loaded,
+		pt->insn_cache_hits, pt->insn_cache_misses, pt->insn_cnt,
+		secs, secs > 0 ? pt->insn_cnt / secs : 0);
+}
+
 static struct auxtrace_cache *intel_pt_cache(struct dso *dso,
 					     struct machine *machine)
 {
@@ -681,8 +950,15 @@ static struct auxtrace_cache *intel_pt_cache(struct dso *dso,
 
 	bits = intel_pt_cache_size(dso, machine);
 
-	/* Ignoring cache creation failure */
-	c = auxtrace_cache__new(bits, sizeof(struct intel_pt_cache_entry), 200);
+	/*
+	 * Ignoring cache creation failure. No limit for threaded decoding,
+	 * because dropping entries may free the ones in use by other threads.
+	 */
+	c = auxtrace_cache__new(bits, sizeof(struct intel_pt_cache_entry),
+				parallel_threads > 1 ? 0 : 200);
+
+	if (c && opt_insn_cache_dir)
+		intel_pt_insn_cache_load(c, dso);
 
 	dso->auxtrace_cache = c;
 
@@ -693,16 +969,24 @@ static int intel_pt_cache_add(struct dso *dso, struct machine *machine,
 			      u64 offset, u64 insn_cnt, u64 byte_cnt,
 			      struct intel_pt_insn *intel_pt_insn)
 {
-	struct auxtrace_cache *c = intel_pt_cache(dso, machine);
+	struct auxtrace_cache *c;
 	struct intel_pt_cache_entry *e;
 	int err;
 
-	if (!c)
-		return -ENOMEM;
+	if (intel_pt_mt)
+		pthread_rwlock_wrlock(&intel_pt_cache_lock);
+
+	c = intel_pt_cache(dso, machine);
+	if (!c) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
 
 	e = auxtrace_cache__alloc_entry(c);
-	if (!e)
-		return -ENOMEM;
+	if (!e) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
 
 	e->insn_cnt = insn_cnt;
 	e->byte_cnt = byte_cnt;
@@ -717,15 +1001,27 @@ static int intel_pt_cache_add(struct dso *dso, struct machine *machine,
 	if (err)
 		auxtrace_cache__free_entry(c, e);
 
+out_unlock:
+	if (intel_pt_mt)
+		pthread_rwlock_unlock(&intel_pt_cache_lock);
 	return err;
 }
 
 static struct intel_pt_cache_entry *
 intel_pt_cache_lookup(struct dso *dso, struct machine *machine, u64 offset)
 {
-	struct auxtrace_cache *c = intel_pt_cache(dso, machine);
+	struct intel_pt_cache_entry *e;
 
-	if (!c)
+	if (intel_pt_mt) {
+		/* entries are never dropped in threaded decoding */
+		pthread_rwlock_rdlock(&intel_pt_cache_lock);
+		e = dso->auxtrace_cache ?
+			auxtrace_cache__lookup(dso->auxtrace_cache, offset) : NULL;
+		pthread_rwlock_unlock(&intel_pt_cache_lock);
+		return e;
+	}
+
+	if (!intel_pt_cache(dso, machine))
 		return NULL;
 
 	return auxtrace_cache__lookup(dso->auxtrace_cache, offset);
@@ -910,6 +1206,8 @@ static int intel_pt_walk_next_insn(struct intel_pt_insn *intel_pt_insn,
 				memcpy(intel_pt_insn->buf, e->insn,
 				       INTEL_PT_INSN_BUF_SZ);
 				intel_pt_log_insn_no_data(intel_pt_insn, *ip);
+				ptq->insn_cache_hits++;
+				ptq->insn_cnt += e->insn_cnt;
 				return 0;
 			}
 		}
@@ -973,6 +1271,8 @@ static int intel_pt_walk_next_insn(struct intel_pt_insn *intel_pt_insn,
 	}
 out:
 	*insn_cnt_ptr = insn_cnt;
+	ptq->insn_cache_misses++;
+	ptq->insn_cnt += insn_cnt;
 
 	if (!one_map)
 		goto out_no_cache;
@@ -1352,6 +1652,7 @@ static struct intel_pt_queue *intel_pt_alloc_queue(struct intel_pt *pt,
 	ptq = zalloc(sizeof(struct intel_pt_queue));
 	if (!ptq)
 		return NULL;
+	ptq->decode_thread = -1;
 
 	if (pt->synth_opts.callchain) {
 		ptq->chain = intel_pt_alloc_chain(pt);
@@ -1455,6 +1756,9 @@ static void intel_pt_free_queue(void *priv)
 
 	if (!ptq)
 		return;
+	ptq->pt->insn_cache_hits += ptq->insn_cache_hits;
+	ptq->pt->insn_cache_misses += ptq->insn_cache_misses;
+	ptq->pt->insn_cnt += ptq->insn_cnt;
 	thread__zput(ptq->thread);
 	thread__zput(ptq->guest_thread);
 	thread__zput(ptq->unknown_guest_thread);
@@ -1462,6 +1766,7 @@ static void intel_pt_free_queue(void *priv)
 	zfree(&ptq->event_buf);
 	zfree(&ptq->last_branch);
 	zfree(&ptq->chain);
+	zfree(&ptq->filter_cache);
 	free(ptq);
 }
 
@@ -1700,9 +2005,13 @@ static int intel_pt_setup_queue(struct intel_pt *pt,
 		    ptq->timestamp < ptq->sel_timestamp)
 			ptq->have_sample = false;
 		intel_pt_sample_flags(ptq);
-		ret = auxtrace_heap__add(&pt->heap, queue_nr, ptq->timestamp);
-		if (ret)
-			return ret;
+		if (pt->unordered || pt->threaded) {
+			ptq->unordered_ts = ptq->timestamp;
+		} else {
+			ret = auxtrace_heap__add(&pt->heap, queue_nr, ptq->timestamp);
+			if (ret)
+				return ret;
+		}
 		ptq->on_heap = true;
 	}
 
@@ -1810,7 +2119,9 @@ static int intel_pt_deliver_synth_event(struct intel_pt *pt,
 	if (ret)
 		return ret;
 
+	intel_pt_deliver_lock_acquire();
 	ret = perf_session__deliver_synth_event(pt->session, event, sample);
+	intel_pt_deliver_lock_release();
 	if (ret)
 		pr_err("Intel PT: failed to deliver event, error %d\n", ret);
 
@@ -1857,13 +2168,6 @@ static int intel_pt_parse_ip(struct intel_pt_queue *ptq, uint64_t ip, struct add
 	return 0;
 }
 
-static int intel_pt_parse_sym(struct intel_pt_queue *ptq, uint64_t ip, struct addr_location *al) {
-	if (intel_pt_parse_ip(ptq, ip, al))
-		return -EINVAL;
-	al->sym = map__find_symbol(al->map, al->addr);
-	return 0;
-}
-
 static bool intel_pt_is_schedule_func(struct addr_location *al) {
 	if (!al->sym) {
 		return false;
@@ -1875,72 +2179,172 @@ static bool intel_pt_is_schedule_func(struct addr_location *al) {
 	return true;
 }
 
-static bool intel_pt_is_target_func_name(struct addr_location *al) {
-	if (!al->sym) {
-		return false;
-	}
-	if (!func_filter_match(al->sym->name)) {
-		return false;
-	}
-	return true;
+/*
+ * Filter verdict of one ip, cached per queue in a direct-mapped table,
+ * so that the map and symbol lookup is done once for each hot ip.
+ */
+#define INTEL_PT_FILTER_CACHE_BITS	12
+#define INTEL_PT_FILTER_CACHE_SIZE	(1 << INTEL_PT_FILTER_CACHE_BITS)
+
+#define INTEL_PT_FILTER_VALID		(1 << 0)
+#define INTEL_PT_FILTER_TARGET_IP	(1 << 1) /* in range of fil_syms */
+#define INTEL_PT_FILTER_TARGET_SYM	(1 << 2) /* symbol name matched */
+#define INTEL_PT_FILTER_SCHED		(1 << 3) /* kernel schedule function */
+#define INTEL_PT_FILTER_KERNEL		(1 << 4) /* ip is in kernel map */
+
+struct intel_pt_filter_entry {
+	u64 ip;
+	pid_t pid;
+	u16 gen;
+	u8 flags;
+};
+
+static u8 intel_pt_filter_ip_flags(struct intel_pt_queue *ptq, u64 ip) {
+	struct addr_location al;
+	u8 flags = INTEL_PT_FILTER_VALID;
+
+	memset(&al, 0, sizeof(al));
+	/* symbol lookup of dso caches the last result, serialize it */
+	intel_pt_deliver_lock_acquire();
+	if (intel_pt_parse_ip(ptq, ip, &al)) {
+		intel_pt_deliver_lock_release();
+		return flags;
+	}
+	if (fil_syms_size > 0 && func_filter_match_ip(al.addr))
+		flags |= INTEL_PT_FILTER_TARGET_IP;
+	if (al.map && __map__is_kernel(al.map))
+		flags |= INTEL_PT_FILTER_KERNEL;
+	al.sym = map__find_symbol(al.map, al.addr);
+	if (al.sym) {
+		if (func_filter_match(al.sym->name))
+			flags |= INTEL_PT_FILTER_TARGET_SYM;
+		if (intel_pt_is_schedule_func(&al))
+			flags |= INTEL_PT_FILTER_SCHED;
+	}
+	intel_pt_deliver_lock_release();
+	return flags;
 }
 
-static bool intel_pt_is_target_func_ip(struct addr_location *al) {
-	bool has_target = false;
-	for (size_t i = 0; i < fil_syms_size; ++i) {
-		if (fil_syms[i].start <= al->addr && fil_syms[i].end >= al->addr) {
-				has_target = true;
-				break;
-		}
-	}
-	return has_target;
+/*
+ * In threaded decoding the queues of one process miss on the same ips,
+ * share their verdicts so that the serialized lookup is done only once.
+ * The sideband state is not changed while the threads run.
+ */
+#define INTEL_PT_SHARED_FILTER_CACHE_BITS	16
+#define INTEL_PT_SHARED_FILTER_CACHE_SIZE	(1 << INTEL_PT_SHARED_FILTER_CACHE_BITS)
+
+static pthread_rwlock_t intel_pt_filter_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static u8 intel_pt_shared_filter_flags(struct intel_pt_queue *ptq, u64 ip) {
+	struct intel_pt *pt = ptq->pt;
+	struct intel_pt_filter_entry *e;
+	u16 gen = (u16)pt->filter_cache_gen;
+	u8 flags = 0;
+
+	if (!intel_pt_mt || !pt->shared_filter_cache)
+		return intel_pt_filter_ip_flags(ptq, ip);
+
+	e = &pt->shared_filter_cache[hash_64(ip ^ (u64)ptq->pid,
+					     INTEL_PT_SHARED_FILTER_CACHE_BITS)];
+	pthread_rwlock_rdlock(&intel_pt_filter_lock);
+	if (e->flags && e->ip == ip && e->pid == ptq->pid && e->gen == gen)
+		flags = e->flags;
+	pthread_rwlock_unlock(&intel_pt_filter_lock);
+	if (flags)
+		return flags;
+
+	flags = intel_pt_filter_ip_flags(ptq, ip);
+	pthread_rwlock_wrlock(&intel_pt_filter_lock);
+	e->ip = ip;
+	e->pid = ptq->pid;
+	e->gen = gen;
+	e->flags = flags;
+	pthread_rwlock_unlock(&intel_pt_filter_lock);
+	return flags;
+}
+
+static u8 intel_pt_filter_lookup(struct intel_pt_queue *ptq, u64 ip) {
+	struct intel_pt_filter_entry *e;
+	u16 gen = (u16)ptq->pt->filter_cache_gen;
+
+	if (unlikely(!ptq->filter_cache)) {
+		ptq->filter_cache = calloc(INTEL_PT_FILTER_CACHE_SIZE,
+					   sizeof(struct intel_pt_filter_entry));
+		if (!ptq->filter_cache)
+			return intel_pt_filter_ip_flags(ptq, ip);
+	}
+	e = &ptq->filter_cache[hash_64(ip, INTEL_PT_FILTER_CACHE_BITS)];
+	if (e->flags && e->ip == ip && e->pid == ptq->pid && e->gen == gen)
+		return e->flags;
+	e->ip = ip;
+	e->pid = ptq->pid;
+	e->gen = gen;
+	e->flags = intel_pt_shared_filter_flags(ptq, ip);
+	return e->flags;
 }
 
-static bool intel_pt_func_filter_by_sym(
-     struct addr_location *from_al,
-     struct addr_location *to_al,
-     struct intel_pt_queue *ptq) {
-	from_al->addr = to_al->addr = 0;
-	from_al->sym = to_al->sym = NULL;
-	intel_pt_parse_sym(ptq, ptq->state->from_ip, from_al);
-	intel_pt_parse_sym(ptq, ptq->state->to_ip, to_al);
-	if (intel_pt_is_target_func_name(from_al)
-		|| intel_pt_is_target_func_name(to_al)) {
-		return false;
-	} else if (to_al->addr && to_al->map && __map__is_kernel(to_al->map)) {
-		/* for schedule function of kernel */
-		if (intel_pt_is_schedule_func(from_al)
-				|| intel_pt_is_schedule_func(to_al)) {
-			return false;
-		}
-	}
-	return true;
+/*
+ * The extent nesting belongs to the thread, not to the queue: in per-cpu
+ * traces the thread may be switched out inside the target and resumed
+ * later, on this or another cpu. It is kept in the thread priv, which is
+ * not used otherwise by perf script.
+ */
+static unsigned int intel_pt_filter_extent_get(struct intel_pt_queue *ptq)
+{
+	if (ptq->thread)
+		return (uintptr_t)thread__priv(ptq->thread);
+	return ptq->filter_extent;
 }
 
-static bool intel_pt_func_filter_by_ip(
-     struct addr_location *from_al,
-     struct addr_location *to_al,
-     struct intel_pt_queue *ptq) {
-	from_al->addr = to_al->addr = 0;
-	intel_pt_parse_ip(ptq, ptq->state->from_ip, from_al);
-	intel_pt_parse_ip(ptq, ptq->state->to_ip, to_al);
+static void intel_pt_filter_extent_set(struct intel_pt_queue *ptq,
+				       unsigned int extent)
+{
+	if (ptq->thread)
+		thread__set_priv(ptq->thread, (void *)(uintptr_t)extent);
+	else
+		ptq->filter_extent = extent;
+}
 
-	if (intel_pt_is_target_func_ip(from_al) ||
-				intel_pt_is_target_func_ip(to_al)) {
-			return false;
-	} else if (to_al->addr && to_al->map && __map__is_kernel(to_al->map)) {
-		from_al->sym = to_al->sym = NULL;
-		intel_pt_parse_sym(ptq, ptq->state->from_ip, from_al);
-		intel_pt_parse_sym(ptq, ptq->state->to_ip, to_al);
-		/* for schedule function of kernel */
-		if (intel_pt_is_schedule_func(from_al)
-				|| intel_pt_is_schedule_func(to_al)) {
-			return false;
-		}
+/*
+ * Keep every branch between the call of a target function and its return,
+ * so that the whole call tree below the target is decoded. Recursive calls
+ * of target are counted, the extent ends at the return of the outermost one.
+ */
+static bool intel_pt_func_filter_extent(struct intel_pt_queue *ptq,
+					u8 from, u8 to, u8 target_flag) {
+	bool from_target = (from & target_flag) == target_flag;
+	bool to_target = (to & target_flag) == target_flag;
+	unsigned int extent = intel_pt_filter_extent_get(ptq);
+
+	if ((ptq->flags & PERF_IP_FLAG_CALL) && to_target) {
+		intel_pt_filter_extent_set(ptq, extent + 1);
+		return true;
 	}
+	if (!extent)
+		return false;
+	if ((ptq->flags & PERF_IP_FLAG_RETURN) && from_target)
+		intel_pt_filter_extent_set(ptq, extent - 1);
 	return true;
 }
 
+/* return true if the branch should be discarded */
+static bool intel_pt_func_filter(struct intel_pt_queue *ptq) {
+	u8 from = intel_pt_filter_lookup(ptq, ptq->state->from_ip);
+	u8 to = intel_pt_filter_lookup(ptq, ptq->state->to_ip);
+	u8 target_flag = INTEL_PT_FILTER_TARGET_SYM;
+
+	/* if symbols are found in the binary, both ip range and name must match */
+	if (fil_syms_size > 0)
+		target_flag |= INTEL_PT_FILTER_TARGET_IP;
+	if (opt_func_filter_extent &&
+	    intel_pt_func_filter_extent(ptq, from, to, target_flag))
+		return false;
+	/* for schedule function of kernel */
+	if ((to & INTEL_PT_FILTER_KERNEL) && ((from | to) & INTEL_PT_FILTER_SCHED))
+		return false;
+	return ((from | to) & target_flag) != target_flag;
+}
+
 static int intel_pt_synth_branch_sample_low(struct intel_pt_queue *ptq);
 static int intel_pt_synth_branch_sample(struct intel_pt_queue *ptq)
 {
@@ -1950,14 +2354,8 @@ static int intel_pt_synth_branch_sample(struct intel_pt_queue *ptq)
 	}
 
 	// function filter
-	if (strlen(func_filter_str) > 0) {
-		struct addr_location from_al, to_al;
-		if (fil_syms_size > 0 &&
-				intel_pt_func_filter_by_ip(&from_al, &to_al, ptq)) {
-			return 0;
-		} else if (intel_pt_func_filter_by_sym(&from_al, &to_al, ptq)){
-			return 0;
-		}
+	if (func_filter_num > 0 && intel_pt_func_filter(ptq)) {
+		return 0;
 	}
 	return intel_pt_synth_branch_sample_low(ptq);
 }
@@ -2712,7 +3110,9 @@ static int intel_pt_synth_error(struct intel_pt *pt, int code, int cpu,
 	if (code != INTEL_PT_ERR_LOST && dump_log_on_error)
 		intel_pt_log_dump_buf();
 
+	intel_pt_deliver_lock_acquire();
 	err = perf_session__deliver_synth_event(pt->session, &event, NULL);
+	intel_pt_deliver_lock_release();
 	if (err)
 		pr_err("Intel Processor Trace: failed to deliver error event, error %d\n",
 		       err);
@@ -2739,6 +3139,9 @@ static int intel_ptq_synth_error(struct intel_pt_queue *ptq,
 		tid = ptq->guest_tid;
 	}
 
+	/* the call nesting is unknown after the trace error */
+	intel_pt_filter_extent_set(ptq, 0);
+
 	return intel_pt_synth_error(pt, state->err, ptq->cpu, pid, tid,
 				    state->from_ip, tm, machine_pid, vcpu);
 }
@@ -3246,6 +3649,7 @@ static int intel_pt_process_queues(struct intel_pt *pt, u64 timestamp)
 			current_decode_cpu = ptq->cpu;
 			current_decode_tid = ptq->tid;
 		}
+		pt->decoder_runs++;
 		ret = intel_pt_run_decoder(ptq, &ts);
 
 		if (ret < 0) {
@@ -3265,6 +3669,243 @@ static int intel_pt_process_queues(struct intel_pt *pt, u64 timestamp)
 	return 0;
 }
 
+/*
+ * Unordered mode: decode each queue up to 'timestamp' in one go, without
+ * interleaving queues in global timestamp order. Only sideband events that
+ * change thread, comm or mmap state call this, 'cpu' limits the decoding
+ * to queues of that cpu for context switch events (-1 for all queues).
+ */
+static int intel_pt_process_queues_unordered(struct intel_pt *pt,
+					     u64 timestamp, int cpu)
+{
+	unsigned int i;
+	u64 ts;
+	int ret;
+
+	for (i = 0; i < pt->queues.nr_queues; i++) {
+		struct auxtrace_queue *queue = &pt->queues.queue_array[i];
+		struct intel_pt_queue *ptq = queue->priv;
+
+		if (!ptq || !ptq->on_heap || ptq->unordered_ts >= timestamp)
+			continue;
+		if (cpu != -1 && ptq->cpu != cpu)
+			continue;
+
+		intel_pt_log("queue %u processing 0x%" PRIx64 " to 0x%" PRIx64 " unordered\n",
+			     i, ptq->unordered_ts, timestamp);
+
+		ts = timestamp;
+		intel_pt_set_pid_tid_cpu(pt, queue);
+		current_decode_cpu = ptq->cpu;
+		current_decode_tid = ptq->tid;
+		pt->decoder_runs++;
+		ret = intel_pt_run_decoder(ptq, &ts);
+		if (ret < 0) {
+			ptq->unordered_ts = ts;
+			return ret;
+		}
+		if (!ret)
+			ptq->unordered_ts = ts;
+		else
+			ptq->on_heap = false;
+	}
+	return 0;
+}
+
+struct intel_pt_decode_thread {
+	pthread_t th;
+	struct intel_pt *pt;
+	u64 timestamp;
+	int idx;
+	int err;
+};
+
+/*
+ * Threaded mode: the queues are decoded by threads in segments, each segment
+ * ends at a sideband event that changes thread, comm or mmap state, which is
+ * processed after all threads are joined. A queue sticks to the thread that
+ * first decoded it, so its actions stay in order in one output file, named
+ * like the parallel workers' files.
+ */
+static int intel_pt_decode_thread_queue(struct intel_pt *pt, unsigned int i,
+					u64 timestamp)
+{
+	struct auxtrace_queue *queue = &pt->queues.queue_array[i];
+	struct intel_pt_queue *ptq = queue->priv;
+	u64 ts = timestamp;
+	int ret;
+
+	intel_pt_deliver_lock_acquire();
+	intel_pt_set_pid_tid_cpu(pt, queue);
+	intel_pt_deliver_lock_release();
+	current_decode_cpu = ptq->cpu;
+	current_decode_tid = ptq->tid;
+	__atomic_fetch_add(&pt->decoder_runs, 1, __ATOMIC_RELAXED);
+
+	ret = intel_pt_run_decoder(ptq, &ts);
+	if (ret < 0) {
+		ptq->unordered_ts = ts;
+		return ret;
+	}
+	if (!ret)
+		ptq->unordered_ts = ts;
+	else
+		ptq->on_heap = false;
+	return 0;
+}
+
+static bool intel_pt_queue_pending(struct auxtrace_queue *queue, u64 timestamp)
+{
+	struct intel_pt_queue *ptq = queue->priv;
+
+	return ptq && ptq->on_heap && ptq->unordered_ts < timestamp;
+}
+
+static void *intel_pt_decode_thread_fn(void *arg)
+{
+	struct intel_pt_decode_thread *t = arg;
+	struct intel_pt *pt = t->pt;
+	struct auxtrace_queue *queue;
+	struct intel_pt_queue *ptq;
+	unsigned int i;
+	int ret;
+
+	parallel_thread_fp = pt->thread_fps[t->idx];
+	output_symbol_state_load(&pt->thread_symbols[t->idx]);
+
+	/* queues owned by this thread from previous segments */
+	for (i = 0; i < pt->queues.nr_queues; i++) {
+		queue = &pt->queues.queue_array[i];
+		ptq = queue->priv;
+		if (!ptq || ptq->decode_thread != t->idx ||
+		    !intel_pt_queue_pending(queue, t->timestamp))
+			continue;
+		ret = intel_pt_decode_thread_queue(pt, i, t->timestamp);
+		if (ret < 0) {
+			t->err = ret;
+			goto out;
+		}
+	}
+
+	/* queues not decoded yet are taken from a shared index */
+	while ((i = __atomic_fetch_add(&pt->next_queue, 1, __ATOMIC_RELAXED)) <
+	       pt->queues.nr_queues) {
+		queue = &pt->queues.queue_array[i];
+		ptq = queue->priv;
+		if (!ptq || ptq->decode_thread != -1 ||
+		    !intel_pt_queue_pending(queue, t->timestamp))
+			continue;
+		ptq->decode_thread = t->idx;
+		ret = intel_pt_decode_thread_queue(pt, i, t->timestamp);
+		if (ret < 0) {
+			t->err = ret;
+			break;
+		}
+	}
+out:
+	output_symbol_state_save(&pt->thread_symbols[t->idx]);
+	fflush(parallel_thread_fp);
+	parallel_thread_fp = NULL;
+	return NULL;
+}
+
+static int intel_pt_open_thread_fps(struct intel_pt *pt)
+{
+	char file_name[256];
+	int i;
+
+	pt->thread_fps = calloc(parallel_threads, sizeof(FILE *));
+	pt->thread_symbols = calloc(parallel_threads,
+				    sizeof(struct output_symbol_state));
+	if (!pt->thread_fps || !pt->thread_symbols)
+		return -ENOMEM;
+	for (i = 0; i < parallel_threads; i++) {
+		if (opt_compact_format) {
+			pt->thread_symbols[i].cache = output_symbol_cache_new();
+			if (!pt->thread_symbols[i].cache)
+				return -ENOMEM;
+		}
+		snprintf(file_name, sizeof(file_name), "%s_%05d", parallel_prefix, i);
+		pt->thread_fps[i] = fopen(file_name, opt_compact_format ? "wb" : "w");
+		if (!pt->thread_fps[i]) {
+			pr_err("Intel PT: failed to open %s\n", file_name);
+			return -errno;
+		}
+	}
+	pt->shared_filter_cache = calloc(INTEL_PT_SHARED_FILTER_CACHE_SIZE,
+					 sizeof(struct intel_pt_filter_entry));
+	return 0;
+}
+
+static void intel_pt_close_thread_fps(struct intel_pt *pt)
+{
+	int i;
+
+	if (!pt->thread_fps)
+		return;
+	for (i = 0; i < parallel_threads; i++) {
+		if (pt->thread_fps[i])
+			fclose(pt->thread_fps[i]);
+		if (pt->thread_symbols && pt->thread_symbols[i].cache)
+			auxtrace_cache__free(pt->thread_symbols[i].cache);
+	}
+	zfree(&pt->thread_fps);
+	zfree(&pt->thread_symbols);
+	zfree(&pt->shared_filter_cache);
+}
+
+/*
+ * Decode all queues up to 'timestamp' with parallel_threads threads.
+ */
+static int intel_pt_process_queues_threaded(struct intel_pt *pt, u64 timestamp)
+{
+	struct intel_pt_decode_thread *threads;
+	int i, nr = parallel_threads, err = 0;
+	unsigned int q;
+
+	for (q = 0; q < pt->queues.nr_queues; q++) {
+		if (intel_pt_queue_pending(&pt->queues.queue_array[q], timestamp))
+			break;
+	}
+	if (q == pt->queues.nr_queues)
+		return 0;
+
+	if (!pt->thread_fps) {
+		err = intel_pt_open_thread_fps(pt);
+		if (err)
+			return err;
+	}
+
+	threads = calloc(nr, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	intel_pt_mt = true;
+	pt->next_queue = 0;
+	pt->threaded_segments++;
+	for (i = 0; i < nr; i++) {
+		threads[i].pt = pt;
+		threads[i].idx = i;
+		threads[i].timestamp = timestamp;
+		err = pthread_create(&threads[i].th, NULL,
+				     intel_pt_decode_thread_fn, &threads[i]);
+		if (err) {
+			pr_err("Intel PT: failed to create decoding thread\n");
+			nr = i;
+			err = -err;
+			break;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		pthread_join(threads[i].th, NULL);
+		if (threads[i].err && !err)
+			err = threads[i].err;
+	}
+	intel_pt_mt = false;
+	free(threads);
+	return err;
+}
+
 static int intel_pt_process_timeless_queues(struct intel_pt *pt, pid_t tid,
 					    u64 time_)
 {
@@ -3685,6 +4326,49 @@ static int intel_pt_process_event(struct perf_session *session,
 							       event->fork.tid,
 							       sample->time);
 		}
+	} else if (timestamp && pt->threaded) {
+		if (!pt->first_timestamp)
+			intel_pt_first_timestamp(pt, timestamp);
+		switch (event->header.type) {
+		case PERF_RECORD_MMAP:
+		case PERF_RECORD_MMAP2:
+		case PERF_RECORD_COMM:
+		case PERF_RECORD_EXIT:
+		case PERF_RECORD_TEXT_POKE:
+			/* decode the trace before the state change first */
+			err = intel_pt_process_queues_threaded(pt, timestamp);
+			break;
+		default:
+			break;
+		}
+	} else if (timestamp && pt->unordered) {
+		if (!pt->first_timestamp)
+			intel_pt_first_timestamp(pt, timestamp);
+		switch (event->header.type) {
+		case PERF_RECORD_MMAP:
+		case PERF_RECORD_MMAP2:
+		case PERF_RECORD_COMM:
+		case PERF_RECORD_EXIT:
+		case PERF_RECORD_TEXT_POKE:
+			/* thread, comm or mmap state changes for all queues */
+			err = intel_pt_process_queues_unordered(pt, timestamp, -1);
+			break;
+		case PERF_RECORD_SWITCH:
+		case PERF_RECORD_SWITCH_CPU_WIDE:
+		case PERF_RECORD_ITRACE_START:
+			/* current thread of this cpu changes */
+			if (pt->per_cpu_mmaps)
+				err = intel_pt_process_queues_unordered(pt,
+							timestamp, sample->cpu);
+			break;
+		case PERF_RECORD_SAMPLE:
+			if (pt->switch_evsel && pt->per_cpu_mmaps)
+				err = intel_pt_process_queues_unordered(pt,
+							timestamp, sample->cpu);
+			break;
+		default:
+			break;
+		}
 	} else if (timestamp) {
 		if (!pt->first_timestamp)
 			intel_pt_first_timestamp(pt, timestamp);
@@ -3693,6 +4377,13 @@ static int intel_pt_process_event(struct perf_session *session,
 	if (err)
 		return err;
 
+	/* maps of thread may be changed, invalidate the ip filter cache */
+	if (event->header.type == PERF_RECORD_MMAP ||
+	    event->header.type == PERF_RECORD_MMAP2 ||
+	    event->header.type == PERF_RECORD_COMM ||
+	    event->header.type == PERF_RECORD_EXIT)
+		pt->filter_cache_gen++;
+
 	if (event->header.type == PERF_RECORD_SAMPLE) {
 		if (pt->synth_opts.add_callchain && !sample->callchain)
 			intel_pt_add_callchain(pt, sample);
@@ -3753,6 +4444,20 @@ static int intel_pt_flush(struct perf_session *session, struct perf_tool *tool)
 		return intel_pt_process_timeless_queues(pt, -1,
 							MAX_TIMESTAMP - 1);
 
+	if (pt->threaded) {
+		ret = intel_pt_process_queues_threaded(pt, MAX_TIMESTAMP);
+		intel_pt_close_thread_fps(pt);
+		fprintf(stderr, "Intel PT threaded decoding: %d threads, %u queues, %u segments\n",
+			parallel_threads, pt->queues.nr_queues, pt->threaded_segments);
+		return ret;
+	}
+
+	if (pt->unordered) {
+		ret = intel_pt_process_queues_unordered(pt, MAX_TIMESTAMP, -1);
+		fprintf(stderr, "Intel PT unordered decoding: %" PRIu64 " decoder runs\n",
+			pt->decoder_runs);
+		return ret;
+	}
 	return intel_pt_process_queues(pt, MAX_TIMESTAMP);
 }
 
@@ -3778,6 +4483,7 @@ static void intel_pt_free(struct perf_session *session)
 
 	auxtrace_heap__free(&pt->heap);
 	intel_pt_free_events(session);
+	intel_pt_insn_cache_report(pt);
 	session->auxtrace = NULL;
 	intel_pt_free_vmcs_info(pt);
 	thread__put(pt->unknown_thread);
@@ -3785,6 +4491,7 @@ static void intel_pt_free(struct perf_session *session)
 	zfree(&pt->chain);
 	zfree(&pt->filter);
 	zfree(&pt->time_ranges);
+	intel_pt_close_thread_fps(pt);
 	free(pt);
 }
 
@@ -4270,6 +4977,29 @@ static int intel_pt_setup_time_ranges(struct intel_pt *pt,
 	return 0;
 }
 
+/* skip the buffers outside the envelope of the time ranges when queuing */
+static void intel_pt_set_ref_window(struct intel_pt *pt)
+{
+	u64 start = ULLONG_MAX, end = 0;
+	bool no_end = false;
+	unsigned int i;
+
+	if (!pt->range_cnt)
+		return;
+
+	for (i = 0; i < pt->range_cnt; i++) {
+		struct range *r = &pt->time_ranges[i];
+
+		start = min(start, r->start);
+		if (!r->end)
+			no_end = true;
+		else
+			end = max(end, r->end);
+	}
+	auxtrace_ref_start = start;
+	auxtrace_ref_end = no_end ? 0 : end;
+}
+
 static int intel_pt_parse_vm_tm_corr_arg(struct intel_pt *pt, char **args)
 {
 	struct intel_pt_vmcs_info *vmcs_info;
@@ -4428,6 +5158,7 @@ int intel_pt_process_auxtrace_info(union perf_event *event,
 
 	pt->session = session;
 	pt->machine = &session->machines.host; /* No kvm support */
+	pt->start_ns = rdclock();
 	pt->auxtrace_type = auxtrace_info->type;
 	pt->pmu_type = auxtrace_info->priv[INTEL_PT_PMU_TYPE];
 	pt->tc.time_shift = auxtrace_info->priv[INTEL_PT_TIME_SHIFT];
@@ -4510,6 +5241,25 @@ int intel_pt_process_auxtrace_info(union perf_event *event,
 	pt->timeless_decoding = intel_pt_timeless_decoding(pt);
 	if (pt->timeless_decoding && !pt->tc.time_mult)
 		pt->tc.time_mult = 1;
+	if (opt_unordered_queues && !pt->timeless_decoding) {
+		/*
+		 * Queues are not decoded in timestamp order, so the decoder
+		 * can not wait for switch events, use the current tid of cpu
+		 * set by the context switch barriers instead.
+		 */
+		pt->unordered = true;
+		pt->sync_switch_not_supported = true;
+	}
+	if (parallel_threads > 1 && !pt->timeless_decoding) {
+		if (pt->per_cpu_mmaps) {
+			/* the current tid of a cpu queue depends on sideband order */
+			pr_warning("Intel PT: --parallel_threads requires per-thread trace, ignored\n");
+		} else {
+			pt->threaded = true;
+			pt->unordered = false;
+			pt->sync_switch_not_supported = true;
+		}
+	}
 	pt->have_tsc = intel_pt_have_tsc(pt);
 	pt->sampling_mode = intel_pt_sampling_mode(pt);
 	pt->est_tsc = !pt->timeless_decoding;
@@ -4676,6 +5426,8 @@ int intel_pt_process_auxtrace_info(union perf_event *event,
 			   "         timestamps and the order of events may be incorrect.\n");
 	}
 
+	intel_pt_set_ref_window(pt);
+
 	if (pt->sampling_mode || list_empty(&session->auxtrace_index))
 		err = auxtrace_queue_data(session, true, true);
 	else